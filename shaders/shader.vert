@@ -1,20 +1,24 @@
 #version 450
 
-layout(location = 0) out vec3 fragColor;
+struct Instance {
+    mat4 model;
+    vec4 color;
+};
+
+layout(std430, set = 0, binding = 0) readonly buffer Instances {
+    Instance instances[];
+};
 
-vec2 positions[3] = vec2[](
-    vec2(0.0, -0.5),
-    vec2(0.5, 0.5),
-    vec2(-0.5, 0.5)
-);
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec3 inColor;
+
+layout(location = 0) out vec3 fragColor;
 
-vec3 colors[3] = vec3[](
-    vec3(1.0, 0.0, 0.0),
-    vec3(0.0, 1.0, 0.0),
-    vec3(0.0, 0.0, 1.0)
-);
+// The depth pre-pass runs this shader in another pipeline, the main pass tests for EQUAL depth against it
+invariant gl_Position;
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    fragColor = colors[gl_VertexIndex];
+    Instance instance = instances[gl_InstanceIndex];
+    gl_Position = instance.model * vec4(inPosition, 0.0, 1.0);
+    fragColor = inColor * instance.color.rgb;
 }
@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array_helper_macros.h"
+#include "config.h"
+#include "log.h"
+
+typedef enum {
+    OPTION_UINT,
+    OPTION_FLAG,
+    OPTION_STRING,
+    // One of a list of names, stored as the uint32_t index of the name
+    OPTION_ENUM,
+} option_type;
+
+typedef struct {
+    const char *name;
+    option_type type;
+    size_t offset;
+    uint32_t min;
+    uint32_t max;
+    const char *help;
+    const char *const *names;
+} config_option;
+
+#define FIELD(f) offsetof(renderer_config, f)
+
+// In gpu_memory_strategy order
+static const char *const MEMORY_STRATEGIES[] = { "tlsf", "buddy", "linear", NULL };
+// In the order of PRESENT_MODES in main.c
+static const char *const PRESENT_MODES[] = { "mailbox", "immediate", "fifo", "fifo-relaxed", NULL };
+// In vertex_layout order
+static const char *const VERTEX_LAYOUTS[] = { "interleaved", "deinterleaved", NULL };
+
+static const config_option OPTIONS[] = {
+    { "frames-in-flight", OPTION_UINT, FIELD(frames_in_flight), 1, MAX_FRAMES_IN_FLIGHT,
+      "Number of frames the CPU may record ahead of the GPU" },
+    { "width", OPTION_UINT, FIELD(width), 1, 16384, "Width of the window or of the headless render target" },
+    { "height", OPTION_UINT, FIELD(height), 1, 16384, "Height of the window or of the headless render target" },
+    { "threads", OPTION_UINT, FIELD(thread_count), 0, 64,
+      "Threads recording commands and updating instances, the main thread included (0: one per CPU)" },
+    { "frames", OPTION_UINT, FIELD(frame_count), 0, UINT32_MAX,
+      "Exit after rendering this many frames, required with --headless (0: never)" },
+    { "present-mode", OPTION_ENUM, FIELD(present_mode), 0, 0,
+      "How frames are queued for display, falls back to fifo when unsupported", PRESENT_MODES },
+    { "swapchain-images", OPTION_UINT, FIELD(swap_chain_images), 0, 16,
+      "Number of swap chain images, clamped to what the surface allows (0: one more than the minimum)" },
+    { "fps-limit", OPTION_UINT, FIELD(fps_limit), 0, 1000,
+      "Start frames at this rate at most, waiting before input is polled to keep latency low (0: unlimited)" },
+    { "headless", OPTION_FLAG, FIELD(headless), 0, 0, "Render offscreen without a window or surface" },
+    { "readback", OPTION_STRING, FIELD(readback_path), 0, 0,
+      "Save the last rendered frame to this PPM file, with --headless only" },
+    { "frame-stats", OPTION_STRING, FIELD(frame_stats_path), 0, 0,
+      "Export frame time statistics to this file on exit, as JSON if it ends in .json and CSV otherwise" },
+    { "sync-log", OPTION_FLAG, FIELD(sync_log), 0, 0,
+      "Write log messages on the calling thread instead of a background thread" },
+    { "pipeline-cache-dir", OPTION_STRING, FIELD(pipeline_cache_dir), 0, 0,
+      "Directory of the pipeline cache (default: $XDG_CACHE_HOME/vulkan_renderer)" },
+    { "no-pipeline-cache", OPTION_FLAG, FIELD(no_pipeline_cache), 0, 0, "Neither load nor save the pipeline cache" },
+    { "memory-strategy", OPTION_ENUM, FIELD(memory_strategy), 0, 0, "Default GPU memory sub-allocation strategy",
+      MEMORY_STRATEGIES },
+    { "memory-block-size", OPTION_UINT, FIELD(memory_block_size), 0, 4096,
+      "Size in MiB of the blocks resources are sub-allocated from, small heaps use an eighth of theirs (0: 64 MiB)" },
+    { "staging-size", OPTION_UINT, FIELD(staging_size), 1, 1024,
+      "Size in MiB of the upload ring feeding the transfer queue" },
+    { "instances", OPTION_UINT, FIELD(instance_count), 1, 1u << 24,
+      "Number of instances of the mesh, each with its own transform and color" },
+    { "instance-benchmark", OPTION_FLAG, FIELD(instance_benchmark), 0, 0,
+      "Report the frame time at every power of 4 instances up to --instances, then exit" },
+    { "gpu-culling", OPTION_FLAG, FIELD(gpu_culling), 0, 0,
+      "Frustum cull the instances on the GPU and draw the visible ones with an indirect draw count" },
+    { "depth-prepass", OPTION_FLAG, FIELD(depth_prepass), 0, 0,
+      "Draw the instances depth only first, then shade them with an EQUAL depth test and no overdraw" },
+    { "no-dynamic-rendering", OPTION_FLAG, FIELD(no_dynamic_rendering), 0, 0,
+      "Render with a render pass and framebuffers even where the device supports dynamic rendering" },
+    { "mesh-grid", OPTION_UINT, FIELD(mesh_grid), 0, 4096,
+      "Draw a grid of N x N quads instead of the triangle, 2N^2 triangles in total" },
+    { "vertex-layout", OPTION_ENUM, FIELD(vertex_layout), 0, 0, "Vertex buffer layout", VERTEX_LAYOUTS },
+    { "particles", OPTION_UINT, FIELD(particle_count), 0, 1u << 24,
+      "Particles simulated on the compute queue, overlapping the previous frame, and drawn as points (0: none)" },
+    { "render-scale-min", OPTION_UINT, FIELD(render_scale_min), 10, 100,
+      "Lowest render resolution in percent of the output the GPU budget may scale down to" },
+    { "render-scale-max", OPTION_UINT, FIELD(render_scale_max), 10, 100,
+      "Highest render resolution in percent of the output, the scene is upscaled to the output below 100" },
+    { "gpu-budget", OPTION_UINT, FIELD(gpu_budget_us), 0, 1000000,
+      "GPU frame time in microseconds to hold by scaling the render resolution (0: fixed at --render-scale-max)" },
+};
+
+void config_set_defaults(renderer_config *config)
+{
+    memset(config, 0, sizeof *config);
+    config->frames_in_flight = 2;
+    config->width = 800;
+    config->height = 600;
+    config->memory_block_size = 64;
+    config->staging_size = 32;
+    config->instance_count = 1;
+    config->render_scale_min = 50;
+    config->render_scale_max = 100;
+}
+
+static void print_usage(const char *program)
+{
+    printf("Usage: %s [options]\n\nOptions:\n", program);
+    for (size_t i = 0; i < LENGTH_OF(OPTIONS); i++) {
+        switch (OPTIONS[i].type) {
+        case OPTION_UINT:
+            printf("  --%s=<%u-%u>\n", OPTIONS[i].name, OPTIONS[i].min, OPTIONS[i].max);
+            break;
+        case OPTION_FLAG:
+            printf("  --%s\n", OPTIONS[i].name);
+            break;
+        case OPTION_STRING:
+            printf("  --%s=<string>\n", OPTIONS[i].name);
+            break;
+        case OPTION_ENUM:
+            printf("  --%s=", OPTIONS[i].name);
+            for (const char *const *name = OPTIONS[i].names; *name; name++)
+                printf("%s%s", name == OPTIONS[i].names ? "" : "|", *name);
+            printf("\n");
+            break;
+        }
+        printf("      %s\n", OPTIONS[i].help);
+    }
+    printf("  --help\n      Show this message\n");
+}
+
+static bool parse_uint(const config_option *option, const char *value, uint32_t *out)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (errno || end == value || *end != '\0' || parsed < option->min || parsed > option->max) {
+        log_error("Invalid value '%s' for --%s, expected %u-%u", value, option->name, option->min, option->max);
+        return false;
+    }
+    *out = (uint32_t) parsed;
+    return true;
+}
+
+static bool parse_enum(const config_option *option, const char *value, uint32_t *out)
+{
+    for (uint32_t i = 0; option->names[i]; i++) {
+        if (!strcmp(option->names[i], value)) {
+            *out = i;
+            return true;
+        }
+    }
+    log_error("Invalid value '%s' for --%s", value, option->name);
+    return false;
+}
+
+static bool apply_option(renderer_config *config, const config_option *option, const char *value)
+{
+    void *field = (char *) config + option->offset;
+
+    if (option->type == OPTION_FLAG) {
+        if (value) {
+            log_error("Option --%s does not take a value", option->name);
+            return false;
+        }
+        *(bool *) field = true;
+        return true;
+    }
+    if (!value) {
+        log_error("Option --%s expects a value", option->name);
+        return false;
+    }
+    switch (option->type) {
+    case OPTION_UINT:
+        return parse_uint(option, value, field);
+    case OPTION_STRING:
+        *(const char **) field = value;
+        return true;
+    case OPTION_ENUM:
+        return parse_enum(option, value, field);
+    case OPTION_FLAG:
+        break;
+    }
+    return false;
+}
+
+// Rejects the combinations of options that cannot do what was asked and warns about the ones that are adjusted
+static bool check_options(const renderer_config *config)
+{
+    if (config->headless && !config->frame_count && !config->instance_benchmark) {
+        log_error("--headless needs --frames, there is no window to close");
+        return false;
+    }
+    if (config->readback_path && !config->headless) {
+        log_error("--readback is only supported with --headless");
+        return false;
+    }
+    if (config->render_scale_min > config->render_scale_max)
+        log_warn(
+            "--render-scale-min=%u is above --render-scale-max=%u, using %u", config->render_scale_min,
+            config->render_scale_max, config->render_scale_max
+        );
+    return true;
+}
+
+config_status config_parse_args(renderer_config *config, int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) {
+            print_usage(argv[0]);
+            return CONFIG_HELP;
+        }
+        if (strncmp(arg, "--", 2) != 0) {
+            log_error("Unexpected argument: %s", arg);
+            return CONFIG_ERROR;
+        }
+        arg += 2;
+
+        const char *value = strchr(arg, '=');
+        size_t name_len = value ? (size_t) (value - arg) : strlen(arg);
+        if (value)
+            value++;
+
+        const config_option *option = NULL;
+        for (size_t y = 0; y < LENGTH_OF(OPTIONS); y++) {
+            if (strlen(OPTIONS[y].name) == name_len && !strncmp(OPTIONS[y].name, arg, name_len)) {
+                option = &OPTIONS[y];
+                break;
+            }
+        }
+        if (!option) {
+            log_error("Unknown option: %s", argv[i]);
+            return CONFIG_ERROR;
+        }
+        if (!apply_option(config, option, value))
+            return CONFIG_ERROR;
+    }
+    return check_options(config) ? CONFIG_RUN : CONFIG_ERROR;
+}
+
+__attribute__((const)) const char *config_present_mode_name(uint32_t present_mode)
+{
+    return PRESENT_MODES[present_mode];
+}
+
+void config_log(const renderer_config *config)
+{
+    for (size_t i = 0; i < LENGTH_OF(OPTIONS); i++) {
+        const void *field = (const char *) config + OPTIONS[i].offset;
+        switch (OPTIONS[i].type) {
+        case OPTION_UINT:
+            log_debug("config: %s=%u", OPTIONS[i].name, *(const uint32_t *) field);
+            break;
+        case OPTION_FLAG:
+            log_debug("config: %s=%s", OPTIONS[i].name, *(const bool *) field ? "true" : "false");
+            break;
+        case OPTION_STRING: {
+            const char *value = *(const char *const *) field;
+            log_debug("config: %s=%s", OPTIONS[i].name, value ? value : "(none)");
+            break;
+        }
+        case OPTION_ENUM:
+            log_debug("config: %s=%s", OPTIONS[i].name, OPTIONS[i].names[*(const uint32_t *) field]);
+            break;
+        }
+    }
+}
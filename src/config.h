@@ -0,0 +1,78 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Upper bound of the frame ring, the actual depth is picked at runtime
+#ifndef MAX_FRAMES_IN_FLIGHT
+#define MAX_FRAMES_IN_FLIGHT 8
+#endif
+
+typedef struct {
+    uint32_t frames_in_flight;
+    uint32_t width;
+    uint32_t height;
+    // Stop after this many frames, 0 runs until the window is closed
+    uint32_t frame_count;
+    // 0 picks one per online CPU
+    uint32_t thread_count;
+    // Index into the mode names of --present-mode, 0 is mailbox
+    uint32_t present_mode;
+    // 0 picks one more than the surface minimum
+    uint32_t swap_chain_images;
+    // 0 does not limit the frame rate
+    uint32_t fps_limit;
+    // Render to offscreen images without GLFW or a VkSurfaceKHR
+    bool headless;
+    // Write the last rendered frame to this file as a binary PPM
+    const char *readback_path;
+    const char *frame_stats_path;
+    // Log from the calling thread, slower but nothing is lost if the process crashes
+    bool sync_log;
+    // Where the pipeline cache lives, NULL for the XDG cache directory
+    const char *pipeline_cache_dir;
+    bool no_pipeline_cache;
+    // Index into the strategy names of --memory-strategy, 0 is TLSF
+    uint32_t memory_strategy;
+    // MiB, 0 uses the allocator default. Small heaps get blocks sized after them either way.
+    uint32_t memory_block_size;
+    // MiB
+    uint32_t staging_size;
+    uint32_t instance_count;
+    bool instance_benchmark;
+    // Cull the instances in a compute pass and draw the survivors indirectly
+    bool gpu_culling;
+    // Lay down depth first so that the main pass only shades the visible fragments
+    bool depth_prepass;
+    // Keep the VkRenderPass and framebuffers even where dynamic rendering is available
+    bool no_dynamic_rendering;
+    // Subdivisions of the generated grid mesh, 0 draws a single triangle
+    uint32_t mesh_grid;
+    // A vertex_layout
+    uint32_t vertex_layout;
+    // Simulated on the compute queue, 0 disables the simulation
+    uint32_t particle_count;
+    // Percent of the output resolution along each axis, the range the render scale may move in
+    uint32_t render_scale_min;
+    uint32_t render_scale_max;
+    // Microseconds of GPU time per frame the render scale is adjusted to hold, 0 renders at render_scale_max
+    uint32_t gpu_budget_us;
+} renderer_config;
+
+typedef enum {
+    CONFIG_RUN,
+    // --help was given and the usage printed
+    CONFIG_HELP,
+    // A bad option or combination of options, already logged
+    CONFIG_ERROR,
+} config_status;
+
+void config_set_defaults(renderer_config *config);
+// The program should only run on CONFIG_RUN
+config_status config_parse_args(renderer_config *config, int argc, char **argv);
+void config_log(const renderer_config *config);
+// As given to --present-mode
+__attribute__((const)) const char *config_present_mode_name(uint32_t present_mode);
+
+#endif
@@ -0,0 +1,321 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/frustum.h>
+
+#include "array_helper_macros.h"
+#include "culling.h"
+#include "log.h"
+#include "shader_code.h"
+
+// Must match local_size_x of cull.comp
+#define WORKGROUP_SIZE 256u
+
+// Must match the Cull push constants of cull.comp
+typedef struct {
+    vec4 planes[6];
+    vec4 sphere;
+    uint32_t count;
+    uint32_t index_count;
+} cull_constants;
+
+struct gpu_culler {
+    VkDevice device;
+    gpu_allocator *allocator;
+    uint32_t frames_in_flight;
+
+    VkBuffer draw_buffers[MAX_FRAMES_IN_FLIGHT];
+    gpu_allocation draw_memory[MAX_FRAMES_IN_FLIGHT];
+    VkBuffer count_buffers[MAX_FRAMES_IN_FLIGHT];
+    gpu_allocation count_memory[MAX_FRAMES_IN_FLIGHT];
+    // One counter per slot, copied from the count buffers
+    VkBuffer readback_buffer;
+    gpu_allocation readback_memory;
+    // Set once commands writing the counter of the slot have been recorded
+    bool recorded[MAX_FRAMES_IN_FLIGHT];
+    uint32_t visible_count;
+
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet sets[MAX_FRAMES_IN_FLIGHT];
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+};
+
+static VkResult create_buffers(gpu_culler *culler, uint32_t max_instances)
+{
+    VkBufferCreateInfo buffer_info = { 0 };
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    gpu_allocation_desc desc = { 0 };
+    desc.required_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+    for (uint32_t i = 0; i < culler->frames_in_flight; i++) {
+        buffer_info.size = (VkDeviceSize) max_instances * sizeof(VkDrawIndexedIndirectCommand);
+        buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+        VkResult result = gpu_memory_create_buffer(
+            culler->allocator, &buffer_info, &desc, &culler->draw_buffers[i], &culler->draw_memory[i]
+        );
+        if (result != VK_SUCCESS)
+            return result;
+
+        buffer_info.size = sizeof(uint32_t);
+        buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+                          | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        result = gpu_memory_create_buffer(
+            culler->allocator, &buffer_info, &desc, &culler->count_buffers[i], &culler->count_memory[i]
+        );
+        if (result != VK_SUCCESS)
+            return result;
+    }
+
+    buffer_info.size = culler->frames_in_flight * sizeof(uint32_t);
+    buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    // Uncached reads of write-combined memory are very slow on the CPU
+    desc.required_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    desc.preferred_flags = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+    return gpu_memory_create_buffer(
+        culler->allocator, &buffer_info, &desc, &culler->readback_buffer, &culler->readback_memory
+    );
+}
+
+// Set i reads the instances of slot i and writes the draws and counter of slot i
+static VkResult create_descriptor_sets(gpu_culler *culler, const VkBuffer *instance_buffers)
+{
+    VkDescriptorSetLayoutBinding bindings[3] = { 0 };
+    for (uint32_t i = 0; i < LENGTH_OF(bindings); i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    VkDescriptorSetLayoutCreateInfo layout_info = { 0 };
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = LENGTH_OF(bindings);
+    layout_info.pBindings = bindings;
+    VkResult result = vkCreateDescriptorSetLayout(culler->device, &layout_info, NULL, &culler->set_layout);
+    if (result != VK_SUCCESS)
+        return result;
+
+    VkDescriptorPoolSize pool_size = { 0 };
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = culler->frames_in_flight * LENGTH_OF(bindings);
+    VkDescriptorPoolCreateInfo pool_info = { 0 };
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = culler->frames_in_flight;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    result = vkCreateDescriptorPool(culler->device, &pool_info, NULL, &culler->descriptor_pool);
+    if (result != VK_SUCCESS)
+        return result;
+
+    VkDescriptorSetLayout layouts[MAX_FRAMES_IN_FLIGHT];
+    for (uint32_t i = 0; i < culler->frames_in_flight; i++)
+        layouts[i] = culler->set_layout;
+    VkDescriptorSetAllocateInfo set_info = { 0 };
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = culler->descriptor_pool;
+    set_info.descriptorSetCount = culler->frames_in_flight;
+    set_info.pSetLayouts = layouts;
+    result = vkAllocateDescriptorSets(culler->device, &set_info, culler->sets);
+    if (result != VK_SUCCESS)
+        return result;
+
+    for (uint32_t i = 0; i < culler->frames_in_flight; i++) {
+        VkDescriptorBufferInfo buffer_infos[3] = { 0 };
+        buffer_infos[0].buffer = instance_buffers[i];
+        buffer_infos[1].buffer = culler->draw_buffers[i];
+        buffer_infos[2].buffer = culler->count_buffers[i];
+        VkWriteDescriptorSet writes[3] = { 0 };
+        for (uint32_t y = 0; y < LENGTH_OF(writes); y++) {
+            buffer_infos[y].range = VK_WHOLE_SIZE;
+            writes[y].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[y].dstSet = culler->sets[i];
+            writes[y].dstBinding = y;
+            writes[y].descriptorCount = 1;
+            writes[y].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writes[y].pBufferInfo = &buffer_infos[y];
+        }
+        vkUpdateDescriptorSets(culler->device, LENGTH_OF(writes), writes, 0, NULL);
+    }
+    return VK_SUCCESS;
+}
+
+static VkResult create_pipeline(gpu_culler *culler, VkPipelineCache pipeline_cache)
+{
+    VkPushConstantRange push_range = { 0 };
+    push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_range.size = sizeof(cull_constants);
+    VkPipelineLayoutCreateInfo layout_info = { 0 };
+    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout_info.setLayoutCount = 1;
+    layout_info.pSetLayouts = &culler->set_layout;
+    layout_info.pushConstantRangeCount = 1;
+    layout_info.pPushConstantRanges = &push_range;
+    VkResult result = vkCreatePipelineLayout(culler->device, &layout_info, NULL, &culler->pipeline_layout);
+    if (result != VK_SUCCESS)
+        return result;
+
+    shader_code code;
+    if (!shader_code_load("cull_comp", &code))
+        return VK_ERROR_INITIALIZATION_FAILED;
+    VkShaderModuleCreateInfo module_info = { 0 };
+    module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    module_info.codeSize = code.size;
+    module_info.pCode = code.code;
+    VkShaderModule module = VK_NULL_HANDLE;
+    result = vkCreateShaderModule(culler->device, &module_info, NULL, &module);
+    shader_code_release(&code);
+    if (result != VK_SUCCESS)
+        return result;
+
+    VkComputePipelineCreateInfo pipeline_info = { 0 };
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = culler->pipeline_layout;
+    result = vkCreateComputePipelines(culler->device, pipeline_cache, 1, &pipeline_info, NULL, &culler->pipeline);
+    vkDestroyShaderModule(culler->device, module, NULL);
+    return result;
+}
+
+gpu_culler *culling_create(
+    VkDevice device, gpu_allocator *allocator, VkPipelineCache pipeline_cache, const VkBuffer *instance_buffers,
+    uint32_t max_instances, uint32_t frames_in_flight
+)
+{
+    gpu_culler *culler = calloc(1, sizeof *culler);
+    if (!culler)
+        return NULL;
+    culler->device = device;
+    culler->allocator = allocator;
+    culler->frames_in_flight = frames_in_flight;
+
+    VkResult result = create_buffers(culler, max_instances);
+    if (result != VK_SUCCESS)
+        goto fail;
+    result = create_descriptor_sets(culler, instance_buffers);
+    if (result != VK_SUCCESS)
+        goto fail;
+    result = create_pipeline(culler, pipeline_cache);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    log_debug("Created GPU culling for %u instances", max_instances);
+    return culler;
+
+fail:
+    log_error("Could not create GPU culling (%d)", result);
+    culling_destroy(culler);
+    return NULL;
+}
+
+void culling_destroy(gpu_culler *culler)
+{
+    if (!culler)
+        return;
+    vkDestroyPipeline(culler->device, culler->pipeline, NULL);
+    vkDestroyPipelineLayout(culler->device, culler->pipeline_layout, NULL);
+    vkDestroyDescriptorPool(culler->device, culler->descriptor_pool, NULL);
+    vkDestroyDescriptorSetLayout(culler->device, culler->set_layout, NULL);
+    for (uint32_t i = 0; i < culler->frames_in_flight; i++) {
+        if (culler->draw_buffers[i] != VK_NULL_HANDLE)
+            gpu_memory_destroy_buffer(culler->allocator, culler->draw_buffers[i], &culler->draw_memory[i]);
+        if (culler->count_buffers[i] != VK_NULL_HANDLE)
+            gpu_memory_destroy_buffer(culler->allocator, culler->count_buffers[i], &culler->count_memory[i]);
+    }
+    if (culler->readback_buffer != VK_NULL_HANDLE)
+        gpu_memory_destroy_buffer(culler->allocator, culler->readback_buffer, &culler->readback_memory);
+    free(culler);
+}
+
+static void cmd_buffer_barrier(
+    VkCommandBuffer command_buffer, VkBuffer buffer, VkPipelineStageFlags src_stages, VkAccessFlags src_access,
+    VkPipelineStageFlags dst_stages, VkAccessFlags dst_access
+)
+{
+    VkBufferMemoryBarrier barrier = { 0 };
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = src_access;
+    barrier.dstAccessMask = dst_access;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = buffer;
+    barrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(command_buffer, src_stages, dst_stages, 0, 0, NULL, 1, &barrier, 0, NULL);
+}
+
+void culling_cmd_cull(
+    gpu_culler *culler, VkCommandBuffer command_buffer, uint32_t slot, uint32_t instance_count, const gpu_mesh *mesh,
+    mat4 view_projection
+)
+{
+    if (culler->recorded[slot]) {
+        gpu_memory_invalidate(culler->allocator, &culler->readback_memory, 0, VK_WHOLE_SIZE);
+        memcpy(&culler->visible_count, (const uint32_t *) culler->readback_memory.mapped + slot, sizeof(uint32_t));
+    }
+    culler->recorded[slot] = true;
+
+    VkBuffer draws = culler->draw_buffers[slot];
+    VkBuffer count = culler->count_buffers[slot];
+    // The previous frame of the slot has completed, nothing still reads the counter being reset
+    vkCmdFillBuffer(command_buffer, count, 0, sizeof(uint32_t), 0);
+    cmd_buffer_barrier(
+        command_buffer, count, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+    );
+
+    // Extracted for a -1 to 1 depth range, which only makes the near plane a little more conservative
+    cull_constants constants = { 0 };
+    glm_frustum_planes(view_projection, constants.planes);
+    memcpy(constants.sphere, mesh->bounding_sphere, sizeof constants.sphere);
+    constants.count = instance_count;
+    constants.index_count = mesh->index_count;
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, culler->pipeline);
+    vkCmdBindDescriptorSets(
+        command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, culler->pipeline_layout, 0, 1, &culler->sets[slot], 0, NULL
+    );
+    vkCmdPushConstants(
+        command_buffer, culler->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof constants, &constants
+    );
+    vkCmdDispatch(command_buffer, (instance_count + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+
+    cmd_buffer_barrier(
+        command_buffer, draws, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+    );
+    cmd_buffer_barrier(
+        command_buffer, count, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT
+    );
+
+    VkBufferCopy region = { 0 };
+    region.dstOffset = slot * sizeof(uint32_t);
+    region.size = sizeof(uint32_t);
+    vkCmdCopyBuffer(command_buffer, count, culler->readback_buffer, 1, &region);
+    cmd_buffer_barrier(
+        command_buffer, culler->readback_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT
+    );
+}
+
+void culling_cmd_draw(
+    const gpu_culler *culler, VkCommandBuffer command_buffer, uint32_t slot, uint32_t instance_count,
+    const gpu_mesh *mesh
+)
+{
+    mesh_cmd_bind(command_buffer, mesh);
+    vkCmdDrawIndexedIndirectCount(
+        command_buffer, culler->draw_buffers[slot], 0, culler->count_buffers[slot], 0, instance_count,
+        sizeof(VkDrawIndexedIndirectCommand)
+    );
+}
+
+__attribute__((pure)) uint32_t culling_visible_count(const gpu_culler *culler)
+{
+    return culler->visible_count;
+}
@@ -0,0 +1,41 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include <cglm/mat4.h>
+
+#include "config.h"
+#include "gpu_memory.h"
+#include "mesh.h"
+
+// Frustum culling of the instances on the GPU. A compute pass tests the bounding sphere of every instance and
+// appends one VkDrawIndexedIndirectCommand per visible instance, drawn with vkCmdDrawIndexedIndirectCount so the CPU
+// records the same few commands whatever the instance count. Each frame slot has its own draws and counter, the
+// counter is copied to host memory and read when the slot comes around again, like the GPU profiler.
+typedef struct gpu_culler gpu_culler;
+
+// instance_buffers holds the instance buffer of every frame slot, each with room for max_instances
+gpu_culler *culling_create(
+    VkDevice device, gpu_allocator *allocator, VkPipelineCache pipeline_cache, const VkBuffer *instance_buffers,
+    uint32_t max_instances, uint32_t frames_in_flight
+);
+void culling_destroy(gpu_culler *culler);
+
+// Records the culling of instance_count instances of the slot, outside of a render pass. Reads the visible count of
+// the previous frame of the slot first, whose fence must have been waited on.
+void culling_cmd_cull(
+    gpu_culler *culler, VkCommandBuffer command_buffer, uint32_t slot, uint32_t instance_count, const gpu_mesh *mesh,
+    mat4 view_projection
+);
+// Binds the mesh and draws what culling_cmd_cull kept, the pipeline and descriptor set must already be bound
+void culling_cmd_draw(
+    const gpu_culler *culler, VkCommandBuffer command_buffer, uint32_t slot, uint32_t instance_count,
+    const gpu_mesh *mesh
+);
+
+// Of the last resolved frame, 0 before any
+__attribute__((pure)) uint32_t culling_visible_count(const gpu_culler *culler);
+
+#endif
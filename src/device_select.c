@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "array_helper_macros.h"
+#include "device_select.h"
+#include "log.h"
+
+// Score weights, the device type outweighs any amount of memory, which outweighs the queue topology
+#define TYPE_WEIGHT (1ull << 40)
+#define MEMORY_UNIT (1ull << 20)
+// Worth as much as 1 GiB of device local memory
+#define QUEUE_FAMILY_BONUS (1ull << 10)
+
+static void probe_queue_families(VkPhysicalDevice device, VkSurfaceKHR surface, device_caps *caps)
+{
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &caps->queue_family_count, NULL);
+    caps->queue_families = calloc(caps->queue_family_count, sizeof *caps->queue_families);
+    if (!caps->queue_families) {
+        caps->queue_family_count = 0;
+        return;
+    }
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &caps->queue_family_count, caps->queue_families);
+
+    caps->graphics_family = UINT32_MAX;
+    caps->present_family = UINT32_MAX;
+    caps->transfer_family = UINT32_MAX;
+    caps->compute_family = UINT32_MAX;
+    for (uint32_t i = 0; i < caps->queue_family_count; i++) {
+        VkQueueFlags flags = caps->queue_families[i].queueFlags;
+        VkBool32 present_support = VK_FALSE;
+        if (surface != VK_NULL_HANDLE)
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &present_support);
+
+        if ((flags & VK_QUEUE_GRAPHICS_BIT) && caps->graphics_family == UINT32_MAX)
+            caps->graphics_family = i;
+        // Presenting from the graphics family saves an ownership transfer, take it when it can
+        if (present_support && (caps->present_family == UINT32_MAX || i == caps->graphics_family))
+            caps->present_family = i;
+        // Transfer-only families map to the DMA engines, copies there run alongside rendering
+        if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))
+            && caps->transfer_family == UINT32_MAX)
+            caps->transfer_family = i;
+        if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT) && caps->compute_family == UINT32_MAX)
+            caps->compute_family = i;
+    }
+
+    if (caps->transfer_family == UINT32_MAX)
+        caps->transfer_family = caps->graphics_family;
+    if (caps->compute_family == UINT32_MAX)
+        caps->compute_family = caps->graphics_family;
+    // Nothing is ever presented in headless mode, keep everything on the graphics queue
+    if (surface == VK_NULL_HANDLE)
+        caps->present_family = caps->graphics_family;
+}
+
+static bool probe_extensions(device_caps *caps, const char *const *extensions, uint32_t extension_count)
+{
+    VkPhysicalDevice device = caps->device;
+    uint32_t available_count = 0;
+    vkEnumerateDeviceExtensionProperties(device, NULL, &available_count, NULL);
+    VkExtensionProperties *available = calloc(available_count, sizeof *available);
+    if (!available)
+        return false;
+    vkEnumerateDeviceExtensionProperties(device, NULL, &available_count, available);
+
+    bool all_found = true;
+    for (uint32_t i = 0; i < extension_count && all_found; i++) {
+        bool found = false;
+        for (uint32_t y = 0; y < available_count && !found; y++)
+            found = !strcmp(extensions[i], available[y].extensionName);
+        if (!found)
+            log_debug("%s is missing device extension %s", caps->properties.deviceName, extensions[i]);
+        all_found = found;
+    }
+    // Optional, and only looked at when the device is older than Vulkan 1.3
+    for (uint32_t y = 0; y < available_count && !caps->dynamic_rendering_extension; y++) {
+        const char *name = available[y].extensionName;
+        caps->dynamic_rendering_extension = !strcmp(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME, name);
+    }
+    free(available);
+    return all_found;
+}
+
+static void probe_surface(VkPhysicalDevice device, VkSurfaceKHR surface, device_caps *caps)
+{
+    vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &caps->surface_format_count, NULL);
+    caps->surface_formats = calloc(caps->surface_format_count, sizeof *caps->surface_formats);
+    if (!caps->surface_formats)
+        caps->surface_format_count = 0;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &caps->surface_format_count, caps->surface_formats);
+
+    vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &caps->present_mode_count, NULL);
+    caps->present_modes = calloc(caps->present_mode_count, sizeof *caps->present_modes);
+    if (!caps->present_modes)
+        caps->present_mode_count = 0;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &caps->present_mode_count, caps->present_modes);
+}
+
+// Nothing uses stencil, so formats without it come first, then by precision
+static const VkFormat DEPTH_FORMATS[] = {
+    VK_FORMAT_D32_SFLOAT,
+    VK_FORMAT_X8_D24_UNORM_PACK32,
+    VK_FORMAT_D24_UNORM_S8_UINT,
+    VK_FORMAT_D32_SFLOAT_S8_UINT,
+    VK_FORMAT_D16_UNORM,
+};
+
+static VkFormat probe_depth_format(VkPhysicalDevice device)
+{
+    for (uint32_t i = 0; i < LENGTH_OF(DEPTH_FORMATS); i++) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(device, DEPTH_FORMATS[i], &properties);
+        if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
+            return DEPTH_FORMATS[i];
+    }
+    return VK_FORMAT_UNDEFINED;
+}
+
+__attribute__((const)) static uint64_t type_rank(VkPhysicalDeviceType type)
+{
+    switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        return 4;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        return 3;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        return 2;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+void device_probe(
+    VkPhysicalDevice device, VkSurfaceKHR surface, const char *const *extensions, uint32_t extension_count,
+    device_caps *caps
+)
+{
+    memset(caps, 0, sizeof *caps);
+    caps->device = device;
+    vkGetPhysicalDeviceProperties(device, &caps->properties);
+    vkGetPhysicalDeviceMemoryProperties(device, &caps->memory_properties);
+    for (uint32_t i = 0; i < caps->memory_properties.memoryHeapCount; i++) {
+        if (caps->memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+            caps->device_local_size += caps->memory_properties.memoryHeaps[i].size;
+    }
+
+    probe_queue_families(device, surface, caps);
+    caps->depth_format = probe_depth_format(device);
+    caps->extensions_supported = probe_extensions(caps, extensions, extension_count);
+    if (surface != VK_NULL_HANDLE && caps->extensions_supported)
+        probe_surface(device, surface, caps);
+
+    if (caps->properties.apiVersion >= VK_API_VERSION_1_2) {
+        bool core_dynamic_rendering = caps->properties.apiVersion >= VK_API_VERSION_1_3;
+        VkPhysicalDeviceVulkan13Features features_13 = { 0 };
+        features_13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+        VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamic_rendering = { 0 };
+        dynamic_rendering.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+        VkPhysicalDeviceVulkan12Features features_12 = { 0 };
+        features_12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        if (core_dynamic_rendering)
+            features_12.pNext = &features_13;
+        else if (caps->dynamic_rendering_extension)
+            features_12.pNext = &dynamic_rendering;
+        VkPhysicalDeviceFeatures2 features = { 0 };
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features.pNext = &features_12;
+        vkGetPhysicalDeviceFeatures2(device, &features);
+        caps->timeline_semaphore = features_12.timelineSemaphore;
+        caps->draw_indirect_count = features_12.drawIndirectCount && features.features.multiDrawIndirect
+                                 && features.features.drawIndirectFirstInstance;
+        caps->dynamic_rendering = core_dynamic_rendering ? features_13.dynamicRendering
+                                                         : dynamic_rendering.dynamicRendering;
+        caps->dynamic_rendering_extension = caps->dynamic_rendering && !core_dynamic_rendering;
+    }
+
+    bool presentable = surface == VK_NULL_HANDLE
+        || (caps->present_family != UINT32_MAX && caps->surface_format_count && caps->present_mode_count);
+    caps->suitable = caps->graphics_family != UINT32_MAX && presentable && caps->extensions_supported
+                  && caps->timeline_semaphore && caps->depth_format != VK_FORMAT_UNDEFINED;
+
+    caps->score = type_rank(caps->properties.deviceType) * TYPE_WEIGHT + caps->device_local_size / MEMORY_UNIT;
+    if (caps->transfer_family != caps->graphics_family)
+        caps->score += QUEUE_FAMILY_BONUS;
+    if (caps->compute_family != caps->graphics_family)
+        caps->score += QUEUE_FAMILY_BONUS;
+}
+
+void device_caps_free(device_caps *caps)
+{
+    free(caps->queue_families);
+    free(caps->surface_formats);
+    free(caps->present_modes);
+    memset(caps, 0, sizeof *caps);
+}
+
+// Index of the device named by the override, UINT32_MAX when unset or matching nothing
+static uint32_t find_override(const device_caps *devices, uint32_t count)
+{
+    const char *name = getenv(DEVICE_OVERRIDE_ENV);
+    if (!name || !*name)
+        return UINT32_MAX;
+
+    char *end;
+    unsigned long index = strtoul(name, &end, 10);
+    if (*end == '\0' && index < count)
+        return (uint32_t) index;
+    for (uint32_t i = 0; i < count; i++) {
+        if (strstr(devices[i].properties.deviceName, name))
+            return i;
+    }
+    log_warn("%s=%s matches no device", DEVICE_OVERRIDE_ENV, name);
+    return UINT32_MAX;
+}
+
+bool device_select(
+    VkInstance instance, VkSurfaceKHR surface, const char *const *extensions, uint32_t extension_count,
+    device_caps *selected
+)
+{
+    uint32_t count = 0;
+    vkEnumeratePhysicalDevices(instance, &count, NULL);
+    VkPhysicalDevice *handles = calloc(count, sizeof *handles);
+    device_caps *devices = calloc(count, sizeof *devices);
+    if (!handles || !devices) {
+        free(handles);
+        free(devices);
+        return false;
+    }
+    vkEnumeratePhysicalDevices(instance, &count, handles);
+
+    uint32_t best = UINT32_MAX;
+    for (uint32_t i = 0; i < count; i++) {
+        device_probe(handles[i], surface, extensions, extension_count, &devices[i]);
+        log_debug(
+            "Device %u: %s, type %d, %lu MiB device local, score %lu%s", i, devices[i].properties.deviceName,
+            devices[i].properties.deviceType, devices[i].device_local_size >> 20, devices[i].score,
+            devices[i].suitable ? "" : ", unsuitable"
+        );
+        if (devices[i].suitable && (best == UINT32_MAX || devices[i].score > devices[best].score))
+            best = i;
+    }
+    free(handles);
+
+    uint32_t chosen = find_override(devices, count);
+    if (chosen != UINT32_MAX && !devices[chosen].suitable) {
+        log_warn("%s is not suitable, ignoring %s", devices[chosen].properties.deviceName, DEVICE_OVERRIDE_ENV);
+        chosen = UINT32_MAX;
+    }
+    if (chosen == UINT32_MAX)
+        chosen = best;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (i != chosen)
+            device_caps_free(&devices[i]);
+    }
+    if (chosen != UINT32_MAX) {
+        *selected = devices[chosen];
+        log_info("Using %s", selected->properties.deviceName);
+    }
+    free(devices);
+    return chosen != UINT32_MAX;
+}
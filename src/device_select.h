@@ -0,0 +1,61 @@
+#ifndef DEVICE_SELECT_H
+#define DEVICE_SELECT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+// Names a device to use instead of the best scored one, either its index in enumeration order or part of its name
+#define DEVICE_OVERRIDE_ENV "VULKAN_RENDERER_DEVICE"
+
+// Everything device selection and setup need to know about a physical device, queried once. Queue families are
+// UINT32_MAX when missing.
+typedef struct {
+    VkPhysicalDevice device;
+    VkPhysicalDeviceProperties properties;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    VkQueueFamilyProperties *queue_families;
+    uint32_t queue_family_count;
+    uint32_t graphics_family;
+    // The graphics family when it can present, and always without a surface
+    uint32_t present_family;
+    // A transfer-only family when there is one, the graphics family otherwise
+    uint32_t transfer_family;
+    // A family with compute but not graphics when there is one, the graphics family otherwise
+    uint32_t compute_family;
+    // Of the surface, empty without one
+    VkSurfaceFormatKHR *surface_formats;
+    uint32_t surface_format_count;
+    VkPresentModeKHR *present_modes;
+    uint32_t present_mode_count;
+    VkDeviceSize device_local_size;
+    // Best depth attachment format with optimal tiling, VK_FORMAT_UNDEFINED when there is none
+    VkFormat depth_format;
+    bool extensions_supported;
+    bool timeline_semaphore;
+    // Multi-draw indirect with a GPU written draw count and first instance, not required
+    bool draw_indirect_count;
+    // vkCmdBeginRendering, not required. Through VK_KHR_dynamic_rendering when dynamic_rendering_extension is set,
+    // which must then be enabled, and Vulkan 1.3 otherwise.
+    bool dynamic_rendering;
+    bool dynamic_rendering_extension;
+    bool suitable;
+    // Higher is better, only meaningful for suitable devices
+    uint64_t score;
+} device_caps;
+
+// surface may be VK_NULL_HANDLE for headless rendering, nothing is then required for presentation
+void device_probe(
+    VkPhysicalDevice device, VkSurfaceKHR surface, const char *const *extensions, uint32_t extension_count,
+    device_caps *caps
+);
+void device_caps_free(device_caps *caps);
+
+// Probes every device and keeps the best suitable one, or the one named by DEVICE_OVERRIDE_ENV when it is suitable.
+// Returns false when no device is.
+bool device_select(
+    VkInstance instance, VkSurfaceKHR surface, const char *const *extensions, uint32_t extension_count,
+    device_caps *selected
+);
+
+#endif
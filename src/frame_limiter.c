@@ -0,0 +1,42 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <time.h>
+
+#include "frame_limiter.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+void frame_limiter_init(frame_limiter *limiter, uint32_t fps)
+{
+    limiter->period_ns = fps ? 1000000000u / fps : 0;
+    limiter->deadline_ns = 0;
+}
+
+void frame_limiter_wait(frame_limiter *limiter)
+{
+    if (!limiter->period_ns)
+        return;
+
+    uint64_t now = now_ns();
+    if (now >= limiter->deadline_ns) {
+        limiter->deadline_ns = now + limiter->period_ns;
+        return;
+    }
+
+    if (limiter->deadline_ns - now > FRAME_LIMITER_SPIN_NS) {
+        uint64_t wake = limiter->deadline_ns - FRAME_LIMITER_SPIN_NS;
+        struct timespec until = { .tv_sec = (time_t) (wake / 1000000000u), .tv_nsec = (long) (wake % 1000000000u) };
+        // Only a signal interrupting the sleep is worth a retry, any other error would fail again right away
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+            ;
+    }
+    while (now_ns() < limiter->deadline_ns)
+        ;
+    limiter->deadline_ns += limiter->period_ns;
+}
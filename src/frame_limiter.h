@@ -0,0 +1,24 @@
+#ifndef FRAME_LIMITER_H
+#define FRAME_LIMITER_H
+
+#include <stdint.h>
+
+// Below this the rest of the wait spins, sleeps routinely overshoot by more than that
+#define FRAME_LIMITER_SPIN_NS 500000
+
+// Paces frame starts at a fixed period. Waiting before a frame rather than after presenting it means input is sampled
+// and the frame recorded as late as possible, so the limiter does not add queued frames to the latency.
+typedef struct {
+    // 0 disables the limiter
+    uint64_t period_ns;
+    // CLOCK_MONOTONIC time at which the next frame may start
+    uint64_t deadline_ns;
+} frame_limiter;
+
+// fps 0 never waits
+void frame_limiter_init(frame_limiter *limiter, uint32_t fps);
+// Blocks until the next frame may start. A frame that ran late moves the schedule instead of being caught up with a
+// burst of unpaced frames.
+void frame_limiter_wait(frame_limiter *limiter);
+
+#endif
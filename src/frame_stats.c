@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_stats.h"
+#include "log.h"
+
+// Frames in the window before stutters are counted, the mean is meaningless before that
+#define STUTTER_MIN_SAMPLES 16
+
+struct frame_stats {
+    double *samples;
+    uint32_t window;
+    // Next sample to overwrite
+    uint32_t head;
+    uint32_t sample_count;
+    double window_sum;
+    uint64_t frame_count;
+    uint64_t stutter_count;
+    uint64_t histogram[FRAME_STATS_BUCKET_COUNT];
+    // Scratch space for sorting the window
+    double *sorted;
+};
+
+frame_stats *frame_stats_create(uint32_t window)
+{
+    frame_stats *stats = calloc(1, sizeof *stats);
+    if (!stats)
+        return NULL;
+    stats->window = window;
+    stats->samples = calloc(window, sizeof *stats->samples);
+    stats->sorted = calloc(window, sizeof *stats->sorted);
+    if (!stats->samples || !stats->sorted) {
+        frame_stats_destroy(stats);
+        return NULL;
+    }
+    return stats;
+}
+
+void frame_stats_destroy(frame_stats *stats)
+{
+    if (!stats)
+        return;
+    free(stats->samples);
+    free(stats->sorted);
+    free(stats);
+}
+
+void frame_stats_add(frame_stats *stats, double ms)
+{
+    if (stats->sample_count >= STUTTER_MIN_SAMPLES
+        && ms > FRAME_STATS_STUTTER_FACTOR * stats->window_sum / stats->sample_count)
+        stats->stutter_count++;
+
+    if (stats->sample_count == stats->window)
+        stats->window_sum -= stats->samples[stats->head];
+    else
+        stats->sample_count++;
+    stats->samples[stats->head] = ms;
+    stats->window_sum += ms;
+    stats->head = (stats->head + 1) % stats->window;
+
+    uint32_t bucket = (uint32_t) (ms / FRAME_STATS_BUCKET_MS);
+    stats->histogram[bucket < FRAME_STATS_BUCKET_COUNT ? bucket : FRAME_STATS_BUCKET_COUNT - 1]++;
+    stats->frame_count++;
+}
+
+__attribute__((pure)) bool frame_stats_window_full(const frame_stats *stats)
+{
+    return stats->frame_count != 0 && stats->frame_count % stats->window == 0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank on the sorted window
+__attribute__((pure)) static double percentile(const double *sorted, uint32_t count, double p)
+{
+    uint32_t rank = (uint32_t) (p / 100.0 * (double) count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    return sorted[(rank > count ? count : rank) - 1];
+}
+
+void frame_stats_summarize(const frame_stats *stats, frame_stats_summary *summary)
+{
+    memset(summary, 0, sizeof *summary);
+    summary->frame_count = stats->frame_count;
+    summary->stutter_count = stats->stutter_count;
+    summary->window_count = stats->sample_count;
+    if (stats->sample_count == 0)
+        return;
+
+    memcpy(stats->sorted, stats->samples, stats->sample_count * sizeof *stats->sorted);
+    qsort(stats->sorted, stats->sample_count, sizeof *stats->sorted, compare_doubles);
+    summary->min = stats->sorted[0];
+    summary->max = stats->sorted[stats->sample_count - 1];
+    summary->mean = stats->window_sum / stats->sample_count;
+    summary->p50 = percentile(stats->sorted, stats->sample_count, 50.0);
+    summary->p95 = percentile(stats->sorted, stats->sample_count, 95.0);
+    summary->p99 = percentile(stats->sorted, stats->sample_count, 99.0);
+}
+
+void frame_stats_log(const frame_stats *stats)
+{
+    frame_stats_summary summary;
+    frame_stats_summarize(stats, &summary);
+    log_debug(
+        "Frame time over %u frames: min %.3f, mean %.3f, p50 %.3f, p95 %.3f, p99 %.3f, max %.3f ms, %lu stutters",
+        summary.window_count, summary.min, summary.mean, summary.p50, summary.p95, summary.p99, summary.max,
+        summary.stutter_count
+    );
+}
+
+// Oldest sample first
+__attribute__((pure)) static double window_sample(const frame_stats *stats, uint32_t i)
+{
+    uint32_t oldest = stats->sample_count == stats->window ? stats->head : 0;
+    return stats->samples[(oldest + i) % stats->window];
+}
+
+static void export_json(const frame_stats *stats, const frame_stats_summary *summary, FILE *file)
+{
+    fprintf(
+        file,
+        "{\n  \"frames\": %lu,\n  \"stutters\": %lu,\n  \"window\": %u,\n  \"min_ms\": %.4f,\n  \"mean_ms\": %.4f,\n"
+        "  \"p50_ms\": %.4f,\n  \"p95_ms\": %.4f,\n  \"p99_ms\": %.4f,\n  \"max_ms\": %.4f,\n",
+        summary->frame_count, summary->stutter_count, summary->window_count, summary->min, summary->mean,
+        summary->p50, summary->p95, summary->p99, summary->max
+    );
+    fprintf(file, "  \"histogram_bucket_ms\": %.2f,\n  \"histogram\": [", FRAME_STATS_BUCKET_MS);
+    for (uint32_t i = 0; i < FRAME_STATS_BUCKET_COUNT; i++)
+        fprintf(file, "%s%lu", i ? ", " : "", stats->histogram[i]);
+    fprintf(file, "],\n  \"samples_ms\": [");
+    for (uint32_t i = 0; i < stats->sample_count; i++)
+        fprintf(file, "%s%.4f", i ? ", " : "", window_sample(stats, i));
+    fprintf(file, "]\n}\n");
+}
+
+// Three sections separated by blank lines, each with its own header row
+static void export_csv(const frame_stats *stats, const frame_stats_summary *summary, FILE *file)
+{
+    fprintf(file, "frames,stutters,window,min_ms,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+    fprintf(
+        file, "%lu,%lu,%u,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n\n", summary->frame_count, summary->stutter_count,
+        summary->window_count, summary->min, summary->mean, summary->p50, summary->p95, summary->p99, summary->max
+    );
+    fprintf(file, "bucket_start_ms,frames\n");
+    for (uint32_t i = 0; i < FRAME_STATS_BUCKET_COUNT; i++)
+        fprintf(file, "%.2f,%lu\n", i * FRAME_STATS_BUCKET_MS, stats->histogram[i]);
+    fprintf(file, "\nsample,frame_ms\n");
+    for (uint32_t i = 0; i < stats->sample_count; i++)
+        fprintf(file, "%u,%.4f\n", i, window_sample(stats, i));
+}
+
+bool frame_stats_export(const frame_stats *stats, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        log_error("Could not open %s to export frame statistics", path);
+        return false;
+    }
+
+    frame_stats_summary summary;
+    frame_stats_summarize(stats, &summary);
+    size_t len = strlen(path);
+    if (len >= 5 && !strcmp(path + len - 5, ".json"))
+        export_json(stats, &summary, file);
+    else
+        export_csv(stats, &summary, file);
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0)
+        ok = false;
+    if (ok)
+        log_info("Exported frame statistics to %s", path);
+    else
+        log_error("Could not write frame statistics to %s", path);
+    return ok;
+}
@@ -0,0 +1,41 @@
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Histogram of every frame since creation, the last bucket also holds everything slower
+#define FRAME_STATS_BUCKET_MS 0.5
+#define FRAME_STATS_BUCKET_COUNT 80
+// A frame is a stutter when it takes this many times the mean of the window
+#define FRAME_STATS_STUTTER_FACTOR 2.0
+
+// Rolling window of CPU frame times plus whole-run histogram and stutter count
+typedef struct frame_stats frame_stats;
+
+// Percentiles are over the window, counts over the whole run
+typedef struct {
+    uint64_t frame_count;
+    uint64_t stutter_count;
+    uint32_t window_count;
+    double min;
+    double mean;
+    double p50;
+    double p95;
+    double p99;
+    double max;
+} frame_stats_summary;
+
+frame_stats *frame_stats_create(uint32_t window);
+void frame_stats_destroy(frame_stats *stats);
+
+void frame_stats_add(frame_stats *stats, double ms);
+// True every window frames, when a fresh summary is worth logging
+bool frame_stats_window_full(const frame_stats *stats);
+void frame_stats_summarize(const frame_stats *stats, frame_stats_summary *summary);
+void frame_stats_log(const frame_stats *stats);
+
+// Writes the summary, the histogram and the window samples, as JSON if path ends in .json and CSV otherwise
+bool frame_stats_export(const frame_stats *stats, const char *path);
+
+#endif
@@ -0,0 +1,983 @@
+#define _XOPEN_SOURCE 600
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpu_memory.h"
+#include "log.h"
+
+#define DEFAULT_BLOCK_SIZE (64ull << 20)
+// Heaps at most this big get blocks of an eighth of their size
+#define SMALL_HEAP_SIZE (1ull << 30)
+
+#define TLSF_SL_LOG2 5u
+#define TLSF_SL_COUNT (1u << TLSF_SL_LOG2)
+#define TLSF_MIN_SIZE_LOG2 4u
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + TLSF_MIN_SIZE_LOG2)
+#define TLSF_SMALL_SIZE (1ull << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (64u - TLSF_FL_SHIFT + 1u)
+
+#define BUDDY_MIN_SIZE (4ull << 10)
+#define BUDDY_MAX_LEVELS 32u
+
+typedef struct tlsf_node {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    struct tlsf_node *prev_phys;
+    struct tlsf_node *next_phys;
+    struct tlsf_node *prev_free;
+    struct tlsf_node *next_free;
+    bool is_free;
+} tlsf_node;
+
+typedef struct {
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[TLSF_FL_COUNT];
+    tlsf_node *free_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    // Lowest offset, the physical list covers the whole block
+    tlsf_node *first;
+} tlsf_state;
+
+enum {
+    BUDDY_UNUSED,
+    BUDDY_FREE,
+    BUDDY_SPLIT,
+    BUDDY_ALLOCATED,
+};
+
+// Nodes are stored as an implicit binary tree, node i has children 2i+1 and 2i+2
+typedef struct {
+    uint32_t levels;
+    uint8_t *state;
+    int32_t *free_next;
+    int32_t *free_prev;
+    int32_t free_heads[BUDDY_MAX_LEVELS];
+} buddy_state;
+
+typedef struct {
+    VkDeviceSize top;
+    gpu_resource_kind last_kind;
+} linear_state;
+
+struct gpu_memory_block {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    void *mapped;
+    gpu_memory_strategy strategy;
+    uint32_t memory_type;
+    uint32_t allocation_count;
+    VkDeviceSize used_bytes;
+    union {
+        tlsf_state tlsf;
+        buddy_state buddy;
+        linear_state linear;
+    };
+    gpu_memory_block *next;
+};
+
+struct gpu_allocator {
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    VkDeviceSize buffer_image_granularity;
+    VkDeviceSize non_coherent_atom_size;
+    uint32_t max_allocation_count;
+    uint32_t device_allocation_count;
+    VkDeviceSize block_size;
+    gpu_memory_strategy default_strategy;
+    gpu_memory_block *blocks[VK_MAX_MEMORY_TYPES][GPU_MEMORY_STRATEGY_COUNT];
+    uint32_t dedicated_count[VK_MAX_MEMORY_TYPES];
+    VkDeviceSize dedicated_bytes[VK_MAX_MEMORY_TYPES];
+    pthread_mutex_t lock;
+};
+
+static const char *const STRATEGY_NAMES[] = { "default", "tlsf", "buddy", "linear" };
+
+__attribute__((const)) static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return alignment > 1 ? (value + alignment - 1) / alignment * alignment : value;
+}
+
+__attribute__((const)) static uint32_t log2_floor(VkDeviceSize value)
+{
+    return 63u - (uint32_t) __builtin_clzll(value);
+}
+
+__attribute__((const)) const char *gpu_memory_strategy_name(gpu_memory_strategy strategy)
+{
+    return STRATEGY_NAMES[strategy];
+}
+
+// ============================== TLSF ===============================
+
+static void tlsf_mapping(VkDeviceSize size, uint32_t *fl, uint32_t *sl)
+{
+    if (size < TLSF_SMALL_SIZE) {
+        *fl = 0;
+        *sl = (uint32_t) (size >> TLSF_MIN_SIZE_LOG2);
+    } else {
+        uint32_t msb = log2_floor(size);
+        *fl = msb - TLSF_FL_SHIFT + 1;
+        *sl = (uint32_t) (size >> (msb - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+    }
+}
+
+// Rounds size up to the next class so that any free node of that class is big enough
+__attribute__((const)) static VkDeviceSize tlsf_round_up(VkDeviceSize size)
+{
+    if (size < TLSF_SMALL_SIZE)
+        return align_up(size, 1ull << TLSF_MIN_SIZE_LOG2);
+    return size + (1ull << (log2_floor(size) - TLSF_SL_LOG2)) - 1;
+}
+
+static void tlsf_insert_free(tlsf_state *tlsf, tlsf_node *node)
+{
+    uint32_t fl;
+    uint32_t sl;
+    tlsf_mapping(node->size, &fl, &sl);
+
+    node->is_free = true;
+    node->prev_free = NULL;
+    node->next_free = tlsf->free_lists[fl][sl];
+    if (node->next_free)
+        node->next_free->prev_free = node;
+    tlsf->free_lists[fl][sl] = node;
+    tlsf->fl_bitmap |= 1ull << fl;
+    tlsf->sl_bitmap[fl] |= 1u << sl;
+}
+
+static void tlsf_remove_free(tlsf_state *tlsf, tlsf_node *node)
+{
+    uint32_t fl;
+    uint32_t sl;
+    tlsf_mapping(node->size, &fl, &sl);
+
+    if (node->prev_free)
+        node->prev_free->next_free = node->next_free;
+    else
+        tlsf->free_lists[fl][sl] = node->next_free;
+    if (node->next_free)
+        node->next_free->prev_free = node->prev_free;
+    if (!tlsf->free_lists[fl][sl]) {
+        tlsf->sl_bitmap[fl] &= ~(1u << sl);
+        if (!tlsf->sl_bitmap[fl])
+            tlsf->fl_bitmap &= ~(1ull << fl);
+    }
+    node->is_free = false;
+}
+
+static tlsf_node *tlsf_find_free(tlsf_state *tlsf, VkDeviceSize size)
+{
+    uint32_t fl;
+    uint32_t sl;
+    tlsf_mapping(tlsf_round_up(size), &fl, &sl);
+    if (fl >= TLSF_FL_COUNT)
+        return NULL;
+
+    uint32_t sl_map = tlsf->sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint64_t fl_map = fl + 1 < 64 ? tlsf->fl_bitmap & (~0ull << (fl + 1)) : 0;
+        if (!fl_map)
+            return NULL;
+        fl = (uint32_t) __builtin_ctzll(fl_map);
+        sl_map = tlsf->sl_bitmap[fl];
+    }
+    sl = (uint32_t) __builtin_ctz(sl_map);
+    return tlsf->free_lists[fl][sl];
+}
+
+// Carves a new node of size bytes off the end of node, keeping the physical list in order
+static tlsf_node *tlsf_split(tlsf_node *node, VkDeviceSize size)
+{
+    tlsf_node *rest = calloc(1, sizeof *rest);
+    if (!rest)
+        return NULL;
+    rest->offset = node->offset + node->size - size;
+    rest->size = size;
+    rest->prev_phys = node;
+    rest->next_phys = node->next_phys;
+    if (node->next_phys)
+        node->next_phys->prev_phys = rest;
+    node->next_phys = rest;
+    node->size -= size;
+    return rest;
+}
+
+static bool tlsf_init(tlsf_state *tlsf, VkDeviceSize size)
+{
+    memset(tlsf, 0, sizeof *tlsf);
+    tlsf->first = calloc(1, sizeof *tlsf->first);
+    if (!tlsf->first)
+        return false;
+    tlsf->first->size = size;
+    tlsf_insert_free(tlsf, tlsf->first);
+    return true;
+}
+
+static void tlsf_destroy(tlsf_state *tlsf)
+{
+    for (tlsf_node *node = tlsf->first; node;) {
+        tlsf_node *next = node->next_phys;
+        free(node);
+        node = next;
+    }
+}
+
+static bool tlsf_alloc(
+    tlsf_state *tlsf, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset, tlsf_node **out
+)
+{
+    // Worst case padding is alignment - 1, asking for it up front keeps the search O(1)
+    tlsf_node *node = tlsf_find_free(tlsf, size + alignment - 1);
+    if (!node)
+        return false;
+    tlsf_remove_free(tlsf, node);
+
+    VkDeviceSize padding = align_up(node->offset, alignment) - node->offset;
+    if (padding) {
+        // The front padding becomes a free node of its own, its physical predecessor is never free
+        tlsf_node *aligned = tlsf_split(node, node->size - padding);
+        if (!aligned) {
+            tlsf_insert_free(tlsf, node);
+            return false;
+        }
+        tlsf_insert_free(tlsf, node);
+        node = aligned;
+    }
+    if (node->size - size >= TLSF_SMALL_SIZE) {
+        tlsf_node *rest = tlsf_split(node, node->size - size);
+        if (rest)
+            tlsf_insert_free(tlsf, rest);
+    }
+
+    *offset = node->offset;
+    *out = node;
+    return true;
+}
+
+static void tlsf_free(tlsf_state *tlsf, tlsf_node *node)
+{
+    tlsf_node *prev = node->prev_phys;
+    if (prev && prev->is_free) {
+        tlsf_remove_free(tlsf, prev);
+        prev->size += node->size;
+        prev->next_phys = node->next_phys;
+        if (node->next_phys)
+            node->next_phys->prev_phys = prev;
+        free(node);
+        node = prev;
+    }
+    tlsf_node *next = node->next_phys;
+    if (next && next->is_free) {
+        tlsf_remove_free(tlsf, next);
+        node->size += next->size;
+        node->next_phys = next->next_phys;
+        if (next->next_phys)
+            next->next_phys->prev_phys = node;
+        free(next);
+    }
+    tlsf_insert_free(tlsf, node);
+}
+
+static void tlsf_add_free_stats(const tlsf_state *tlsf, gpu_memory_stats *stats)
+{
+    for (const tlsf_node *node = tlsf->first; node; node = node->next_phys) {
+        if (!node->is_free)
+            continue;
+        stats->free_region_count++;
+        stats->free_bytes += node->size;
+        if (node->size > stats->largest_free_region)
+            stats->largest_free_region = node->size;
+    }
+}
+
+// ============================== BUDDY ==============================
+
+__attribute__((const)) static uint32_t buddy_level_of(uint32_t node)
+{
+    return log2_floor((VkDeviceSize) node + 1);
+}
+
+static void buddy_push_free(buddy_state *buddy, uint32_t node, uint32_t level)
+{
+    int32_t head = buddy->free_heads[level];
+    buddy->state[node] = BUDDY_FREE;
+    buddy->free_prev[node] = -1;
+    buddy->free_next[node] = head;
+    if (head >= 0)
+        buddy->free_prev[head] = (int32_t) node;
+    buddy->free_heads[level] = (int32_t) node;
+}
+
+static void buddy_remove_free(buddy_state *buddy, uint32_t node, uint32_t level)
+{
+    int32_t prev = buddy->free_prev[node];
+    int32_t next = buddy->free_next[node];
+    if (prev >= 0)
+        buddy->free_next[prev] = next;
+    else
+        buddy->free_heads[level] = next;
+    if (next >= 0)
+        buddy->free_prev[next] = prev;
+    buddy->state[node] = BUDDY_UNUSED;
+}
+
+static bool buddy_init(buddy_state *buddy, VkDeviceSize size)
+{
+    memset(buddy, 0, sizeof *buddy);
+    if (size < BUDDY_MIN_SIZE)
+        return false;
+    buddy->levels = log2_floor(size / BUDDY_MIN_SIZE) + 1;
+    if (buddy->levels > BUDDY_MAX_LEVELS)
+        return false;
+
+    size_t node_count = (1ull << buddy->levels) - 1;
+    buddy->state = calloc(node_count, sizeof *buddy->state);
+    buddy->free_next = calloc(node_count, sizeof *buddy->free_next);
+    buddy->free_prev = calloc(node_count, sizeof *buddy->free_prev);
+    if (!buddy->state || !buddy->free_next || !buddy->free_prev) {
+        free(buddy->state);
+        free(buddy->free_next);
+        free(buddy->free_prev);
+        return false;
+    }
+    for (uint32_t i = 0; i < BUDDY_MAX_LEVELS; i++)
+        buddy->free_heads[i] = -1;
+    buddy_push_free(buddy, 0, 0);
+    return true;
+}
+
+static void buddy_destroy(buddy_state *buddy)
+{
+    free(buddy->state);
+    free(buddy->free_next);
+    free(buddy->free_prev);
+}
+
+static bool buddy_alloc(
+    buddy_state *buddy, VkDeviceSize block_size, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset,
+    uint32_t *out
+)
+{
+    // Nodes are aligned to their own size, so alignment only ever raises the size
+    VkDeviceSize needed = size > alignment ? size : alignment;
+    if (needed < BUDDY_MIN_SIZE)
+        needed = BUDDY_MIN_SIZE;
+    if (needed > block_size)
+        return false;
+    uint32_t target = log2_floor(block_size) - log2_floor(needed);
+    if ((block_size >> target) < needed)
+        target--;
+
+    int32_t level = (int32_t) target;
+    while (level >= 0 && buddy->free_heads[level] < 0)
+        level--;
+    if (level < 0)
+        return false;
+
+    uint32_t node = (uint32_t) buddy->free_heads[level];
+    buddy_remove_free(buddy, node, (uint32_t) level);
+    for (; (uint32_t) level < target; level++) {
+        buddy->state[node] = BUDDY_SPLIT;
+        buddy_push_free(buddy, node * 2 + 2, (uint32_t) level + 1);
+        node = node * 2 + 1;
+    }
+    buddy->state[node] = BUDDY_ALLOCATED;
+
+    uint32_t first_of_level = (1u << target) - 1;
+    *offset = (VkDeviceSize) (node - first_of_level) * (block_size >> target);
+    *out = node;
+    return true;
+}
+
+static void buddy_free(buddy_state *buddy, uint32_t node)
+{
+    uint32_t level = buddy_level_of(node);
+    while (node > 0) {
+        uint32_t sibling = node & 1 ? node + 1 : node - 1;
+        if (buddy->state[sibling] != BUDDY_FREE)
+            break;
+        buddy_remove_free(buddy, sibling, level);
+        buddy->state[node] = BUDDY_UNUSED;
+        node = (node - 1) / 2;
+        level--;
+    }
+    buddy_push_free(buddy, node, level);
+}
+
+static void buddy_add_free_stats(const buddy_state *buddy, VkDeviceSize block_size, gpu_memory_stats *stats)
+{
+    for (uint32_t level = 0; level < buddy->levels; level++) {
+        for (int32_t node = buddy->free_heads[level]; node >= 0; node = buddy->free_next[node]) {
+            VkDeviceSize size = block_size >> level;
+            stats->free_region_count++;
+            stats->free_bytes += size;
+            if (size > stats->largest_free_region)
+                stats->largest_free_region = size;
+        }
+    }
+}
+
+// ============================== LINEAR =============================
+
+static bool linear_alloc(
+    linear_state *linear, VkDeviceSize block_size, VkDeviceSize granularity, VkDeviceSize size,
+    VkDeviceSize alignment, gpu_resource_kind kind, VkDeviceSize *offset
+)
+{
+    VkDeviceSize start = align_up(linear->top, alignment);
+    // Neighbours of a different kind must not share a granularity page
+    if (linear->top != 0 && linear->last_kind != kind)
+        start = align_up(start, granularity);
+    if (start + size > block_size)
+        return false;
+
+    linear->top = start + size;
+    linear->last_kind = kind;
+    *offset = start;
+    return true;
+}
+
+// ============================== BLOCKS =============================
+
+static uint32_t find_memory_type(
+    const gpu_allocator *allocator, uint32_t type_bits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred
+)
+{
+    uint32_t best = UINT32_MAX;
+    int best_score = -1;
+
+    for (uint32_t i = 0; i < allocator->memory_properties.memoryTypeCount; i++) {
+        VkMemoryPropertyFlags flags = allocator->memory_properties.memoryTypes[i].propertyFlags;
+        if (!(type_bits & (1u << i)) || (flags & required) != required)
+            continue;
+        int score = __builtin_popcount(flags & preferred);
+        if (score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static bool is_host_visible(const gpu_allocator *allocator, uint32_t memory_type)
+{
+    return allocator->memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+}
+
+static VkResult allocate_device_memory(
+    gpu_allocator *allocator, uint32_t memory_type, VkDeviceSize size, VkDeviceMemory *memory, void **mapped
+)
+{
+    if (allocator->device_allocation_count >= allocator->max_allocation_count)
+        return VK_ERROR_TOO_MANY_OBJECTS;
+
+    VkMemoryAllocateInfo alloc_info = { 0 };
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = size;
+    alloc_info.memoryTypeIndex = memory_type;
+    VkResult result = vkAllocateMemory(allocator->device, &alloc_info, NULL, memory);
+    if (result != VK_SUCCESS)
+        return result;
+
+    *mapped = NULL;
+    if (is_host_visible(allocator, memory_type)) {
+        result = vkMapMemory(allocator->device, *memory, 0, VK_WHOLE_SIZE, 0, mapped);
+        if (result != VK_SUCCESS) {
+            vkFreeMemory(allocator->device, *memory, NULL);
+            return result;
+        }
+    }
+    allocator->device_allocation_count++;
+    return VK_SUCCESS;
+}
+
+static void free_device_memory(gpu_allocator *allocator, VkDeviceMemory memory)
+{
+    vkFreeMemory(allocator->device, memory, NULL);
+    allocator->device_allocation_count--;
+}
+
+static VkDeviceSize preferred_block_size(const gpu_allocator *allocator, uint32_t memory_type)
+{
+    uint32_t heap = allocator->memory_properties.memoryTypes[memory_type].heapIndex;
+    VkDeviceSize heap_size = allocator->memory_properties.memoryHeaps[heap].size;
+    VkDeviceSize size = heap_size <= SMALL_HEAP_SIZE ? heap_size / 8 : allocator->block_size;
+    // Buddy trees need a power of two
+    return 1ull << log2_floor(size);
+}
+
+static gpu_memory_block *create_block(
+    gpu_allocator *allocator, uint32_t memory_type, gpu_memory_strategy strategy, VkDeviceSize size
+)
+{
+    gpu_memory_block *block = calloc(1, sizeof *block);
+    if (!block)
+        return NULL;
+    block->size = size;
+    block->strategy = strategy;
+    block->memory_type = memory_type;
+
+    bool ok = true;
+    switch (strategy) {
+    case GPU_MEMORY_STRATEGY_TLSF:
+        ok = tlsf_init(&block->tlsf, size);
+        break;
+    case GPU_MEMORY_STRATEGY_BUDDY:
+        ok = buddy_init(&block->buddy, size);
+        break;
+    case GPU_MEMORY_STRATEGY_LINEAR:
+    case GPU_MEMORY_STRATEGY_DEFAULT:
+    case GPU_MEMORY_STRATEGY_COUNT:
+        break;
+    }
+    if (!ok || allocate_device_memory(allocator, memory_type, size, &block->memory, &block->mapped) != VK_SUCCESS) {
+        if (ok && strategy == GPU_MEMORY_STRATEGY_TLSF)
+            tlsf_destroy(&block->tlsf);
+        if (ok && strategy == GPU_MEMORY_STRATEGY_BUDDY)
+            buddy_destroy(&block->buddy);
+        free(block);
+        return NULL;
+    }
+
+    block->next = allocator->blocks[memory_type][strategy];
+    allocator->blocks[memory_type][strategy] = block;
+    log_trace(
+        "Created %s block of %lu bytes in memory type %u", gpu_memory_strategy_name(strategy), size, memory_type
+    );
+    return block;
+}
+
+static void destroy_block(gpu_allocator *allocator, gpu_memory_block *block)
+{
+    switch (block->strategy) {
+    case GPU_MEMORY_STRATEGY_TLSF:
+        tlsf_destroy(&block->tlsf);
+        break;
+    case GPU_MEMORY_STRATEGY_BUDDY:
+        buddy_destroy(&block->buddy);
+        break;
+    case GPU_MEMORY_STRATEGY_LINEAR:
+    case GPU_MEMORY_STRATEGY_DEFAULT:
+    case GPU_MEMORY_STRATEGY_COUNT:
+        break;
+    }
+    free_device_memory(allocator, block->memory);
+    free(block);
+}
+
+static bool block_allocate(
+    gpu_allocator *allocator, gpu_memory_block *block, const VkMemoryRequirements *requirements,
+    gpu_resource_kind kind, gpu_allocation *allocation
+)
+{
+    VkDeviceSize size = requirements->size;
+    VkDeviceSize alignment = requirements->alignment ? requirements->alignment : 1;
+    VkDeviceSize offset = 0;
+    bool ok = false;
+
+    // Giving optimal images whole granularity pages means no linear resource can ever land next to them
+    if (kind == GPU_RESOURCE_OPTIMAL && block->strategy != GPU_MEMORY_STRATEGY_LINEAR
+        && allocator->buffer_image_granularity > 1) {
+        size = align_up(size, allocator->buffer_image_granularity);
+        if (alignment < allocator->buffer_image_granularity)
+            alignment = allocator->buffer_image_granularity;
+    }
+
+    switch (block->strategy) {
+    case GPU_MEMORY_STRATEGY_TLSF: {
+        tlsf_node *node = NULL;
+        ok = tlsf_alloc(&block->tlsf, size, alignment, &offset, &node);
+        allocation->node = node;
+        break;
+    }
+    case GPU_MEMORY_STRATEGY_BUDDY:
+        ok = buddy_alloc(&block->buddy, block->size, size, alignment, &offset, &allocation->node_index);
+        break;
+    case GPU_MEMORY_STRATEGY_LINEAR:
+        ok = linear_alloc(
+            &block->linear, block->size, allocator->buffer_image_granularity, size, alignment, kind, &offset
+        );
+        break;
+    case GPU_MEMORY_STRATEGY_DEFAULT:
+    case GPU_MEMORY_STRATEGY_COUNT:
+        break;
+    }
+    if (!ok)
+        return false;
+
+    block->allocation_count++;
+    block->used_bytes += requirements->size;
+    allocation->memory = block->memory;
+    allocation->offset = offset;
+    allocation->size = requirements->size;
+    allocation->mapped = block->mapped ? (char *) block->mapped + offset : NULL;
+    allocation->memory_type = block->memory_type;
+    allocation->block = block;
+    return true;
+}
+
+static void unlink_block(gpu_allocator *allocator, gpu_memory_block *block)
+{
+    gpu_memory_block **it = &allocator->blocks[block->memory_type][block->strategy];
+    while (*it != block)
+        it = &(*it)->next;
+    *it = block->next;
+}
+
+static void block_free(gpu_allocator *allocator, gpu_memory_block *block, const gpu_allocation *allocation)
+{
+    switch (block->strategy) {
+    case GPU_MEMORY_STRATEGY_TLSF:
+        tlsf_free(&block->tlsf, allocation->node);
+        break;
+    case GPU_MEMORY_STRATEGY_BUDDY:
+        buddy_free(&block->buddy, allocation->node_index);
+        break;
+    case GPU_MEMORY_STRATEGY_LINEAR:
+        // Freeing the most recent allocation rolls the top back, everything else waits for the block to empty
+        if (allocation->offset + allocation->size == block->linear.top)
+            block->linear.top = allocation->offset;
+        break;
+    case GPU_MEMORY_STRATEGY_DEFAULT:
+    case GPU_MEMORY_STRATEGY_COUNT:
+        break;
+    }
+    block->allocation_count--;
+    block->used_bytes -= allocation->size;
+    if (block->allocation_count != 0)
+        return;
+
+    if (block->strategy == GPU_MEMORY_STRATEGY_LINEAR)
+        block->linear.top = 0;
+    // Keep one empty block around per pool so that alloc/free patterns do not thrash vkAllocateMemory
+    if (allocator->blocks[block->memory_type][block->strategy] == block && !block->next)
+        return;
+    unlink_block(allocator, block);
+    destroy_block(allocator, block);
+}
+
+// ============================== PUBLIC =============================
+
+gpu_allocator *gpu_allocator_create(
+    VkPhysicalDevice physical_device, VkDevice device, gpu_memory_strategy default_strategy, VkDeviceSize block_size
+)
+{
+    gpu_allocator *allocator = calloc(1, sizeof *allocator);
+    if (!allocator)
+        return NULL;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &allocator->memory_properties);
+    allocator->device = device;
+    allocator->buffer_image_granularity = properties.limits.bufferImageGranularity;
+    allocator->non_coherent_atom_size = properties.limits.nonCoherentAtomSize;
+    allocator->max_allocation_count = properties.limits.maxMemoryAllocationCount;
+    allocator->block_size = block_size ? block_size : DEFAULT_BLOCK_SIZE;
+    allocator->default_strategy = default_strategy == GPU_MEMORY_STRATEGY_DEFAULT ? GPU_MEMORY_STRATEGY_TLSF
+                                                                                  : default_strategy;
+    pthread_mutex_init(&allocator->lock, NULL);
+
+    log_debug(
+        "GPU allocator: %s strategy, %lu MiB blocks, bufferImageGranularity %lu, maxMemoryAllocationCount %u",
+        gpu_memory_strategy_name(allocator->default_strategy), allocator->block_size >> 20,
+        allocator->buffer_image_granularity, allocator->max_allocation_count
+    );
+    return allocator;
+}
+
+void gpu_allocator_destroy(gpu_allocator *allocator)
+{
+    if (!allocator)
+        return;
+
+    for (uint32_t type = 0; type < VK_MAX_MEMORY_TYPES; type++) {
+        if (allocator->dedicated_count[type])
+            log_warn("%u dedicated allocations leaked in memory type %u", allocator->dedicated_count[type], type);
+        for (uint32_t strategy = 0; strategy < GPU_MEMORY_STRATEGY_COUNT; strategy++) {
+            gpu_memory_block *block = allocator->blocks[type][strategy];
+            while (block) {
+                gpu_memory_block *next = block->next;
+                if (block->allocation_count)
+                    log_warn("%u allocations leaked in memory type %u", block->allocation_count, type);
+                destroy_block(allocator, block);
+                block = next;
+            }
+        }
+    }
+    pthread_mutex_destroy(&allocator->lock);
+    free(allocator);
+}
+
+static VkResult allocate_dedicated(
+    gpu_allocator *allocator, uint32_t memory_type, const VkMemoryRequirements *requirements,
+    gpu_allocation *allocation
+)
+{
+    void *mapped = NULL;
+    VkResult result = allocate_device_memory(
+        allocator, memory_type, requirements->size, &allocation->memory, &mapped
+    );
+    if (result != VK_SUCCESS)
+        return result;
+
+    allocation->offset = 0;
+    allocation->size = requirements->size;
+    allocation->mapped = mapped;
+    allocation->memory_type = memory_type;
+    allocation->block = NULL;
+    allocator->dedicated_count[memory_type]++;
+    allocator->dedicated_bytes[memory_type] += requirements->size;
+    return VK_SUCCESS;
+}
+
+VkResult gpu_memory_allocate(
+    gpu_allocator *allocator, const VkMemoryRequirements *requirements, const gpu_allocation_desc *desc,
+    gpu_allocation *allocation
+)
+{
+    memset(allocation, 0, sizeof *allocation);
+    uint32_t memory_type = find_memory_type(
+        allocator, requirements->memoryTypeBits, desc->required_flags, desc->preferred_flags
+    );
+    if (memory_type == UINT32_MAX) {
+        log_error(
+            "No memory type in 0x%x has properties 0x%x", requirements->memoryTypeBits, desc->required_flags
+        );
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+    gpu_memory_strategy strategy = desc->strategy == GPU_MEMORY_STRATEGY_DEFAULT ? allocator->default_strategy
+                                                                                 : desc->strategy;
+    VkDeviceSize block_size = preferred_block_size(allocator, memory_type);
+
+    pthread_mutex_lock(&allocator->lock);
+    VkResult result = VK_SUCCESS;
+    // Large resources would mostly waste a shared block
+    if (desc->dedicated || requirements->size > block_size / 2) {
+        result = allocate_dedicated(allocator, memory_type, requirements, allocation);
+        goto out;
+    }
+
+    for (gpu_memory_block *block = allocator->blocks[memory_type][strategy]; block; block = block->next) {
+        if (block_allocate(allocator, block, requirements, desc->kind, allocation))
+            goto out;
+    }
+
+    // Retry smaller blocks when the heap is close to full before giving up on sub-allocation
+    for (VkDeviceSize size = block_size; size >= requirements->size * 2 && size >= BUDDY_MIN_SIZE; size /= 2) {
+        gpu_memory_block *block = create_block(allocator, memory_type, strategy, size);
+        if (block && block_allocate(allocator, block, requirements, desc->kind, allocation))
+            goto out;
+    }
+    result = allocate_dedicated(allocator, memory_type, requirements, allocation);
+
+out:
+    pthread_mutex_unlock(&allocator->lock);
+    if (result != VK_SUCCESS)
+        log_error("Could not allocate %lu bytes in memory type %u (%d)", requirements->size, memory_type, result);
+    return result;
+}
+
+void gpu_memory_free(gpu_allocator *allocator, gpu_allocation *allocation)
+{
+    if (allocation->memory == VK_NULL_HANDLE)
+        return;
+
+    pthread_mutex_lock(&allocator->lock);
+    if (allocation->block) {
+        block_free(allocator, allocation->block, allocation);
+    } else {
+        free_device_memory(allocator, allocation->memory);
+        allocator->dedicated_count[allocation->memory_type]--;
+        allocator->dedicated_bytes[allocation->memory_type] -= allocation->size;
+    }
+    pthread_mutex_unlock(&allocator->lock);
+    memset(allocation, 0, sizeof *allocation);
+}
+
+static void mapped_range(
+    const gpu_allocator *allocator, const gpu_allocation *allocation, VkDeviceSize offset, VkDeviceSize size,
+    VkMappedMemoryRange *range
+)
+{
+    VkDeviceSize atom = allocator->non_coherent_atom_size;
+    VkDeviceSize start = allocation->offset + offset;
+    VkDeviceSize end = allocation->offset + (size == VK_WHOLE_SIZE ? allocation->size : offset + size);
+
+    range->sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range->pNext = NULL;
+    range->memory = allocation->memory;
+    range->offset = start / atom * atom;
+    range->size = align_up(end, atom) - range->offset;
+    // The range may not reach past the end of the VkDeviceMemory
+    VkDeviceSize memory_size = allocation->block ? allocation->block->size : allocation->size;
+    if (range->offset + range->size > memory_size)
+        range->size = VK_WHOLE_SIZE;
+}
+
+void gpu_memory_flush(
+    gpu_allocator *allocator, const gpu_allocation *allocation, VkDeviceSize offset, VkDeviceSize size
+)
+{
+    VkMemoryPropertyFlags flags = allocator->memory_properties.memoryTypes[allocation->memory_type].propertyFlags;
+    if (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+        return;
+
+    VkMappedMemoryRange range;
+    mapped_range(allocator, allocation, offset, size, &range);
+    vkFlushMappedMemoryRanges(allocator->device, 1, &range);
+}
+
+void gpu_memory_invalidate(
+    gpu_allocator *allocator, const gpu_allocation *allocation, VkDeviceSize offset, VkDeviceSize size
+)
+{
+    VkMemoryPropertyFlags flags = allocator->memory_properties.memoryTypes[allocation->memory_type].propertyFlags;
+    if (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+        return;
+
+    VkMappedMemoryRange range;
+    mapped_range(allocator, allocation, offset, size, &range);
+    vkInvalidateMappedMemoryRanges(allocator->device, 1, &range);
+}
+
+VkResult gpu_memory_create_buffer(
+    gpu_allocator *allocator, const VkBufferCreateInfo *create_info, const gpu_allocation_desc *desc, VkBuffer *buffer,
+    gpu_allocation *allocation
+)
+{
+    VkResult result = vkCreateBuffer(allocator->device, create_info, NULL, buffer);
+    if (result != VK_SUCCESS)
+        return result;
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(allocator->device, *buffer, &requirements);
+    gpu_allocation_desc buffer_desc = *desc;
+    buffer_desc.kind = GPU_RESOURCE_LINEAR;
+    result = gpu_memory_allocate(allocator, &requirements, &buffer_desc, allocation);
+    if (result == VK_SUCCESS)
+        result = vkBindBufferMemory(allocator->device, *buffer, allocation->memory, allocation->offset);
+    if (result != VK_SUCCESS) {
+        gpu_memory_free(allocator, allocation);
+        vkDestroyBuffer(allocator->device, *buffer, NULL);
+        *buffer = VK_NULL_HANDLE;
+    }
+    return result;
+}
+
+void gpu_memory_destroy_buffer(gpu_allocator *allocator, VkBuffer buffer, gpu_allocation *allocation)
+{
+    vkDestroyBuffer(allocator->device, buffer, NULL);
+    gpu_memory_free(allocator, allocation);
+}
+
+VkResult gpu_memory_create_image(
+    gpu_allocator *allocator, const VkImageCreateInfo *create_info, const gpu_allocation_desc *desc, VkImage *image,
+    gpu_allocation *allocation
+)
+{
+    VkResult result = vkCreateImage(allocator->device, create_info, NULL, image);
+    if (result != VK_SUCCESS)
+        return result;
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(allocator->device, *image, &requirements);
+    gpu_allocation_desc image_desc = *desc;
+    image_desc.kind = create_info->tiling == VK_IMAGE_TILING_OPTIMAL ? GPU_RESOURCE_OPTIMAL : GPU_RESOURCE_LINEAR;
+    result = gpu_memory_allocate(allocator, &requirements, &image_desc, allocation);
+    if (result == VK_SUCCESS)
+        result = vkBindImageMemory(allocator->device, *image, allocation->memory, allocation->offset);
+    if (result != VK_SUCCESS) {
+        gpu_memory_free(allocator, allocation);
+        vkDestroyImage(allocator->device, *image, NULL);
+        *image = VK_NULL_HANDLE;
+    }
+    return result;
+}
+
+void gpu_memory_destroy_image(gpu_allocator *allocator, VkImage image, gpu_allocation *allocation)
+{
+    vkDestroyImage(allocator->device, image, NULL);
+    gpu_memory_free(allocator, allocation);
+}
+
+static void add_block_stats(const gpu_memory_block *block, gpu_memory_stats *stats)
+{
+    stats->block_count++;
+    stats->block_bytes += block->size;
+    stats->used_bytes += block->used_bytes;
+    stats->allocation_count += block->allocation_count;
+
+    switch (block->strategy) {
+    case GPU_MEMORY_STRATEGY_TLSF:
+        tlsf_add_free_stats(&block->tlsf, stats);
+        break;
+    case GPU_MEMORY_STRATEGY_BUDDY:
+        buddy_add_free_stats(&block->buddy, block->size, stats);
+        break;
+    case GPU_MEMORY_STRATEGY_LINEAR: {
+        // Holes below the top only come back once the block empties, they are not usable free space
+        VkDeviceSize free_bytes = block->size - block->linear.top;
+        stats->free_region_count += free_bytes != 0;
+        stats->free_bytes += free_bytes;
+        if (free_bytes > stats->largest_free_region)
+            stats->largest_free_region = free_bytes;
+        break;
+    }
+    case GPU_MEMORY_STRATEGY_DEFAULT:
+    case GPU_MEMORY_STRATEGY_COUNT:
+        break;
+    }
+}
+
+void gpu_memory_get_stats(gpu_allocator *allocator, uint32_t heap, gpu_memory_stats *stats)
+{
+    memset(stats, 0, sizeof *stats);
+
+    pthread_mutex_lock(&allocator->lock);
+    for (uint32_t type = 0; type < allocator->memory_properties.memoryTypeCount; type++) {
+        if (heap != UINT32_MAX && allocator->memory_properties.memoryTypes[type].heapIndex != heap)
+            continue;
+        stats->dedicated_allocation_count += allocator->dedicated_count[type];
+        stats->dedicated_bytes += allocator->dedicated_bytes[type];
+        for (uint32_t strategy = 0; strategy < GPU_MEMORY_STRATEGY_COUNT; strategy++) {
+            for (const gpu_memory_block *block = allocator->blocks[type][strategy]; block; block = block->next)
+                add_block_stats(block, stats);
+        }
+    }
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+__attribute__((pure)) float gpu_memory_fragmentation(const gpu_memory_stats *stats)
+{
+    if (stats->free_bytes == 0)
+        return 0.0f;
+    return 1.0f - (float) stats->largest_free_region / (float) stats->free_bytes;
+}
+
+void gpu_memory_log_stats(gpu_allocator *allocator)
+{
+    const double mib = 1024.0 * 1024.0;
+
+    for (uint32_t heap = 0; heap < allocator->memory_properties.memoryHeapCount; heap++) {
+        gpu_memory_stats stats;
+        gpu_memory_get_stats(allocator, heap, &stats);
+        if (stats.block_count == 0 && stats.dedicated_allocation_count == 0)
+            continue;
+        log_debug(
+            "heap %u: %u blocks of %.1f MiB total, %u allocations using %.1f MiB, %u dedicated using %.1f MiB", heap,
+            stats.block_count, (double) stats.block_bytes / mib, stats.allocation_count,
+            (double) stats.used_bytes / mib, stats.dedicated_allocation_count, (double) stats.dedicated_bytes / mib
+        );
+        log_debug(
+            "heap %u: %.1f MiB free in %u regions, largest %.1f MiB, fragmentation %.1f%%", heap,
+            (double) stats.free_bytes / mib, stats.free_region_count, (double) stats.largest_free_region / mib,
+            (double) gpu_memory_fragmentation(&stats) * 100.0
+        );
+    }
+    log_debug(
+        "%u of %u device memory allocations in use", allocator->device_allocation_count,
+        allocator->max_allocation_count
+    );
+}
@@ -0,0 +1,103 @@
+#ifndef GPU_MEMORY_H
+#define GPU_MEMORY_H
+
+#include <stdbool.h>
+#include <vulkan/vulkan.h>
+
+typedef enum {
+    // Whatever the allocator was created with
+    GPU_MEMORY_STRATEGY_DEFAULT,
+    // Two-level segregated fit, general purpose with O(1) allocation and free
+    GPU_MEMORY_STRATEGY_TLSF,
+    // Power of two buddies of at least BUDDY_MIN_SIZE, cheap merges for mid-sized resources
+    GPU_MEMORY_STRATEGY_BUDDY,
+    // Bump pointer, memory is only reclaimed once every allocation of a block is freed
+    GPU_MEMORY_STRATEGY_LINEAR,
+    GPU_MEMORY_STRATEGY_COUNT,
+} gpu_memory_strategy;
+
+typedef enum {
+    // Buffers and linearly tiled images
+    GPU_RESOURCE_LINEAR,
+    // Optimally tiled images, never share a bufferImageGranularity page with linear resources
+    GPU_RESOURCE_OPTIMAL,
+} gpu_resource_kind;
+
+typedef struct gpu_allocator gpu_allocator;
+typedef struct gpu_memory_block gpu_memory_block;
+
+typedef struct {
+    VkMemoryPropertyFlags required_flags;
+    // Picked over other memory types when available, e.g. HOST_CACHED for readbacks
+    VkMemoryPropertyFlags preferred_flags;
+    gpu_memory_strategy strategy;
+    gpu_resource_kind kind;
+    // Give the resource its own VkDeviceMemory
+    bool dedicated;
+} gpu_allocation_desc;
+
+typedef struct {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    // Persistently mapped pointer to offset, NULL unless the memory is host visible
+    void *mapped;
+    uint32_t memory_type;
+    // Bookkeeping of the owning block, NULL for dedicated allocations
+    gpu_memory_block *block;
+    void *node;
+    uint32_t node_index;
+} gpu_allocation;
+
+typedef struct {
+    uint32_t block_count;
+    uint32_t allocation_count;
+    uint32_t dedicated_allocation_count;
+    uint32_t free_region_count;
+    VkDeviceSize block_bytes;
+    VkDeviceSize used_bytes;
+    VkDeviceSize dedicated_bytes;
+    VkDeviceSize free_bytes;
+    VkDeviceSize largest_free_region;
+} gpu_memory_stats;
+
+// block_size of 0 uses 64 MiB. Heaps of 1 GiB or less get blocks of an eighth of their size whatever block_size is.
+gpu_allocator *gpu_allocator_create(
+    VkPhysicalDevice physical_device, VkDevice device, gpu_memory_strategy default_strategy, VkDeviceSize block_size
+);
+void gpu_allocator_destroy(gpu_allocator *allocator);
+
+VkResult gpu_memory_allocate(
+    gpu_allocator *allocator, const VkMemoryRequirements *requirements, const gpu_allocation_desc *desc,
+    gpu_allocation *allocation
+);
+void gpu_memory_free(gpu_allocator *allocator, gpu_allocation *allocation);
+// Makes host writes visible to the device, a no-op on coherent memory
+void gpu_memory_flush(
+    gpu_allocator *allocator, const gpu_allocation *allocation, VkDeviceSize offset, VkDeviceSize size
+);
+// Makes device writes visible to the host, a no-op on coherent memory
+void gpu_memory_invalidate(
+    gpu_allocator *allocator, const gpu_allocation *allocation, VkDeviceSize offset, VkDeviceSize size
+);
+
+VkResult gpu_memory_create_buffer(
+    gpu_allocator *allocator, const VkBufferCreateInfo *create_info, const gpu_allocation_desc *desc, VkBuffer *buffer,
+    gpu_allocation *allocation
+);
+void gpu_memory_destroy_buffer(gpu_allocator *allocator, VkBuffer buffer, gpu_allocation *allocation);
+VkResult gpu_memory_create_image(
+    gpu_allocator *allocator, const VkImageCreateInfo *create_info, const gpu_allocation_desc *desc, VkImage *image,
+    gpu_allocation *allocation
+);
+void gpu_memory_destroy_image(gpu_allocator *allocator, VkImage image, gpu_allocation *allocation);
+
+// heap of UINT32_MAX accumulates every heap
+void gpu_memory_get_stats(gpu_allocator *allocator, uint32_t heap, gpu_memory_stats *stats);
+// 0 when all free memory is one region, close to 1 when it is scattered in small pieces
+float gpu_memory_fragmentation(const gpu_memory_stats *stats);
+void gpu_memory_log_stats(gpu_allocator *allocator);
+
+const char *gpu_memory_strategy_name(gpu_memory_strategy strategy);
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpu_profiler.h"
+#include "log.h"
+
+#define QUERIES_PER_SLOT (GPU_PROFILER_MAX_SCOPES * 2)
+// Weight of the newest frame in the moving averages
+#define AVERAGE_WEIGHT 0.05
+
+typedef struct {
+    const char *names[GPU_PROFILER_MAX_SCOPES];
+    uint32_t scope_count;
+    // Set once commands using the queries have been recorded, a slot is never resolved before that
+    bool recorded;
+} profiler_slot;
+
+struct gpu_profiler {
+    VkDevice device;
+    VkQueryPool query_pool;
+    // Nanoseconds per tick
+    double timestamp_period;
+    uint64_t timestamp_mask;
+    uint32_t frames_in_flight;
+    profiler_slot slots[MAX_FRAMES_IN_FLIGHT];
+    uint32_t current_slot;
+    gpu_profiler_scope results[GPU_PROFILER_MAX_SCOPES];
+    uint32_t result_count;
+};
+
+gpu_profiler *gpu_profiler_create(
+    VkDevice device, float timestamp_period, uint32_t timestamp_valid_bits, uint32_t frames_in_flight
+)
+{
+    if (timestamp_valid_bits == 0 || timestamp_period == 0.0f) {
+        log_warn("The graphics queue family does not support timestamps, GPU timings are disabled");
+        return NULL;
+    }
+
+    gpu_profiler *profiler = calloc(1, sizeof *profiler);
+    if (!profiler)
+        return NULL;
+    profiler->device = device;
+    profiler->timestamp_period = timestamp_period;
+    profiler->timestamp_mask = timestamp_valid_bits >= 64 ? UINT64_MAX : (1ull << timestamp_valid_bits) - 1;
+    profiler->frames_in_flight = frames_in_flight;
+
+    VkQueryPoolCreateInfo pool_info = { 0 };
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount = QUERIES_PER_SLOT * frames_in_flight;
+    VkResult result = vkCreateQueryPool(device, &pool_info, NULL, &profiler->query_pool);
+    if (result != VK_SUCCESS) {
+        log_error("Could not create the timestamp query pool (%d)", result);
+        free(profiler);
+        return NULL;
+    }
+    log_debug("GPU profiler: %.3f ns per tick, %u valid bits", profiler->timestamp_period, timestamp_valid_bits);
+    return profiler;
+}
+
+void gpu_profiler_destroy(gpu_profiler *profiler)
+{
+    if (!profiler)
+        return;
+    vkDestroyQueryPool(profiler->device, profiler->query_pool, NULL);
+    free(profiler);
+}
+
+static bool resolve_slot(gpu_profiler *profiler, uint32_t slot_index)
+{
+    profiler_slot *slot = &profiler->slots[slot_index];
+    if (!slot->recorded || slot->scope_count == 0)
+        return false;
+
+    uint64_t timestamps[QUERIES_PER_SLOT];
+    // No WAIT bit, the frame fence already guarantees completion and a stall here would defeat the purpose
+    VkResult result = vkGetQueryPoolResults(
+        profiler->device, profiler->query_pool, slot_index * QUERIES_PER_SLOT, slot->scope_count * 2,
+        sizeof timestamps, timestamps, sizeof timestamps[0], VK_QUERY_RESULT_64_BIT
+    );
+    if (result != VK_SUCCESS)
+        return false;
+
+    for (uint32_t i = 0; i < slot->scope_count; i++) {
+        uint64_t ticks = (timestamps[i * 2 + 1] - timestamps[i * 2]) & profiler->timestamp_mask;
+        double ms = (double) ticks * profiler->timestamp_period / 1e6;
+        gpu_profiler_scope *scope = &profiler->results[i];
+        // Scopes usually come in the same order every frame, restart the average when they do not
+        if (i >= profiler->result_count || scope->name != slot->names[i])
+            scope->average_ms = ms;
+        else
+            scope->average_ms += (ms - scope->average_ms) * AVERAGE_WEIGHT;
+        scope->name = slot->names[i];
+        scope->ms = ms;
+    }
+    profiler->result_count = slot->scope_count;
+    return true;
+}
+
+bool gpu_profiler_begin_frame(gpu_profiler *profiler, VkCommandBuffer command_buffer, uint32_t slot)
+{
+    if (!profiler)
+        return false;
+
+    bool resolved = resolve_slot(profiler, slot);
+    profiler->current_slot = slot;
+    profiler->slots[slot].scope_count = 0;
+    profiler->slots[slot].recorded = true;
+    vkCmdResetQueryPool(command_buffer, profiler->query_pool, slot * QUERIES_PER_SLOT, QUERIES_PER_SLOT);
+    gpu_profiler_begin_scope(profiler, command_buffer, "frame");
+    return resolved;
+}
+
+void gpu_profiler_end_frame(gpu_profiler *profiler, VkCommandBuffer command_buffer)
+{
+    gpu_profiler_end_scope(profiler, command_buffer, 0);
+}
+
+uint32_t gpu_profiler_begin_scope(gpu_profiler *profiler, VkCommandBuffer command_buffer, const char *name)
+{
+    if (!profiler)
+        return 0;
+
+    profiler_slot *slot = &profiler->slots[profiler->current_slot];
+    if (slot->scope_count == GPU_PROFILER_MAX_SCOPES) {
+        log_once(LOG_WARN, "Too many GPU profiler scopes, ignoring %s and any further ones", name);
+        return UINT32_MAX;
+    }
+    uint32_t scope = slot->scope_count++;
+    slot->names[scope] = name;
+    vkCmdWriteTimestamp(
+        command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, profiler->query_pool,
+        profiler->current_slot * QUERIES_PER_SLOT + scope * 2
+    );
+    return scope;
+}
+
+void gpu_profiler_end_scope(gpu_profiler *profiler, VkCommandBuffer command_buffer, uint32_t scope)
+{
+    if (!profiler || scope == UINT32_MAX)
+        return;
+
+    vkCmdWriteTimestamp(
+        command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, profiler->query_pool,
+        profiler->current_slot * QUERIES_PER_SLOT + scope * 2 + 1
+    );
+}
+
+uint32_t gpu_profiler_results(const gpu_profiler *profiler, const gpu_profiler_scope **scopes)
+{
+    if (!profiler) {
+        *scopes = NULL;
+        return 0;
+    }
+    *scopes = profiler->results;
+    return profiler->result_count;
+}
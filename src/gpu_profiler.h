@@ -0,0 +1,46 @@
+#ifndef GPU_PROFILER_H
+#define GPU_PROFILER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "config.h"
+
+// Scopes per frame, the whole frame counts as one
+#define GPU_PROFILER_MAX_SCOPES 32
+
+// Timestamp queries around named scopes of the frame command buffers. Each frame slot has its own queries, which are
+// read back when the slot comes around again, after its fence has been waited on, so reading never stalls.
+typedef struct gpu_profiler gpu_profiler;
+
+typedef struct {
+    // Points to the string given to gpu_profiler_begin_scope
+    const char *name;
+    // Of the last resolved frame
+    double ms;
+    // Exponential moving average, smooths the per-frame jitter out of the logs
+    double average_ms;
+} gpu_profiler_scope;
+
+// timestamp_period comes from the device limits and timestamp_valid_bits from the queue family the frames are recorded
+// for. Returns NULL if that family cannot write timestamps.
+gpu_profiler *gpu_profiler_create(
+    VkDevice device, float timestamp_period, uint32_t timestamp_valid_bits, uint32_t frames_in_flight
+);
+void gpu_profiler_destroy(gpu_profiler *profiler);
+
+// Resolves the previous frame of the slot then resets its queries and opens the frame scope.
+// The slot's fence must have been waited on. Returns whether the results now hold that frame, they are left as they
+// were when the slot was never recorded or its queries were not available.
+bool gpu_profiler_begin_frame(gpu_profiler *profiler, VkCommandBuffer command_buffer, uint32_t slot);
+void gpu_profiler_end_frame(gpu_profiler *profiler, VkCommandBuffer command_buffer);
+
+// name must outlive the profiler, string literals are expected. Returns the scope to close.
+uint32_t gpu_profiler_begin_scope(gpu_profiler *profiler, VkCommandBuffer command_buffer, const char *name);
+void gpu_profiler_end_scope(gpu_profiler *profiler, VkCommandBuffer command_buffer, uint32_t scope);
+
+// Scopes of the last resolved frame, the first one is the whole frame. Returns the scope count.
+uint32_t gpu_profiler_results(const gpu_profiler *profiler, const gpu_profiler_scope **scopes);
+
+#endif
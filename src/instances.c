@@ -0,0 +1,84 @@
+#include <math.h>
+#include <string.h>
+
+#include "instances.h"
+
+// Cheap integer hash, gives every instance a stable phase, speed and color
+__attribute__((const)) static uint32_t hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+__attribute__((const)) static float unit(uint32_t bits)
+{
+    return (float) (bits & 0xffffu) / 65535.0f;
+}
+
+__attribute__((const)) static uint32_t grid_side(uint32_t total)
+{
+    return (uint32_t) ceilf(sqrtf((float) total));
+}
+
+scene_graph *instances_create_scene(uint32_t total)
+{
+    uint32_t side = grid_side(total);
+    uint32_t rows = side ? (total + side - 1) / side : 0;
+    float cell = 2.0f / (float) side;
+
+    scene_graph *scene = scene_create(rows + total);
+    if (!scene)
+        return NULL;
+    // Rows first so that the instances, all one level below, come after them in instance order
+    for (uint32_t row = 0; row < rows; row++) {
+        uint32_t node = scene_add(scene, SCENE_NO_PARENT);
+        scene_set_position(scene, node, (vec3) { 0.0f, -1.0f + cell * ((float) row + 0.5f), 0.0f });
+    }
+    for (uint32_t i = 0; i < total; i++) {
+        // Spread in depth so that the overlapping corners of neighbours are resolved by the depth test
+        float depth = 0.25f + 0.5f * unit(hash(i) >> 3);
+        uint32_t node = scene_add(scene, i / side);
+        scene_set_position(scene, node, (vec3) { -1.0f + cell * ((float) (i % side) + 0.5f), 0.0f, depth });
+        scene_set_scale(scene, node, (vec3) { cell, cell, 1.0f });
+    }
+    return scene;
+}
+
+void instances_animate(scene_graph *scene, uint32_t first, uint32_t count, uint32_t total, uint64_t frame)
+{
+    uint32_t side = grid_side(total);
+    uint32_t rows = side ? (total + side - 1) / side : 0;
+    float time = (float) (frame % 36000) / 60.0f;
+
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t h = hash(i);
+        float angle = time * (0.5f + unit(h)) + unit(h >> 16) * 6.2831853f;
+        versor rotation;
+        glm_quat(rotation, angle, 0.0f, 0.0f, 1.0f);
+        scene_set_rotation(scene, rows + i, rotation);
+    }
+}
+
+void instances_write(instance_data *dst, const scene_graph *scene, uint32_t first, uint32_t count, uint32_t total)
+{
+    uint32_t side = grid_side(total);
+    uint32_t rows = side ? (total + side - 1) / side : 0;
+    const mat4 *worlds = scene_world_matrices(scene);
+
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t h = hash(i);
+
+        // Built on the stack and copied whole, dst is usually write-combined memory
+        instance_data instance;
+        memcpy(instance.model, worlds[rows + i], sizeof instance.model);
+        instance.color[0] = 0.5f + 0.5f * unit(h >> 8);
+        instance.color[1] = 0.5f + 0.5f * unit(h >> 12);
+        instance.color[2] = 0.5f + 0.5f * unit(h >> 4);
+        instance.color[3] = 1.0f;
+        memcpy(&dst[i], &instance, sizeof instance);
+    }
+}
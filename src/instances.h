@@ -0,0 +1,26 @@
+#ifndef INSTANCES_H
+#define INSTANCES_H
+
+#include <stdint.h>
+
+#include <cglm/mat4.h>
+#include <cglm/vec4.h>
+
+#include "scene.h"
+
+// Matches the std430 Instance struct of shader.vert
+typedef struct {
+    mat4 model;
+    vec4 color;
+} instance_data;
+
+// Builds a total-sized square grid as a scene of one node per row, each the parent of the nodes of its instances
+scene_graph *instances_create_scene(uint32_t total);
+
+// Spins the instances [first, first + count) of the grid to frame.
+// Ranges are independent so that the animation can be split across threads.
+void instances_animate(scene_graph *scene, uint32_t first, uint32_t count, uint32_t total, uint64_t frame);
+// Writes the instances [first, first + count) of the grid from the world matrices of the updated scene
+void instances_write(instance_data *dst, const scene_graph *scene, uint32_t first, uint32_t count, uint32_t total);
+
+#endif
@@ -0,0 +1,282 @@
+#define _XOPEN_SOURCE 600
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "jobs.h"
+#include "log.h"
+
+// Power of two, a full deque runs new jobs inline instead of pushing them
+#define DEQUE_CAPACITY 4096u
+// Failed steal rounds before a worker goes to sleep
+#define IDLE_SPINS 64
+
+typedef struct {
+    atomic_uint remaining;
+} job_counter;
+
+typedef struct {
+    job_fn fn;
+    void *user;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t grain;
+    job_counter *counter;
+} job;
+
+// Chase-Lev deque, the owner pushes and pops at the bottom, thieves take from the top
+typedef struct {
+    _Alignas(64) atomic_size_t top;
+    _Alignas(64) atomic_size_t bottom;
+    job jobs[DEQUE_CAPACITY];
+} job_deque;
+
+typedef struct {
+    job_system *jobs;
+    uint32_t index;
+    pthread_t thread;
+} worker;
+
+struct job_system {
+    uint32_t thread_count;
+    job_deque *deques;
+    worker *workers;
+    atomic_bool quit;
+
+    // Jobs sitting in a deque, idle workers sleep while it is 0
+    atomic_uint queued;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+    uint32_t sleeping;
+};
+
+static _Thread_local uint32_t THREAD_INDEX = 0;
+
+static bool deque_push(job_deque *deque, const job *item)
+{
+    size_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    size_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= DEQUE_CAPACITY)
+        return false;
+    deque->jobs[bottom & (DEQUE_CAPACITY - 1)] = *item;
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+static bool deque_pop(job_deque *deque, job *item)
+{
+    size_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    if (bottom == 0)
+        return false;
+    bottom--;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+    *item = deque->jobs[bottom & (DEQUE_CAPACITY - 1)];
+    if (top != bottom)
+        return true;
+    // Last job, race the thieves for it
+    bool won = atomic_compare_exchange_strong_explicit(
+        &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed
+    );
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return won;
+}
+
+static bool deque_steal(job_deque *deque, job *item)
+{
+    size_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return false;
+    // The slot cannot be reused before top moves past it, so the copy is only kept if the CAS succeeds
+    *item = deque->jobs[top & (DEQUE_CAPACITY - 1)];
+    return atomic_compare_exchange_strong_explicit(
+        &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed
+    );
+}
+
+static void wake_workers(job_system *jobs)
+{
+    pthread_mutex_lock(&jobs->sleep_lock);
+    if (jobs->sleeping)
+        pthread_cond_broadcast(&jobs->wake);
+    pthread_mutex_unlock(&jobs->sleep_lock);
+}
+
+static void push_job(job_system *jobs, const job *item)
+{
+    atomic_fetch_add_explicit(&jobs->queued, 1, memory_order_release);
+    if (!deque_push(&jobs->deques[THREAD_INDEX], item)) {
+        atomic_fetch_sub_explicit(&jobs->queued, 1, memory_order_relaxed);
+        item->fn(item->user, item->begin, item->end, THREAD_INDEX);
+        atomic_fetch_sub_explicit(&item->counter->remaining, item->end - item->begin, memory_order_release);
+        return;
+    }
+    wake_workers(jobs);
+}
+
+static void run_job(job_system *jobs, job *item)
+{
+    // Hand the upper half of big ranges back to the deque so that idle threads can steal it
+    while (item->end - item->begin > item->grain) {
+        job upper = *item;
+        upper.begin = item->begin + (item->end - item->begin) / 2;
+        item->end = upper.begin;
+        push_job(jobs, &upper);
+    }
+    item->fn(item->user, item->begin, item->end, THREAD_INDEX);
+    atomic_fetch_sub_explicit(&item->counter->remaining, item->end - item->begin, memory_order_release);
+}
+
+static bool find_job(job_system *jobs, job *item, uint32_t *seed)
+{
+    if (deque_pop(&jobs->deques[THREAD_INDEX], item))
+        goto found;
+    for (uint32_t i = 0; i < jobs->thread_count; i++) {
+        // xorshift, a fixed victim order would make every thief hit the same deque
+        *seed ^= *seed << 13;
+        *seed ^= *seed >> 17;
+        *seed ^= *seed << 5;
+        uint32_t victim = *seed % jobs->thread_count;
+        if (victim != THREAD_INDEX && deque_steal(&jobs->deques[victim], item))
+            goto found;
+    }
+    return false;
+
+found:
+    atomic_fetch_sub_explicit(&jobs->queued, 1, memory_order_relaxed);
+    return true;
+}
+
+static void *worker_main(void *arg)
+{
+    worker *self = arg;
+    job_system *jobs = self->jobs;
+    THREAD_INDEX = self->index;
+    uint32_t seed = self->index * 0x9e3779b9u + 1;
+    uint32_t idle = 0;
+
+    while (!atomic_load_explicit(&jobs->quit, memory_order_acquire)) {
+        job item;
+        if (find_job(jobs, &item, &seed)) {
+            run_job(jobs, &item);
+            idle = 0;
+            continue;
+        }
+        if (++idle < IDLE_SPINS)
+            continue;
+
+        pthread_mutex_lock(&jobs->sleep_lock);
+        jobs->sleeping++;
+        while (!atomic_load_explicit(&jobs->queued, memory_order_acquire)
+               && !atomic_load_explicit(&jobs->quit, memory_order_acquire))
+            pthread_cond_wait(&jobs->wake, &jobs->sleep_lock);
+        jobs->sleeping--;
+        pthread_mutex_unlock(&jobs->sleep_lock);
+        idle = 0;
+    }
+    return NULL;
+}
+
+job_system *jobs_create(uint32_t thread_count)
+{
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (uint32_t) cpus : 1;
+    }
+    if (thread_count > JOBS_MAX_THREADS)
+        thread_count = JOBS_MAX_THREADS;
+
+    job_system *jobs = calloc(1, sizeof *jobs);
+    if (!jobs)
+        return NULL;
+    jobs->thread_count = thread_count;
+    jobs->deques = aligned_alloc(64, thread_count * sizeof *jobs->deques);
+    jobs->workers = calloc(thread_count, sizeof *jobs->workers);
+    if (!jobs->deques || !jobs->workers) {
+        free(jobs->deques);
+        free(jobs->workers);
+        free(jobs);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < thread_count; i++) {
+        atomic_init(&jobs->deques[i].top, 0);
+        atomic_init(&jobs->deques[i].bottom, 0);
+    }
+    atomic_init(&jobs->quit, false);
+    atomic_init(&jobs->queued, 0);
+    pthread_mutex_init(&jobs->sleep_lock, NULL);
+    pthread_cond_init(&jobs->wake, NULL);
+
+    THREAD_INDEX = 0;
+    for (uint32_t i = 1; i < thread_count; i++) {
+        jobs->workers[i].jobs = jobs;
+        jobs->workers[i].index = i;
+        if (pthread_create(&jobs->workers[i].thread, NULL, worker_main, &jobs->workers[i]) != 0) {
+            log_error("Could not start job worker %u, running with %u threads", i, i);
+            jobs->thread_count = i;
+            break;
+        }
+    }
+    log_debug("Started a job system with %u threads", jobs->thread_count);
+    return jobs;
+}
+
+void jobs_destroy(job_system *jobs)
+{
+    if (!jobs)
+        return;
+
+    atomic_store_explicit(&jobs->quit, true, memory_order_release);
+    pthread_mutex_lock(&jobs->sleep_lock);
+    pthread_cond_broadcast(&jobs->wake);
+    pthread_mutex_unlock(&jobs->sleep_lock);
+    for (uint32_t i = 1; i < jobs->thread_count; i++)
+        pthread_join(jobs->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&jobs->wake);
+    pthread_mutex_destroy(&jobs->sleep_lock);
+    free(jobs->deques);
+    free(jobs->workers);
+    free(jobs);
+}
+
+__attribute__((pure)) uint32_t jobs_thread_count(const job_system *jobs)
+{
+    return jobs->thread_count;
+}
+
+void jobs_parallel_for(job_system *jobs, job_fn fn, void *user, uint32_t count, uint32_t grain)
+{
+    if (count == 0)
+        return;
+
+    job_counter counter;
+    atomic_init(&counter.remaining, count);
+    job item = { 0 };
+    item.fn = fn;
+    item.user = user;
+    item.begin = 0;
+    item.end = count;
+    item.grain = grain ? grain : 1;
+    item.counter = &counter;
+    run_job(jobs, &item);
+
+    uint32_t seed = THREAD_INDEX * 0x9e3779b9u + 7;
+    while (atomic_load_explicit(&counter.remaining, memory_order_acquire)) {
+        job other;
+        // Other ranges may belong to an outer parallel_for, running them still makes progress
+        if (find_job(jobs, &other, &seed))
+            run_job(jobs, &other);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdint.h>
+
+// Upper bound of threads in a job system, the calling thread included
+#define JOBS_MAX_THREADS 64
+
+// Fixed pool of worker threads, each with its own deque of jobs. Threads pop from the bottom of their own deque and
+// steal from the top of a random other one when it runs dry.
+typedef struct job_system job_system;
+
+// Processes the items [begin, end), thread is the index of the running thread, 0 being the one that created the
+// system. Per-thread resources can be indexed by it.
+typedef void (*job_fn)(void *user, uint32_t begin, uint32_t end, uint32_t thread);
+
+// thread_count of 0 uses one thread per online CPU, the calling thread counts as one of them
+job_system *jobs_create(uint32_t thread_count);
+void jobs_destroy(job_system *jobs);
+uint32_t jobs_thread_count(const job_system *jobs);
+
+// Calls fn over [0, count) in ranges of at most grain items and returns once every range is done.
+// The calling thread runs jobs while it waits. May be called from inside a job.
+void jobs_parallel_for(job_system *jobs, job_fn fn, void *user, uint32_t count, uint32_t grain);
+
+#endif
@@ -20,9 +20,22 @@
  * IN THE SOFTWARE.
  */
 
+#define _XOPEN_SOURCE 600
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
 #include "log.h"
 
 #define MAX_CALLBACKS 32
+// Records written before the streams are flushed, bounds the delay while the ring never runs empty
+#define ASYNC_BATCH 256
+// Longest sleep of the writer thread, producers wake it earlier
+#define ASYNC_IDLE_NS 10000000L
 
 typedef struct {
     log_LogFn fn;
@@ -38,6 +51,32 @@ static struct {
     Callback callbacks[MAX_CALLBACKS];
 } L;
 
+typedef struct {
+    // Position in the ring while free, position + 1 once written
+    atomic_size_t sequence;
+    time_t time;
+    const char *file;
+    int line;
+    int level;
+    char message[LOG_ASYNC_MESSAGE_SIZE];
+} Record;
+
+// Bounded MPSC queue, producers claim positions with a CAS on head and the writer thread alone advances tail
+static struct {
+    Record *records;
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_ulong dropped;
+    atomic_bool running;
+    atomic_bool quit;
+    atomic_bool sleeping;
+    sem_t wake;
+    pthread_t thread;
+} A;
+
+// Set on the writer thread, whose callbacks leave flushing to the end of the batch
+static _Thread_local bool IN_WRITER = false;
+
 static const char *level_strings[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL" };
 
 #ifdef LOG_USE_COLOR
@@ -58,7 +97,8 @@ static void stdout_callback(log_Event *ev)
 #endif
     vfprintf(ev->udata, ev->fmt, ev->ap);
     fprintf(ev->udata, "\n");
-    fflush(ev->udata);
+    if (!IN_WRITER)
+        fflush(ev->udata);
 }
 
 static void file_callback(log_Event *ev)
@@ -68,7 +108,8 @@ static void file_callback(log_Event *ev)
     fprintf(ev->udata, "%s %-5s %s:%d: ", buf, level_strings[ev->level], ev->file, ev->line);
     vfprintf(ev->udata, ev->fmt, ev->ap);
     fprintf(ev->udata, "\n");
-    fflush(ev->udata);
+    if (!IN_WRITER)
+        fflush(ev->udata);
 }
 
 static void lock(void)
@@ -131,6 +172,253 @@ static void init_event(log_Event *ev, void *udata)
     ev->udata = udata;
 }
 
+static bool level_wanted(int level)
+{
+    if (!L.quiet && level >= L.level)
+        return true;
+    for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+        if (level >= L.callbacks[i].level)
+            return true;
+    }
+    return false;
+}
+
+static void wake_writer(void)
+{
+    // Pairs with the fence of the writer between announcing its sleep and looking at the ring one last time
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&A.sleeping, memory_order_relaxed)
+        && atomic_exchange_explicit(&A.sleeping, false, memory_order_relaxed))
+        sem_post(&A.wake);
+}
+
+static void enqueue(int level, const char *file, int line, const char *fmt, va_list ap)
+{
+    size_t pos = atomic_load_explicit(&A.head, memory_order_relaxed);
+    Record *record;
+    for (;;) {
+        record = &A.records[pos & (LOG_ASYNC_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &A.head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed
+                ))
+                break;
+        } else if (diff < 0) {
+            // The writer is a whole ring behind, waiting for it is what async mode avoids
+            atomic_fetch_add_explicit(&A.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&A.head, memory_order_relaxed);
+        }
+    }
+
+    record->time = time(NULL);
+    record->file = file;
+    record->line = line;
+    record->level = level;
+    vsnprintf(record->message, sizeof record->message, fmt, ap);
+    atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+    wake_writer();
+}
+
+__attribute__((format(printf, 3, 4))) static void dispatch(log_LogFn fn, log_Event *ev, const char *fmt, ...)
+{
+    ev->fmt = fmt;
+    va_start(ev->ap, fmt);
+    fn(ev);
+    va_end(ev->ap);
+}
+
+static void write_record(const Record *record, struct tm *time)
+{
+    log_Event ev = {
+        .file = record->file,
+        .time = time,
+        .line = record->line,
+        .level = record->level,
+    };
+    if (!L.quiet && record->level >= L.level) {
+        ev.udata = stderr;
+        dispatch(stdout_callback, &ev, "%s", record->message);
+    }
+    for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+        Callback *cb = &L.callbacks[i];
+        if (record->level >= cb->level) {
+            ev.udata = cb->udata;
+            dispatch(cb->fn, &ev, "%s", record->message);
+        }
+    }
+}
+
+static void flush_streams(void)
+{
+    fflush(stderr);
+    for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+        if (L.callbacks[i].fn == file_callback)
+            fflush(L.callbacks[i].udata);
+    }
+}
+
+// Writes up to ASYNC_BATCH records and returns how many there were
+static uint32_t write_batch(time_t *cached_time, struct tm *local_time, unsigned long *reported_drops)
+{
+    size_t tail = atomic_load_explicit(&A.tail, memory_order_relaxed);
+    uint32_t count = 0;
+
+    lock();
+    for (; count < ASYNC_BATCH; count++) {
+        Record *record = &A.records[tail & (LOG_ASYNC_CAPACITY - 1)];
+        if (atomic_load_explicit(&record->sequence, memory_order_acquire) != tail + 1)
+            break;
+        // localtime_r takes a lock of its own, seconds rarely change within a batch
+        if (record->time != *cached_time) {
+            *cached_time = record->time;
+            localtime_r(cached_time, local_time);
+        }
+        write_record(record, local_time);
+        atomic_store_explicit(&record->sequence, tail + LOG_ASYNC_CAPACITY, memory_order_release);
+        tail++;
+        atomic_store_explicit(&A.tail, tail, memory_order_release);
+    }
+
+    unsigned long dropped = atomic_load_explicit(&A.dropped, memory_order_relaxed);
+    if (dropped != *reported_drops) {
+        Record note = { .time = time(NULL), .file = __FILE__, .line = __LINE__, .level = LOG_WARN };
+        snprintf(
+            note.message, sizeof note.message, "Dropped %lu log messages, the ring was full",
+            dropped - *reported_drops
+        );
+        *reported_drops = dropped;
+        localtime_r(&note.time, local_time);
+        *cached_time = note.time;
+        write_record(&note, local_time);
+    }
+    if (count)
+        flush_streams();
+    unlock();
+    return count;
+}
+
+static bool ring_empty(void)
+{
+    size_t tail = atomic_load_explicit(&A.tail, memory_order_relaxed);
+    const Record *record = &A.records[tail & (LOG_ASYNC_CAPACITY - 1)];
+    return atomic_load_explicit(&record->sequence, memory_order_acquire) != tail + 1;
+}
+
+static void *writer_main(void *arg)
+{
+    (void) arg;
+    IN_WRITER = true;
+    time_t cached_time = (time_t) -1;
+    struct tm local_time;
+    unsigned long reported_drops = 0;
+
+    for (;;) {
+        if (write_batch(&cached_time, &local_time, &reported_drops))
+            continue;
+        if (atomic_load_explicit(&A.quit, memory_order_acquire) && ring_empty())
+            break;
+
+        atomic_store_explicit(&A.sleeping, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ring_empty() && !atomic_load_explicit(&A.quit, memory_order_acquire)) {
+            // Timed so that a wake up lost to a producer dying between its write and its post costs little
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += ASYNC_IDLE_NS;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            sem_timedwait(&A.wake, &deadline);
+        }
+        atomic_store_explicit(&A.sleeping, false, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+int log_start_async(void)
+{
+    if (atomic_load_explicit(&A.running, memory_order_acquire))
+        return 0;
+
+    A.records = calloc(LOG_ASYNC_CAPACITY, sizeof *A.records);
+    if (!A.records)
+        return -1;
+    for (size_t i = 0; i < LOG_ASYNC_CAPACITY; i++)
+        atomic_init(&A.records[i].sequence, i);
+    atomic_init(&A.head, 0);
+    atomic_init(&A.tail, 0);
+    atomic_init(&A.dropped, 0);
+    atomic_init(&A.quit, false);
+    atomic_init(&A.sleeping, false);
+    if (sem_init(&A.wake, 0, 0) != 0) {
+        free(A.records);
+        return -1;
+    }
+    if (pthread_create(&A.thread, NULL, writer_main, NULL) != 0) {
+        sem_destroy(&A.wake);
+        free(A.records);
+        return -1;
+    }
+    atomic_store_explicit(&A.running, true, memory_order_release);
+    return 0;
+}
+
+void log_stop_async(void)
+{
+    if (!atomic_load_explicit(&A.running, memory_order_acquire))
+        return;
+    atomic_store_explicit(&A.running, false, memory_order_release);
+    atomic_store_explicit(&A.quit, true, memory_order_release);
+    sem_post(&A.wake);
+    pthread_join(A.thread, NULL);
+    sem_destroy(&A.wake);
+    free(A.records);
+    A.records = NULL;
+}
+
+void log_flush(void)
+{
+    if (!atomic_load_explicit(&A.running, memory_order_acquire) || IN_WRITER)
+        return;
+    // No need to wake the writer, it does not sleep while a record is written and the producer of a record still
+    // being written wakes it when done
+    size_t head = atomic_load_explicit(&A.head, memory_order_acquire);
+    while (atomic_load_explicit(&A.tail, memory_order_acquire) < head)
+        sched_yield();
+}
+
+unsigned long log_dropped_count(void)
+{
+    return atomic_load_explicit(&A.dropped, memory_order_relaxed);
+}
+
+bool log_rate_limit(log_RateLimit *limit, uint32_t count, uint32_t interval_ms, unsigned long *suppressed)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int_least64_t now_ms = (int_least64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    int_least64_t start = atomic_load_explicit(&limit->interval_start_ms, memory_order_relaxed);
+    // Only the thread winning the exchange starts the new interval, the others count against it
+    if ((start == 0 || now_ms - start >= interval_ms)
+        && atomic_compare_exchange_strong_explicit(
+            &limit->interval_start_ms, &start, now_ms, memory_order_relaxed, memory_order_relaxed
+        ))
+        atomic_store_explicit(&limit->count, 0, memory_order_relaxed);
+
+    if (atomic_fetch_add_explicit(&limit->count, 1, memory_order_relaxed) >= count) {
+        atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    *suppressed = atomic_exchange_explicit(&limit->suppressed, 0, memory_order_relaxed);
+    return true;
+}
+
 void log_log(int level, const char *file, int line, const char *fmt, ...)
 {
     log_Event ev = {
@@ -140,6 +428,20 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
         .level = level,
     };
 
+    if (atomic_load_explicit(&A.running, memory_order_acquire)) {
+        if (level < LOG_FATAL) {
+            if (level_wanted(level)) {
+                va_list ap;
+                va_start(ap, fmt);
+                enqueue(level, file, line, fmt, ap);
+                va_end(ap);
+            }
+            return;
+        }
+        // The process is likely about to die, write it here rather than trust the writer thread to get to it
+        log_flush();
+    }
+
     lock();
 
     if (!L.quiet && level >= L.level) {
@@ -9,12 +9,19 @@
 #define LOG_H
 
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
 #define LOG_VERSION "0.1.0"
 
+// Longer messages are truncated in async mode
+#define LOG_ASYNC_MESSAGE_SIZE 512
+// Records in the async ring, a power of two. Messages arriving while it is full are dropped and counted.
+#define LOG_ASYNC_CAPACITY 1024u
+
 typedef struct {
     va_list ap;
     const char *fmt;
@@ -37,13 +44,82 @@ enum {
     LOG_FATAL
 };
 
+// Calls below this level are compiled out, their arguments are not evaluated. A number since the preprocessor cannot
+// see the enum, 0 is LOG_TRACE and 5 LOG_FATAL.
+#ifndef LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define LOG_MIN_LEVEL 2
+#else
+#define LOG_MIN_LEVEL 0
+#endif
+#endif
+
+// Still type checks the arguments, so that a call does not rot while compiled out
+#define LOG_DISCARD(...)                                         \
+    do {                                                         \
+        if (0)                                                   \
+            log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__); \
+    } while (0)
+
+#if LOG_MIN_LEVEL <= 0
 #define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_trace(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 1
 #define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_debug(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 2
 #define log_info(...) log_log(LOG_INFO, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_info(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 3
 #define log_warn(...) log_log(LOG_WARN, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_warn(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 4
 #define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_error(...) LOG_DISCARD(__VA_ARGS__)
+#endif
 #define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
 
+// Logs the first time the site is reached only. level is one of the enum, compared to LOG_MIN_LEVEL at compile time.
+#define log_once(level, ...)                                                              \
+    do {                                                                                  \
+        if ((level) >= LOG_MIN_LEVEL) {                                                   \
+            static atomic_flag log_once_done = ATOMIC_FLAG_INIT;                          \
+            if (!atomic_flag_test_and_set_explicit(&log_once_done, memory_order_relaxed)) \
+                log_log(level, __FILE__, __LINE__, __VA_ARGS__);                          \
+        }                                                                                 \
+    } while (0)
+
+// Logs at most count times every interval_ms milliseconds from the site. The first message of each interval is
+// followed by how many were suppressed during the previous ones.
+#define log_limited(level, count, interval_ms, ...)                                                             \
+    do {                                                                                                        \
+        if ((level) >= LOG_MIN_LEVEL) {                                                                         \
+            static log_RateLimit log_limit;                                                                     \
+            unsigned long log_suppressed;                                                                       \
+            if (log_rate_limit(&log_limit, count, interval_ms, &log_suppressed)) {                              \
+                log_log(level, __FILE__, __LINE__, __VA_ARGS__);                                                \
+                if (log_suppressed)                                                                             \
+                    log_log(level, __FILE__, __LINE__, "%lu similar messages were suppressed", log_suppressed); \
+            }                                                                                                   \
+        }                                                                                                       \
+    } while (0)
+
+// State of a log_limited site, zero initialized
+typedef struct {
+    atomic_int_least64_t interval_start_ms;
+    atomic_uint count;
+    atomic_ulong suppressed;
+} log_RateLimit;
+
 const char *log_level_string(int level);
 void log_set_lock(log_LockFn fn, void *udata);
 void log_set_level(int level);
@@ -51,6 +127,18 @@ void log_set_quiet(bool enable);
 int log_add_callback(log_LogFn fn, void *udata, int level);
 int log_add_fp(FILE *fp, int level);
 
-void log_log(int level, const char *file, int line, const char *fmt, ...);
+// Callers format their message into a lock-free ring and a background thread writes it, so logging never blocks on
+// I/O. Fatal messages still go out synchronously after everything queued before them.
+int log_start_async(void);
+// Writes what is left in the ring. Other threads must have stopped logging.
+void log_stop_async(void);
+// Returns once every message queued before the call has been written
+void log_flush(void);
+unsigned long log_dropped_count(void);
+
+// Returns whether the caller may log, suppressed is set to the messages dropped since the last one let through
+bool log_rate_limit(log_RateLimit *limit, uint32_t count, uint32_t interval_ms, unsigned long *suppressed);
+
+__attribute__((format(printf, 4, 5))) void log_log(int level, const char *file, int line, const char *fmt, ...);
 
 #endif
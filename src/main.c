@@ -1,12 +1,10 @@
 #define _XOPEN_SOURCE 600
 
-#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 #include <time.h>
-#include <unistd.h>
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
@@ -17,10 +15,23 @@
 #include <cglm/vec4.h>
 
 #include "array_helper_macros.h"
+#include "config.h"
+#include "culling.h"
+#include "device_select.h"
+#include "frame_limiter.h"
+#include "frame_stats.h"
+#include "gpu_memory.h"
+#include "gpu_profiler.h"
+#include "instances.h"
+#include "jobs.h"
 #include "log.h"
-
-static const int WIDTH = 800;
-static const int HEIGHT = 600;
+#include "mesh.h"
+#include "particles.h"
+#include "pipeline_cache.h"
+#include "render_graph.h"
+#include "resolution_controller.h"
+#include "shader_code.h"
+#include "staging.h"
 
 static const char *const VALIDATION_LAYERS[] = {
     "VK_LAYER_KHRONOS_validation",
@@ -30,6 +41,9 @@ static const char *const DEVICE_EXTENSIONS[] = {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME,
 };
 
+// Format of the offscreen targets in headless mode, mandatory as a color attachment and easy to read back
+static const VkFormat HEADLESS_IMAGE_FORMAT = VK_FORMAT_R8G8B8A8_SRGB;
+
 #ifdef NDEBUG
 const bool ENABLE_VALIDATION_LAYERS = false;
 #else
@@ -43,47 +57,209 @@ const bool ENABLE_VALIDATION_LAYERS = true;
     } while (0)
 #else
 #include <assert.h>
-#define ASSERT(x) assert(x)
+// The messages still queued for the log writer, often the error explaining the failure, would be lost on abort. x
+// is evaluated again by assert for its message, only once it failed.
+#define ASSERT(x)        \
+    do {                 \
+        if (!(x)) {      \
+            log_flush(); \
+            assert(x);   \
+        }                \
+    } while (0)
 #endif
 
+#define BENCHMARK_WARMUP_FRAMES 32
+#define BENCHMARK_FRAMES 256
+
+// Per severity, validation messages past that are counted instead of logged
+#define VL_MESSAGES_PER_SECOND 20
+
+// Frames in the rolling window of the frame statistics, also how often they are logged
+#define FRAME_STATS_WINDOW 1024
+
+// Instances transformed per job
+#define INSTANCE_UPDATE_GRAIN 16384
+
+// Seconds per particle step, like the instances the simulation advances per frame and not with the wall clock
+#define PARTICLE_STEP (1.0f / 60.0f)
+
+// Secondary command buffers of one thread for one frame slot, the pool is reset as a whole
+typedef struct {
+    VkCommandPool pool;
+    VkCommandBuffer *buffers;
+    uint32_t buffer_count;
+    uint32_t used;
+} thread_commands;
+
+typedef struct {
+    VkCommandBuffer command_buffer;
+    thread_commands threads[JOBS_MAX_THREADS];
+    VkSemaphore image_available_semaphore;
+    VkFence in_flight_fence;
+    // Per-instance transforms and colors, rewritten by the CPU every time the slot comes around
+    VkBuffer instance_buffer;
+    gpu_allocation instance_memory;
+    VkDescriptorSet descriptor_set;
+    // Of the last frame recorded in the slot, the scale its GPU timings were measured at
+    float render_scale;
+} frame_data;
+
+// Resources replaced by a swap chain recreation, destroyed once no frame in flight can use them
+typedef struct {
+    VkSwapchainKHR swap_chain;
+    VkImage *images;
+    VkImageView *image_views;
+    VkFramebuffer *framebuffers;
+    uint32_t framebuffer_count;
+    uint32_t image_count;
+    VkSemaphore *render_finished_semaphores;
+    VkFramebuffer scene_framebuffer;
+    // Owns the depth buffer and the scene target
+    render_graph *graph;
+    // Every frame that could use the resources has completed once frame_index reaches this
+    uint64_t release_frame;
+} retired_swap_chain;
+
+typedef struct {
+    frame_data *frame;
+    uint32_t image_index;
+    VkExtent2D extent;
+    uint32_t subpass;
+    // The pre-pass, which has no color attachment
+    bool depth_only;
+    // Drawing the instances
+    VkPipeline pipeline;
+    uint32_t chunk_count;
+    // One per chunk, then the particles if any
+    VkCommandBuffer secondaries[JOBS_MAX_THREADS + 1];
+} draw_recording;
+
+// What the passes of the render graph record from, per frame
+typedef struct {
+    draw_recording main;
+    uint32_t main_count;
+    // prepass_count is 0 without a depth pre-pass
+    draw_recording prepass;
+    uint32_t prepass_count;
+} graph_recording;
+
 typedef struct {
     GLFWwindow *window;
     VkInstance instance;
     VkDebugUtilsMessengerEXT debug_messenger;
     VkPhysicalDevice physical_device;
+    // Probed once when picking the device
+    device_caps device_caps;
     VkDevice device;
+    gpu_allocator *allocator;
     VkQueue graphics_queue;
     VkSurfaceKHR surface;
     VkQueue present_queue;
+    VkQueue transfer_queue;
+    // The graphics queue when the device has no separate compute family
+    VkQueue compute_queue;
+    staging_ring *staging;
     VkSwapchainKHR swap_chain;
+    // In headless mode these are offscreen targets that we own, one per frame slot
     VkImage *swap_chain_images;
+    gpu_allocation *headless_image_memory;
     uint32_t swap_chain_images_nb;
+    // Chosen once, swap chain recreations keep it so that the render pass stays compatible
     VkFormat swap_chain_image_format;
+    VkColorSpaceKHR swap_chain_color_space;
     VkExtent2D swap_chain_extent;
     VkImageView *swap_chain_image_views;
     uint32_t swap_chain_image_views_nb;
+    // VK_NULL_HANDLE with dynamic rendering, which needs neither a render pass nor framebuffers
     VkRenderPass render_pass;
+    bool dynamic_rendering;
+    // The core entry points or those of VK_KHR_dynamic_rendering, whichever the device has
+    PFN_vkCmdBeginRendering cmd_begin_rendering;
+    PFN_vkCmdEndRendering cmd_end_rendering;
+    VkPipelineCache pipeline_cache;
+    pipeline_cache_identity cache_identity;
+    char pipeline_cache_path[512];
+    VkDescriptorSetLayout descriptor_set_layout;
+    VkDescriptorPool descriptor_pool;
     VkPipelineLayout pipeline_layout;
     VkPipeline graphics_pipeline;
+    // Depth only, VK_NULL_HANDLE without --depth-prepass
+    VkPipeline depth_prepass_pipeline;
+    // Subpass of the color pass, the depth pre-pass is subpass 0 when enabled
+    uint32_t main_subpass;
+    // Set when the scene is rendered to the scene target at the render scale, then blitted to the output image
+    bool scaled_rendering;
+    resolution_controller resolution;
+    // Passes of a frame and the images they use, rebuilt with the swap chain
+    render_graph *graph;
+    // The swap chain image of the frame
+    render_graph_resource output_resource;
+    // Sized for the largest render scale, a frame renders to its top left corner
+    render_graph_resource scene_resource;
+    // Shared by every framebuffer, cleared by each frame and never read afterwards
+    render_graph_resource depth_resource;
+    VkFramebuffer scene_framebuffer;
     VkFramebuffer *swap_chain_framebuffers;
     uint32_t swap_chain_framebuffers_nb;
+    // Set on resize and when acquire or present report the swap chain out of date or suboptimal
+    bool swap_chain_outdated;
+    retired_swap_chain retired_swap_chains[MAX_FRAMES_IN_FLIGHT + 1];
+    uint32_t retired_swap_chain_count;
     VkCommandPool command_pool;
-    VkCommandBuffer command_buffer;
-    VkSemaphore image_available_semaphore;
-    VkSemaphore render_finished_semaphore;
-    VkFence in_flight_fence;
+    job_system *jobs;
+    gpu_profiler *profiler;
+    frame_stats *frame_stats;
+    frame_limiter frame_limiter;
+    // Start of the previous frame, zero before the first one
+    struct timespec last_frame_start;
+    gpu_mesh mesh;
+    // NULL when --particles is 0
+    particle_system *particles;
+    // NULL when culling on the CPU, which means not culling at all for now
+    gpu_culler *culler;
+    frame_data frames[MAX_FRAMES_IN_FLIGHT];
+    uint32_t frames_in_flight;
+    uint32_t current_frame;
+    uint64_t frame_index;
+    uint32_t instance_count;
+    uint32_t max_instance_count;
+    // Transforms of the instances, rebuilt when instance_count changes
+    scene_graph *scene;
+    uint32_t scene_instance_count;
+    // Fence of the frame currently using each swap chain image, if any
+    VkFence *images_in_flight;
+    // Signaled for the present of each swap chain image. Per image rather than per frame slot, as the presentation
+    // engine can still be waiting on it when the slot comes around again, but not once the image is acquired again.
+    VkSemaphore *render_finished_semaphores;
+    // Host visible copies of the rendered images, one per frame slot
+    VkBuffer readback_buffers[MAX_FRAMES_IN_FLIGHT];
+    gpu_allocation readback_memory[MAX_FRAMES_IN_FLIGHT];
+    uint32_t last_submitted_frame;
 } global_ctx;
 
 static global_ctx CTX = { 0 };
+static renderer_config CONFIG = { 0 };
+
+static void framebuffer_size_callback(GLFWwindow *window, int width, int height)
+{
+    (void) window;
+    (void) width;
+    (void) height;
+    CTX.swap_chain_outdated = true;
+}
 
 static void init_window(void)
 {
+    if (CONFIG.headless)
+        return;
+
     glfwInit();
 
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
-    CTX.window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", NULL, NULL);
+    CTX.window = glfwCreateWindow((int) CONFIG.width, (int) CONFIG.height, "Vulkan", NULL, NULL);
+    glfwSetFramebufferSizeCallback(CTX.window, framebuffer_size_callback);
 }
 
 static VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback(
@@ -91,18 +267,19 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback(
     const VkDebugUtilsMessengerCallbackDataEXT *callback_data, void *user_data
 )
 {
+    // A message repeated every frame would otherwise bury everything else and slow the frame down
     switch (message_severity) {
     case VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT:
-        log_trace("vl: %s", callback_data->pMessage);
+        log_limited(LOG_TRACE, VL_MESSAGES_PER_SECOND, 1000, "vl: %s", callback_data->pMessage);
         break;
     case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT:
-        log_info("vl: %s", callback_data->pMessage);
+        log_limited(LOG_INFO, VL_MESSAGES_PER_SECOND, 1000, "vl: %s", callback_data->pMessage);
         break;
     case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT:
-        log_warn("vl: %s", callback_data->pMessage);
+        log_limited(LOG_WARN, VL_MESSAGES_PER_SECOND, 1000, "vl: %s", callback_data->pMessage);
         break;
     case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT:
-        log_error("vl: %s", callback_data->pMessage);
+        log_limited(LOG_ERROR, VL_MESSAGES_PER_SECOND, 1000, "vl: %s", callback_data->pMessage);
         break;
     default:
         break;
@@ -158,7 +335,11 @@ static bool check_validation_layer_support(void)
 
 static const char **get_required_extensions(uint32_t *glfw_extension_count)
 {
-    const char **glfw_extensions = glfwGetRequiredInstanceExtensions(glfw_extension_count);
+    const char **glfw_extensions = NULL;
+    *glfw_extension_count = 0;
+    // There is no window system to talk to in headless mode
+    if (!CONFIG.headless)
+        glfw_extensions = glfwGetRequiredInstanceExtensions(glfw_extension_count);
     if (ENABLE_VALIDATION_LAYERS)
         *glfw_extension_count += 1;
 
@@ -185,7 +366,8 @@ static void create_instance(void)
     app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     app_info.pEngineName = "No Engine";
     app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    app_info.apiVersion = VK_API_VERSION_1_0;
+    // 1.2 for timeline semaphores, 1.3 for dynamic rendering on the devices that have it
+    app_info.apiVersion = VK_API_VERSION_1_3;
     log_trace("Created VkApplicationInfo");
 
     log_trace("Creating VkInstanceCreateInfo");
@@ -249,121 +431,10 @@ static void setup_debug_messenger(void)
     ASSERT(result == VK_SUCCESS);
 }
 
-typedef struct {
-    uint32_t graphics_family;
-    bool has_graphics_family;
-    uint32_t present_family;
-    bool has_present_family;
-} queue_family_indices;
-
-static bool is_queue_family_indices_complete(queue_family_indices qfi)
-{
-    return qfi.has_graphics_family && qfi.has_present_family;
-}
-
-static queue_family_indices find_queue_families(VkPhysicalDevice device)
-{
-    queue_family_indices indices = { 0 };
-
-    uint32_t queue_family_count = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, NULL);
-    VkQueueFamilyProperties *queue_families = calloc(sizeof *queue_families, queue_family_count);
-    ASSERT(queue_families);
-    vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, queue_families);
-
-    for (uint32_t i = 0; i < queue_family_count; i++) {
-        VkBool32 present_support = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, CTX.surface, &present_support);
-        if (queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-            indices.graphics_family = i;
-            indices.has_graphics_family = true;
-        }
-        if (present_support) {
-            indices.present_family = i;
-            indices.has_present_family = true;
-        }
-        if (is_queue_family_indices_complete(indices))
-            break;
-    }
-
-    free(queue_families);
-    return indices;
-}
-
-static bool check_device_extension_support(VkPhysicalDevice device)
-{
-    uint32_t extensions_count;
-    vkEnumerateDeviceExtensionProperties(device, NULL, &extensions_count, NULL);
-
-    VkExtensionProperties *available_extensions = calloc(sizeof *available_extensions, extensions_count);
-    vkEnumerateDeviceExtensionProperties(device, NULL, &extensions_count, available_extensions);
-    log_trace("Found %u available device extensions", extensions_count);
-    for (size_t i = 0; i < extensions_count; i++) {
-        log_trace("device extension %lu: %s", i, available_extensions[i].extensionName);
-    }
-
-    for (size_t i = 0; i < LENGTH_OF(DEVICE_EXTENSIONS); i++) {
-        bool extension_found = false;
-        log_debug("Testing for device extension: %s", DEVICE_EXTENSIONS[i]);
-
-        for (size_t y = 0; y < extensions_count; y++) {
-            if (!strcmp(DEVICE_EXTENSIONS[i], available_extensions[y].extensionName)) {
-                log_debug("Found wanted device extension: %s", DEVICE_EXTENSIONS[i]);
-                extension_found = true;
-                break;
-            }
-        }
-
-        if (!extension_found) {
-            log_fatal("Did not find wanted device extension: %s", DEVICE_EXTENSIONS[i]);
-            free(available_extensions);
-            return false;
-        }
-    }
-
-    free(available_extensions);
-    return true;
-}
-
-typedef struct {
-    VkSurfaceCapabilitiesKHR capabilities;
-    VkSurfaceFormatKHR *formats;
-    uint32_t formats_nb;
-    VkPresentModeKHR *present_modes;
-    uint32_t present_modes_nb;
-} swap_chain_support_details;
-
-static swap_chain_support_details query_swap_chain_support(VkPhysicalDevice device)
-{
-    swap_chain_support_details details = { 0 };
-
-    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, CTX.surface, &details.capabilities);
-
-    vkGetPhysicalDeviceSurfacePresentModesKHR(device, CTX.surface, &details.present_modes_nb, NULL);
-    if (details.present_modes_nb != 0) {
-        details.present_modes = calloc(sizeof *details.present_modes, details.present_modes_nb);
-        ASSERT(details.present_modes);
-        vkGetPhysicalDeviceSurfacePresentModesKHR(
-            device, CTX.surface, &details.present_modes_nb, details.present_modes
-        );
-    }
-
-    vkGetPhysicalDeviceSurfaceFormatsKHR(device, CTX.surface, &details.formats_nb, NULL);
-    if (details.formats_nb != 0) {
-        details.formats = calloc(sizeof *details.formats, details.formats_nb);
-        ASSERT(details.formats);
-        vkGetPhysicalDeviceSurfaceFormatsKHR(device, CTX.surface, &details.formats_nb, details.formats);
-    }
-
-    return details;
-}
-
-static void destroy_swap_chain_support_details(swap_chain_support_details details)
+static uint32_t required_device_extension_count(void)
 {
-    if (details.formats)
-        free(details.formats);
-    if (details.present_modes)
-        free(details.present_modes);
+    // Only the swap chain is required for now, and headless mode has none
+    return CONFIG.headless ? 0 : (uint32_t) LENGTH_OF(DEVICE_EXTENSIONS);
 }
 
 static VkSurfaceFormatKHR choose_swap_surface_format(
@@ -380,15 +451,26 @@ static VkSurfaceFormatKHR choose_swap_surface_format(
     return available_formats[0];
 }
 
+// In --present-mode order
+static const VkPresentModeKHR PRESENT_MODES[] = {
+    VK_PRESENT_MODE_MAILBOX_KHR,
+    VK_PRESENT_MODE_IMMEDIATE_KHR,
+    VK_PRESENT_MODE_FIFO_KHR,
+    VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+};
+
 static VkPresentModeKHR choose_swap_present_mode(
     const VkPresentModeKHR *available_present_modes, uint32_t nb_available_present_modes
 )
 {
+    VkPresentModeKHR wanted = PRESENT_MODES[CONFIG.present_mode];
     for (uint32_t i = 0; i < nb_available_present_modes; i++) {
-        if (available_present_modes[i] == VK_PRESENT_MODE_MAILBOX_KHR) {
+        if (available_present_modes[i] == wanted) {
             return available_present_modes[i];
         }
     }
+    // FIFO is the only mode every implementation has to support
+    log_once(LOG_WARN, "Present mode %s is not supported, using fifo", config_present_mode_name(CONFIG.present_mode));
     return VK_PRESENT_MODE_FIFO_KHR;
 }
 
@@ -419,68 +501,75 @@ static VkExtent2D choose_swap_extent(const VkSurfaceCapabilitiesKHR *capabilitie
     return actual_extent;
 }
 
-static bool is_device_suitable(VkPhysicalDevice device)
-{
-    queue_family_indices indices = find_queue_families(device);
-
-    bool extensions_supported = check_device_extension_support(device);
-    bool swap_chain_adequate = false;
-    if (extensions_supported) {
-        swap_chain_support_details swap_chain_support = query_swap_chain_support(device);
-        swap_chain_adequate = swap_chain_support.formats_nb != 0 && swap_chain_support.present_modes_nb != 0;
-        destroy_swap_chain_support_details(swap_chain_support);
-    }
-
-    return is_queue_family_indices_complete(indices) && extensions_supported && swap_chain_adequate;
-}
-
 static void pick_physical_device(void)
 {
-    VkPhysicalDevice physical_device = VK_NULL_HANDLE;
-
-    uint32_t device_count = 0;
-    vkEnumeratePhysicalDevices(CTX.instance, &device_count, NULL);
-    ASSERT(device_count != 0);
-
-    VkPhysicalDevice *devices = calloc(sizeof *devices, device_count);
-    vkEnumeratePhysicalDevices(CTX.instance, &device_count, devices);
-
-    for (uint32_t i = 0; i < device_count; i++) {
-        if (is_device_suitable(devices[i])) {
-            physical_device = devices[i];
-            break;
-        }
-    }
-
-    ASSERT(physical_device != VK_NULL_HANDLE);
-    free(devices);
-    CTX.physical_device = physical_device;
+    bool found = device_select(
+        CTX.instance, CTX.surface, DEVICE_EXTENSIONS, required_device_extension_count(), &CTX.device_caps
+    );
+    ASSERT(found);
+    CTX.physical_device = CTX.device_caps.device;
 }
 
 static void create_logical_device(void)
 {
-    queue_family_indices indices = find_queue_families(CTX.physical_device);
+    const device_caps *caps = &CTX.device_caps;
     float queue_priority = 1.0;
 
-    VkDeviceQueueCreateInfo queue_create_infos[2] = { 0 };
-    queue_create_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_create_infos[0].queueFamilyIndex = indices.graphics_family;
-    queue_create_infos[0].queueCount = 1;
-    queue_create_infos[0].pQueuePriorities = &queue_priority;
-    bool is_same_queue = indices.present_family == indices.graphics_family;
-    if (!is_same_queue) {
-        queue_create_infos[1].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        queue_create_infos[1].queueFamilyIndex = indices.present_family;
-        queue_create_infos[1].queueCount = 1;
-        queue_create_infos[1].pQueuePriorities = &queue_priority;
+    uint32_t families[] = {
+        caps->graphics_family,
+        caps->present_family,
+        caps->transfer_family,
+        caps->compute_family,
+    };
+    VkDeviceQueueCreateInfo queue_create_infos[LENGTH_OF(families)] = { 0 };
+    uint32_t queue_create_info_count = 0;
+    for (uint32_t i = 0; i < LENGTH_OF(families); i++) {
+        bool is_duplicate = false;
+        for (uint32_t y = 0; y < queue_create_info_count; y++)
+            is_duplicate |= queue_create_infos[y].queueFamilyIndex == families[i];
+        if (is_duplicate)
+            continue;
+        VkDeviceQueueCreateInfo *queue_create_info = &queue_create_infos[queue_create_info_count++];
+        queue_create_info->sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queue_create_info->queueFamilyIndex = families[i];
+        queue_create_info->queueCount = 1;
+        queue_create_info->pQueuePriorities = &queue_priority;
     }
 
+    VkPhysicalDeviceVulkan12Features features_12 = { 0 };
+    features_12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    features_12.timelineSemaphore = VK_TRUE;
+
     VkPhysicalDeviceFeatures device_features = { 0 };
+    if (CONFIG.gpu_culling && caps->draw_indirect_count) {
+        features_12.drawIndirectCount = VK_TRUE;
+        device_features.multiDrawIndirect = VK_TRUE;
+        device_features.drawIndirectFirstInstance = VK_TRUE;
+    }
+
+    const char *extensions[LENGTH_OF(DEVICE_EXTENSIONS) + 1];
+    uint32_t extension_count = required_device_extension_count();
+    for (uint32_t i = 0; i < extension_count; i++)
+        extensions[i] = DEVICE_EXTENSIONS[i];
+    VkPhysicalDeviceVulkan13Features features_13 = { 0 };
+    features_13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamic_rendering = { 0 };
+    dynamic_rendering.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+    CTX.dynamic_rendering = caps->dynamic_rendering && !CONFIG.no_dynamic_rendering;
+    if (CTX.dynamic_rendering && caps->dynamic_rendering_extension) {
+        dynamic_rendering.dynamicRendering = VK_TRUE;
+        features_12.pNext = &dynamic_rendering;
+        extensions[extension_count++] = VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME;
+    } else if (CTX.dynamic_rendering) {
+        features_13.dynamicRendering = VK_TRUE;
+        features_12.pNext = &features_13;
+    }
 
     VkDeviceCreateInfo create_info = { 0 };
     create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    create_info.pNext = &features_12;
     create_info.pQueueCreateInfos = queue_create_infos;
-    create_info.queueCreateInfoCount = is_same_queue ? 1 : 2;
+    create_info.queueCreateInfoCount = queue_create_info_count;
     create_info.pEnabledFeatures = &device_features;
     if (ENABLE_VALIDATION_LAYERS) {
         create_info.enabledLayerCount = LENGTH_OF(VALIDATION_LAYERS);
@@ -488,51 +577,202 @@ static void create_logical_device(void)
     } else {
         create_info.enabledLayerCount = 0;
     }
-    create_info.enabledExtensionCount = LENGTH_OF(DEVICE_EXTENSIONS);
-    create_info.ppEnabledExtensionNames = DEVICE_EXTENSIONS;
+    create_info.enabledExtensionCount = extension_count;
+    create_info.ppEnabledExtensionNames = extensions;
 
     VkResult result = vkCreateDevice(CTX.physical_device, &create_info, NULL, &CTX.device);
     ASSERT(result == VK_SUCCESS);
-    vkGetDeviceQueue(CTX.device, indices.graphics_family, 0, &CTX.graphics_queue);
-    vkGetDeviceQueue(CTX.device, indices.present_family, 0, &CTX.present_queue);
+    vkGetDeviceQueue(CTX.device, caps->graphics_family, 0, &CTX.graphics_queue);
+    vkGetDeviceQueue(CTX.device, caps->present_family, 0, &CTX.present_queue);
+    vkGetDeviceQueue(CTX.device, caps->transfer_family, 0, &CTX.transfer_queue);
+    vkGetDeviceQueue(CTX.device, caps->compute_family, 0, &CTX.compute_queue);
+
+    const char *rendering = "a render pass";
+    if (CTX.dynamic_rendering) {
+        bool extension = caps->dynamic_rendering_extension;
+        CTX.cmd_begin_rendering = (PFN_vkCmdBeginRendering) vkGetDeviceProcAddr(
+            CTX.device, extension ? "vkCmdBeginRenderingKHR" : "vkCmdBeginRendering"
+        );
+        CTX.cmd_end_rendering = (PFN_vkCmdEndRendering) vkGetDeviceProcAddr(
+            CTX.device, extension ? "vkCmdEndRenderingKHR" : "vkCmdEndRendering"
+        );
+        ASSERT(CTX.cmd_begin_rendering && CTX.cmd_end_rendering);
+        rendering = extension ? VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME : "Vulkan 1.3 dynamic rendering";
+    }
+    log_debug("Rendering with %s", rendering);
 }
 
 static void create_surface(void)
 {
+    if (CONFIG.headless)
+        return;
+
     VkResult result = glfwCreateWindowSurface(CTX.instance, CTX.window, NULL, &CTX.surface);
     ASSERT(result == VK_SUCCESS);
 }
 
-static void create_swap_chain(void)
+static void create_allocator(void)
+{
+    // The config enum starts at TLSF, gpu_memory_strategy starts at DEFAULT
+    gpu_memory_strategy strategy = (gpu_memory_strategy) (CONFIG.memory_strategy + 1);
+    CTX.allocator = gpu_allocator_create(
+        CTX.physical_device, CTX.device, strategy, (VkDeviceSize) CONFIG.memory_block_size << 20
+    );
+    ASSERT(CTX.allocator);
+}
+
+static void create_staging_ring(void)
 {
-    swap_chain_support_details swap_chain_support = query_swap_chain_support(CTX.physical_device);
+    CTX.staging = staging_create(
+        CTX.device, CTX.allocator, CTX.transfer_queue, CTX.device_caps.transfer_family, CTX.device_caps.graphics_family,
+        (VkDeviceSize) CONFIG.staging_size << 20
+    );
+    ASSERT(CTX.staging);
+}
 
+// Separate from the swap chain so that the render pass and the pipelines do not have to wait for it
+static void choose_surface_format(void)
+{
+    if (CONFIG.headless) {
+        CTX.swap_chain_image_format = HEADLESS_IMAGE_FORMAT;
+        return;
+    }
     VkSurfaceFormatKHR surface_format = choose_swap_surface_format(
-        swap_chain_support.formats, swap_chain_support.formats_nb
+        CTX.device_caps.surface_formats, CTX.device_caps.surface_format_count
+    );
+    CTX.swap_chain_image_format = surface_format.format;
+    CTX.swap_chain_color_space = surface_format.colorSpace;
+}
+
+// Scaled rendering blits the scene to the output image, which its format and the swap chain have to allow
+static void choose_render_scale(void)
+{
+    resolution_controller_init(
+        &CTX.resolution, (float) CONFIG.render_scale_min / 100.0f, (float) CONFIG.render_scale_max / 100.0f,
+        (double) CONFIG.gpu_budget_us / 1000.0
     );
+    if (!CONFIG.gpu_budget_us && CONFIG.render_scale_max == 100)
+        return;
+
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(CTX.physical_device, CTX.swap_chain_image_format, &properties);
+    VkFormatFeatureFlags needed = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT
+                                | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    bool blittable = (properties.optimalTilingFeatures & needed) == needed;
+    if (!CONFIG.headless) {
+        VkSurfaceCapabilitiesKHR capabilities;
+        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(CTX.physical_device, CTX.surface, &capabilities);
+        blittable = blittable && (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+    }
+    if (!blittable) {
+        log_warn("The output images cannot be blitted to with filtering, rendering at full resolution");
+        return;
+    }
+    CTX.scaled_rendering = true;
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++)
+        CTX.frames[i].render_scale = CTX.resolution.max_scale;
+}
+
+// The part of the scene target a frame renders to
+static VkExtent2D scaled_extent(float scale)
+{
+    VkExtent2D extent;
+    extent.width = (uint32_t) ((float) CTX.swap_chain_extent.width * scale + 0.5f);
+    extent.height = (uint32_t) ((float) CTX.swap_chain_extent.height * scale + 0.5f);
+    extent.width = extent.width ? extent.width : 1;
+    extent.height = extent.height ? extent.height : 1;
+    return extent;
+}
+
+// Of the images the render pass draws to
+static VkExtent2D target_extent(void)
+{
+    return CTX.scaled_rendering ? scaled_extent(CTX.resolution.max_scale) : CTX.swap_chain_extent;
+}
+
+// Where a frame first touches its output image, and so where it waits for the acquire
+static VkPipelineStageFlags output_wait_stage(void)
+{
+    // A scaled frame only touches the image with the blit
+    return CTX.scaled_rendering ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+}
+
+static void create_headless_targets(void)
+{
+    CTX.swap_chain_images_nb = CTX.frames_in_flight;
+    CTX.swap_chain_images = calloc(sizeof *CTX.swap_chain_images, CTX.swap_chain_images_nb);
+    ASSERT(CTX.swap_chain_images);
+    CTX.headless_image_memory = calloc(sizeof *CTX.headless_image_memory, CTX.swap_chain_images_nb);
+    ASSERT(CTX.headless_image_memory);
+    CTX.swap_chain_extent = (VkExtent2D){ CONFIG.width, CONFIG.height };
+
+    for (uint32_t i = 0; i < CTX.swap_chain_images_nb; i++) {
+        VkImageCreateInfo image_info = { 0 };
+        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_info.imageType = VK_IMAGE_TYPE_2D;
+        image_info.format = CTX.swap_chain_image_format;
+        image_info.extent.width = CTX.swap_chain_extent.width;
+        image_info.extent.height = CTX.swap_chain_extent.height;
+        image_info.extent.depth = 1;
+        image_info.mipLevels = 1;
+        image_info.arrayLayers = 1;
+        image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+        image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        image_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        if (CTX.scaled_rendering)
+            image_info.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        gpu_allocation_desc desc = { 0 };
+        desc.required_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+        VkResult result = gpu_memory_create_image(
+            CTX.allocator, &image_info, &desc, &CTX.swap_chain_images[i], &CTX.headless_image_memory[i]
+        );
+        ASSERT(result == VK_SUCCESS);
+    }
+    log_debug(
+        "Created %u headless targets of %ux%u", CTX.swap_chain_images_nb, CTX.swap_chain_extent.width,
+        CTX.swap_chain_extent.height
+    );
+}
+
+static void create_swap_chain(void)
+{
+    if (CONFIG.headless) {
+        create_headless_targets();
+        return;
+    }
+
+    // Formats and present modes are cached with the device, only the capabilities change with the window
+    VkSurfaceCapabilitiesKHR capabilities;
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(CTX.physical_device, CTX.surface, &capabilities);
+
     VkPresentModeKHR present_mode = choose_swap_present_mode(
-        swap_chain_support.present_modes, swap_chain_support.present_modes_nb
+        CTX.device_caps.present_modes, CTX.device_caps.present_mode_count
     );
-    VkExtent2D extent = choose_swap_extent(&swap_chain_support.capabilities);
-    uint32_t image_count = swap_chain_support.capabilities.minImageCount + 1;
+    VkExtent2D extent = choose_swap_extent(&capabilities);
+    uint32_t image_count = CONFIG.swap_chain_images ? CONFIG.swap_chain_images : capabilities.minImageCount + 1;
+    if (image_count < capabilities.minImageCount)
+        image_count = capabilities.minImageCount;
 
-    if (swap_chain_support.capabilities.maxImageCount > 0
-        && image_count > swap_chain_support.capabilities.maxImageCount)
-        image_count = swap_chain_support.capabilities.maxImageCount;
+    if (capabilities.maxImageCount > 0 && image_count > capabilities.maxImageCount)
+        image_count = capabilities.maxImageCount;
 
     VkSwapchainCreateInfoKHR create_info = { 0 };
     create_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
     create_info.surface = CTX.surface;
     create_info.minImageCount = image_count;
-    create_info.imageFormat = surface_format.format;
-    create_info.imageColorSpace = surface_format.colorSpace;
+    create_info.imageFormat = CTX.swap_chain_image_format;
+    create_info.imageColorSpace = CTX.swap_chain_color_space;
     create_info.imageExtent = extent;
     create_info.imageArrayLayers = 1;
     create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    if (CTX.scaled_rendering)
+        create_info.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 
-    queue_family_indices indices = find_queue_families(CTX.physical_device);
-    uint32_t idx[] = { indices.graphics_family, indices.present_family };
-    if (indices.graphics_family != indices.present_family) {
+    uint32_t idx[] = { CTX.device_caps.graphics_family, CTX.device_caps.present_family };
+    if (idx[0] != idx[1]) {
         create_info.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
         create_info.queueFamilyIndexCount = 2;
         create_info.pQueueFamilyIndices = idx;
@@ -540,23 +780,21 @@ static void create_swap_chain(void)
         create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
     }
 
-    create_info.preTransform = swap_chain_support.capabilities.currentTransform;
+    create_info.preTransform = capabilities.currentTransform;
     create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     create_info.presentMode = present_mode;
     create_info.clipped = VK_TRUE;
-    create_info.oldSwapchain = VK_NULL_HANDLE;
+    // Lets the driver reuse the old images and keeps presentation going while we switch over
+    create_info.oldSwapchain = CTX.swap_chain;
 
     VkResult result = vkCreateSwapchainKHR(CTX.device, &create_info, NULL, &CTX.swap_chain);
     ASSERT(result == VK_SUCCESS);
 
-    destroy_swap_chain_support_details(swap_chain_support);
-
     vkGetSwapchainImagesKHR(CTX.device, CTX.swap_chain, &CTX.swap_chain_images_nb, NULL);
     CTX.swap_chain_images = calloc(sizeof *CTX.swap_chain_images, CTX.swap_chain_images_nb);
     ASSERT(CTX.swap_chain_images);
     vkGetSwapchainImagesKHR(CTX.device, CTX.swap_chain, &CTX.swap_chain_images_nb, CTX.swap_chain_images);
 
-    CTX.swap_chain_image_format = surface_format.format;
     CTX.swap_chain_extent = extent;
 }
 
@@ -587,46 +825,92 @@ static void create_image_views(void)
     }
 }
 
-static char *read_file(const char *filename, size_t *size)
+static VkShaderModule create_shader_module(const char *name)
 {
-    int fd = open(filename, O_RDONLY);
-    ASSERT(fd > 0);
+    shader_code code;
+    bool loaded = shader_code_load(name, &code);
+    ASSERT(loaded);
 
-    struct stat st;
-    stat(filename, &st);
-    *size = (size_t) st.st_size;
-
-    char *data = malloc(*size);
-    read(fd, data, *size);
-    close(fd);
-    return data;
-}
-
-static VkShaderModule create_shader_module(const char *code, size_t code_size)
-{
     VkShaderModuleCreateInfo create_info = { 0 };
     create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    create_info.codeSize = code_size;
-    // Hope this doesn't crash for some alignement reason :/
-    create_info.pCode = (const uint32_t *) code;
+    create_info.codeSize = code.size;
+    create_info.pCode = code.code;
 
     VkShaderModule shader_module = { 0 };
     VkResult result = vkCreateShaderModule(CTX.device, &create_info, NULL, &shader_module);
     ASSERT(result == VK_SUCCESS);
+    shader_code_release(&code);
     return shader_module;
 }
 
-static void create_graphics_pipeline(void)
+static void create_pipeline_cache(void)
+{
+    pipeline_cache_identify(CTX.physical_device, &CTX.cache_identity);
+
+    CTX.pipeline_cache_path[0] = '\0';
+    if (!CONFIG.no_pipeline_cache
+        && !pipeline_cache_path(
+            &CTX.cache_identity, CONFIG.pipeline_cache_dir, CTX.pipeline_cache_path, sizeof CTX.pipeline_cache_path
+        )) {
+        log_warn("No cache directory found, pipelines will not be cached across runs");
+        CTX.pipeline_cache_path[0] = '\0';
+    }
+    CTX.pipeline_cache = pipeline_cache_load(
+        CTX.device, &CTX.cache_identity, CTX.pipeline_cache_path[0] ? CTX.pipeline_cache_path : NULL
+    );
+}
+
+static void destroy_pipeline_cache(void)
+{
+    if (CTX.pipeline_cache_path[0])
+        pipeline_cache_save(CTX.device, CTX.pipeline_cache, &CTX.cache_identity, CTX.pipeline_cache_path);
+    vkDestroyPipelineCache(CTX.device, CTX.pipeline_cache, NULL);
+}
+
+static void create_descriptor_set_layout(void)
+{
+    VkDescriptorSetLayoutBinding instances_binding = { 0 };
+    instances_binding.binding = 0;
+    instances_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    instances_binding.descriptorCount = 1;
+    instances_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    VkDescriptorSetLayoutCreateInfo layout_info = { 0 };
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = 1;
+    layout_info.pBindings = &instances_binding;
+
+    VkResult result = vkCreateDescriptorSetLayout(CTX.device, &layout_info, NULL, &CTX.descriptor_set_layout);
+    ASSERT(result == VK_SUCCESS);
+}
+
+static void create_pipeline_layout(void)
+{
+    VkPipelineLayoutCreateInfo pipeline_layout_info = { 0 };
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &CTX.descriptor_set_layout;
+
+    VkResult result = vkCreatePipelineLayout(CTX.device, &pipeline_layout_info, NULL, &CTX.pipeline_layout);
+    ASSERT(result == VK_SUCCESS);
+}
+
+// What a pipeline drawn with dynamic rendering is told of the attachments instead of a render pass.
+// The pre-pass has no color attachment.
+static VkPipelineRenderingCreateInfo pipeline_rendering_info(bool color)
 {
-    size_t vert_shader_code_size;
-    size_t frag_shader_code_size;
-    char *vert_shader_code = read_file("shaders/vert.spv", &vert_shader_code_size);
-    log_debug("Loaded vertex shader bytecode with size %lu", vert_shader_code_size);
-    char *frag_shader_code = read_file("shaders/frag.spv", &frag_shader_code_size);
-    log_debug("Loaded frament shader bytecode with size %lu", frag_shader_code_size);
+    VkPipelineRenderingCreateInfo rendering_info = { 0 };
+    rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+    rendering_info.colorAttachmentCount = color ? 1 : 0;
+    rendering_info.pColorAttachmentFormats = &CTX.swap_chain_image_format;
+    rendering_info.depthAttachmentFormat = CTX.device_caps.depth_format;
+    return rendering_info;
+}
 
-    VkShaderModule vert_shader_module = create_shader_module(vert_shader_code, vert_shader_code_size);
-    VkShaderModule frag_shader_module = create_shader_module(frag_shader_code, frag_shader_code_size);
+static void create_graphics_pipeline(void)
+{
+    VkShaderModule vert_shader_module = create_shader_module("vert");
+    VkShaderModule frag_shader_module = create_shader_module("frag");
 
     VkPipelineShaderStageCreateInfo vert_shader_stage_info = { 0 };
     vert_shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -645,35 +929,35 @@ static void create_graphics_pipeline(void)
         frag_shader_stage_info,
     };
 
+    mesh_vertex_input vertex_input;
+    mesh_vertex_input_describe((vertex_layout) CONFIG.vertex_layout, &vertex_input);
+
     VkPipelineVertexInputStateCreateInfo vertex_input_info = { 0 };
     vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_info.vertexBindingDescriptionCount = 0;
-    vertex_input_info.vertexAttributeDescriptionCount = 0;
+    vertex_input_info.vertexBindingDescriptionCount = vertex_input.binding_count;
+    vertex_input_info.pVertexBindingDescriptions = vertex_input.bindings;
+    vertex_input_info.vertexAttributeDescriptionCount = LENGTH_OF(vertex_input.attributes);
+    vertex_input_info.pVertexAttributeDescriptions = vertex_input.attributes;
 
     VkPipelineInputAssemblyStateCreateInfo input_assembly = { 0 };
     input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
     input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
     input_assembly.primitiveRestartEnable = VK_FALSE;
 
-    VkViewport viewport = { 0 };
-    viewport.x = 0.0;
-    viewport.y = 0.0;
-    viewport.width = (float) CTX.swap_chain_extent.width;
-    viewport.height = (float) CTX.swap_chain_extent.height;
-    viewport.minDepth = 0.0;
-    viewport.maxDepth = 1.0;
-
-    VkRect2D scissor = { 0 };
-    scissor.offset.x = 0;
-    scissor.offset.y = 0;
-    scissor.extent = CTX.swap_chain_extent;
-
+    // Set while recording, so that the pipeline works for any target size
     VkPipelineViewportStateCreateInfo viewport_state = { 0 };
     viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewport_state.viewportCount = 1;
-    viewport_state.pViewports = &viewport;
     viewport_state.scissorCount = 1;
-    viewport_state.pScissors = &scissor;
+
+    VkDynamicState dynamic_states[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR,
+    };
+    VkPipelineDynamicStateCreateInfo dynamic_state = { 0 };
+    dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state.dynamicStateCount = LENGTH_OF(dynamic_states);
+    dynamic_state.pDynamicStates = dynamic_states;
 
     VkPipelineRasterizationStateCreateInfo rasterizer = { 0 };
     rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -690,6 +974,15 @@ static void create_graphics_pipeline(void)
     multisampling.sampleShadingEnable = VK_FALSE;
     multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
 
+    // After a pre-pass the depth buffer already holds the nearest surface, only fragments matching it are shaded
+    VkPipelineDepthStencilStateCreateInfo depth_stencil = { 0 };
+    depth_stencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil.depthTestEnable = VK_TRUE;
+    depth_stencil.depthWriteEnable = CONFIG.depth_prepass ? VK_FALSE : VK_TRUE;
+    depth_stencil.depthCompareOp = CONFIG.depth_prepass ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS;
+    depth_stencil.depthBoundsTestEnable = VK_FALSE;
+    depth_stencil.stencilTestEnable = VK_FALSE;
+
     VkPipelineColorBlendAttachmentState color_blend_attachement = { 0 };
     color_blend_attachement.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
         | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
@@ -701,12 +994,6 @@ static void create_graphics_pipeline(void)
     color_blending.attachmentCount = 1;
     color_blending.pAttachments = &color_blend_attachement;
 
-    VkPipelineLayoutCreateInfo pipeline_layout_info = { 0 };
-    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-
-    VkResult result = vkCreatePipelineLayout(CTX.device, &pipeline_layout_info, NULL, &CTX.pipeline_layout);
-    ASSERT(result == VK_SUCCESS);
-
     VkGraphicsPipelineCreateInfo pipeline_info = { 0 };
     pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
     pipeline_info.stageCount = 2;
@@ -716,23 +1003,47 @@ static void create_graphics_pipeline(void)
     pipeline_info.pViewportState = &viewport_state;
     pipeline_info.pRasterizationState = &rasterizer;
     pipeline_info.pMultisampleState = &multisampling;
-    pipeline_info.pDepthStencilState = NULL;
+    pipeline_info.pDepthStencilState = &depth_stencil;
     pipeline_info.pColorBlendState = &color_blending;
+    pipeline_info.pDynamicState = &dynamic_state;
     pipeline_info.layout = CTX.pipeline_layout;
     pipeline_info.renderPass = CTX.render_pass;
-    pipeline_info.subpass = 0;
+    pipeline_info.subpass = CTX.main_subpass;
+    VkPipelineRenderingCreateInfo rendering_info = pipeline_rendering_info(true);
+    if (CTX.dynamic_rendering)
+        pipeline_info.pNext = &rendering_info;
 
-    result = vkCreateGraphicsPipelines(CTX.device, VK_NULL_HANDLE, 1, &pipeline_info, NULL, &CTX.graphics_pipeline);
+    VkResult result = vkCreateGraphicsPipelines(
+        CTX.device, CTX.pipeline_cache, 1, &pipeline_info, NULL, &CTX.graphics_pipeline
+    );
     ASSERT(result == VK_SUCCESS);
 
+    if (CONFIG.depth_prepass) {
+        // Same vertex state so that both passes compute the same depths, without a fragment stage or color
+        depth_stencil.depthWriteEnable = VK_TRUE;
+        depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+        color_blending.attachmentCount = 0;
+        pipeline_info.stageCount = 1;
+        pipeline_info.subpass = 0;
+        rendering_info.colorAttachmentCount = 0;
+        result = vkCreateGraphicsPipelines(
+            CTX.device, CTX.pipeline_cache, 1, &pipeline_info, NULL, &CTX.depth_prepass_pipeline
+        );
+        ASSERT(result == VK_SUCCESS);
+    }
+
     vkDestroyShaderModule(CTX.device, vert_shader_module, NULL);
     vkDestroyShaderModule(CTX.device, frag_shader_module, NULL);
-    free(frag_shader_code);
-    free(vert_shader_code);
 }
 
 static void create_render_pass(void)
 {
+    // The pre-pass is a separate pass of the render graph then
+    if (CTX.dynamic_rendering) {
+        CTX.main_subpass = 0;
+        return;
+    }
+
     VkAttachmentDescription color_attachement = { 0 };
     color_attachement.format = CTX.swap_chain_image_format;
     color_attachement.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -740,123 +1051,827 @@ static void create_render_pass(void)
     color_attachement.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     color_attachement.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     color_attachement.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    color_attachement.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    color_attachement.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    // The render graph transitions the attachments around the pass, the pass itself keeps them as they are
+    color_attachement.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_attachement.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    // Only lives for the duration of the pass
+    VkAttachmentDescription depth_attachment = { 0 };
+    depth_attachment.format = CTX.device_caps.depth_format;
+    depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription attachments[] = {
+        color_attachement,
+        depth_attachment,
+    };
 
     VkAttachmentReference color_attachment_ref = { 0 };
     color_attachment_ref.attachment = 0;
     color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
-    VkSubpassDescription subpass = { 0 };
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &color_attachment_ref;
-
-    VkSubpassDependency dependency = { 0 };
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    VkAttachmentReference depth_attachment_ref = { 0 };
+    depth_attachment_ref.attachment = 1;
+    depth_attachment_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    CTX.main_subpass = CONFIG.depth_prepass ? 1 : 0;
+    VkSubpassDescription subpasses[2] = { 0 };
+    subpasses[0].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses[0].pDepthStencilAttachment = &depth_attachment_ref;
+    subpasses[CTX.main_subpass].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses[CTX.main_subpass].colorAttachmentCount = 1;
+    subpasses[CTX.main_subpass].pColorAttachments = &color_attachment_ref;
+    // The main pass only tests against what the pre-pass wrote, its pipeline does not write depth. Staying in the
+    // attachment layout keeps every transition out of the pass.
+    if (CONFIG.depth_prepass)
+        subpasses[CTX.main_subpass].pDepthStencilAttachment = &depth_attachment_ref;
+
+    // Everything outside of the pass is synchronized by the barriers of the render graph
+    VkSubpassDependency dependencies[1] = { 0 };
+    uint32_t dependency_count = 0;
+    if (CONFIG.depth_prepass) {
+        VkSubpassDependency *dependency = &dependencies[dependency_count++];
+        dependency->srcSubpass = 0;
+        dependency->dstSubpass = CTX.main_subpass;
+        dependency->srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependency->srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependency->dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                                 | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependency->dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+        dependency->dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    }
 
     VkRenderPassCreateInfo render_pass_info = { 0 };
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_info.attachmentCount = 1;
-    render_pass_info.pAttachments = &color_attachement;
-    render_pass_info.subpassCount = 1;
-    render_pass_info.pSubpasses = &subpass;
-    render_pass_info.dependencyCount = 1;
-    render_pass_info.pDependencies = &dependency;
+    render_pass_info.attachmentCount = LENGTH_OF(attachments);
+    render_pass_info.pAttachments = attachments;
+    render_pass_info.subpassCount = CTX.main_subpass + 1;
+    render_pass_info.pSubpasses = subpasses;
+    render_pass_info.dependencyCount = dependency_count;
+    render_pass_info.pDependencies = dependencies;
 
     VkResult result = vkCreateRenderPass(CTX.device, &render_pass_info, NULL, &CTX.render_pass);
     ASSERT(result == VK_SUCCESS);
 }
 
+static VkFramebuffer create_framebuffer(VkImageView color_view)
+{
+    VkImageView attachments[] = {
+        color_view,
+        render_graph_image_view(CTX.graph, CTX.depth_resource),
+    };
+
+    VkExtent2D extent = target_extent();
+    VkFramebufferCreateInfo framebuffer_info = { 0 };
+    framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_info.renderPass = CTX.render_pass;
+    framebuffer_info.attachmentCount = LENGTH_OF(attachments);
+    framebuffer_info.pAttachments = attachments;
+    framebuffer_info.width = extent.width;
+    framebuffer_info.height = extent.height;
+    framebuffer_info.layers = 1;
+
+    VkFramebuffer framebuffer;
+    VkResult result = vkCreateFramebuffer(CTX.device, &framebuffer_info, NULL, &framebuffer);
+    ASSERT(result == VK_SUCCESS);
+    return framebuffer;
+}
+
+// Scaled rendering only ever draws to the scene target, the swap chain images are blitted to
 static void create_framebuffers(void)
 {
+    // Dynamic rendering takes the image views directly
+    if (CTX.dynamic_rendering)
+        return;
+    if (CTX.scaled_rendering) {
+        CTX.scene_framebuffer = create_framebuffer(render_graph_image_view(CTX.graph, CTX.scene_resource));
+        CTX.swap_chain_framebuffers = NULL;
+        CTX.swap_chain_framebuffers_nb = 0;
+        return;
+    }
+
     CTX.swap_chain_framebuffers_nb = CTX.swap_chain_images_nb;
     CTX.swap_chain_framebuffers = calloc(sizeof *CTX.swap_chain_framebuffers, CTX.swap_chain_framebuffers_nb);
     ASSERT(CTX.swap_chain_framebuffers);
+    for (uint32_t i = 0; i < CTX.swap_chain_framebuffers_nb; i++)
+        CTX.swap_chain_framebuffers[i] = create_framebuffer(CTX.swap_chain_image_views[i]);
+}
 
-    for (uint32_t i = 0; i < CTX.swap_chain_framebuffers_nb; i++) {
-        VkImageView attachments[] = {
-            CTX.swap_chain_image_views[i],
-        };
-
-        VkFramebufferCreateInfo framebuffer_info = { 0 };
-        framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        framebuffer_info.renderPass = CTX.render_pass;
-        framebuffer_info.attachmentCount = 1;
-        framebuffer_info.pAttachments = attachments;
-        framebuffer_info.width = CTX.swap_chain_extent.width;
-        framebuffer_info.height = CTX.swap_chain_extent.height;
-        framebuffer_info.layers = 1;
-
-        VkResult result = vkCreateFramebuffer(CTX.device, &framebuffer_info, NULL, &CTX.swap_chain_framebuffers[i]);
-        ASSERT(result == VK_SUCCESS);
-    }
+static VkFramebuffer target_framebuffer(uint32_t image_index)
+{
+    return CTX.scaled_rendering ? CTX.scene_framebuffer : CTX.swap_chain_framebuffers[image_index];
 }
 
 static void create_command_pool(void)
 {
-    queue_family_indices qfi = find_queue_families(CTX.physical_device);
-
     VkCommandPoolCreateInfo pool_info = { 0 };
     pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    pool_info.queueFamilyIndex = qfi.graphics_family;
+    pool_info.queueFamilyIndex = CTX.device_caps.graphics_family;
 
     VkResult result = vkCreateCommandPool(CTX.device, &pool_info, NULL, &CTX.command_pool);
     ASSERT(result == VK_SUCCESS);
 }
 
-static void create_command_buffer(void)
+static void create_thread_command_pools(void)
+{
+    VkCommandPoolCreateInfo pool_info = { 0 };
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_info.queueFamilyIndex = CTX.device_caps.graphics_family;
+
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++) {
+        for (uint32_t t = 0; t < jobs_thread_count(CTX.jobs); t++) {
+            VkResult result = vkCreateCommandPool(CTX.device, &pool_info, NULL, &CTX.frames[i].threads[t].pool);
+            ASSERT(result == VK_SUCCESS);
+        }
+    }
+}
+
+// Only ever called by the thread owning commands, pools are externally synchronized
+static VkCommandBuffer acquire_secondary_command_buffer(thread_commands *commands)
+{
+    if (commands->used == commands->buffer_count) {
+        VkCommandBuffer *buffers = realloc(commands->buffers, (commands->buffer_count + 1) * sizeof *buffers);
+        ASSERT(buffers);
+        commands->buffers = buffers;
+
+        VkCommandBufferAllocateInfo alloc_info = { 0 };
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = commands->pool;
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        alloc_info.commandBufferCount = 1;
+        VkResult result = vkAllocateCommandBuffers(CTX.device, &alloc_info, &commands->buffers[commands->buffer_count]);
+        ASSERT(result == VK_SUCCESS);
+        commands->buffer_count++;
+    }
+    return commands->buffers[commands->used++];
+}
+
+static void create_gpu_profiler(void)
+{
+    const device_caps *caps = &CTX.device_caps;
+    // NULL is fine, every profiler call is a no-op then
+    CTX.profiler = gpu_profiler_create(
+        CTX.device, caps->properties.limits.timestampPeriod,
+        caps->queue_families[caps->graphics_family].timestampValidBits, CTX.frames_in_flight
+    );
+}
+
+static double gpu_frame_ms(void)
+{
+    const gpu_profiler_scope *scopes;
+    return gpu_profiler_results(CTX.profiler, &scopes) ? scopes[0].average_ms : 0.0;
+}
+
+static double gpu_last_frame_ms(void)
+{
+    const gpu_profiler_scope *scopes;
+    return gpu_profiler_results(CTX.profiler, &scopes) ? scopes[0].ms : 0.0;
+}
+
+static void log_render_scale(void)
+{
+    if (!CTX.scaled_rendering)
+        return;
+    VkExtent2D extent = scaled_extent(CTX.resolution.scale);
+    log_debug(
+        "Render scale: %.0f%% (%ux%u), %.3f ms of GPU time at full resolution", CTX.resolution.scale * 100.0,
+        extent.width, extent.height, CTX.resolution.full_scale_ms
+    );
+}
+
+static void log_gpu_timings(void)
+{
+    const gpu_profiler_scope *scopes;
+    uint32_t scope_count = gpu_profiler_results(CTX.profiler, &scopes);
+    for (uint32_t i = 0; i < scope_count; i++)
+        log_debug("GPU %s: %.3f ms (last %.3f ms)", scopes[i].name, scopes[i].average_ms, scopes[i].ms);
+}
+
+static void log_culling(void)
+{
+    if (!CTX.culler)
+        return;
+    uint32_t visible = culling_visible_count(CTX.culler);
+    log_debug(
+        "GPU culling: %u of %u instances visible (%.1f%%)", visible, CTX.instance_count,
+        100.0 * visible / CTX.instance_count
+    );
+}
+
+static void create_command_buffers(void)
 {
+    VkCommandBuffer command_buffers[MAX_FRAMES_IN_FLIGHT];
+
     VkCommandBufferAllocateInfo alloc_info = { 0 };
     alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     alloc_info.commandPool = CTX.command_pool;
     alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    alloc_info.commandBufferCount = 1;
+    alloc_info.commandBufferCount = CTX.frames_in_flight;
+
+    VkResult result = vkAllocateCommandBuffers(CTX.device, &alloc_info, command_buffers);
+    ASSERT(result == VK_SUCCESS);
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++)
+        CTX.frames[i].command_buffer = command_buffers[i];
+}
+
+static void create_mesh_buffers(void)
+{
+    mesh_data data;
+    bool generated = mesh_generate_grid(CONFIG.mesh_grid, &data);
+    ASSERT(generated);
+    VkDeviceSize size = mesh_packed_size(&data, (vertex_layout) CONFIG.vertex_layout, &CTX.mesh);
+    void *packed = malloc(size);
+    ASSERT(packed);
+    mesh_pack(&data, &CTX.mesh, packed);
+    mesh_data_free(&data);
+
+    VkBufferCreateInfo buffer_info = { 0 };
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = size;
+    buffer_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+                      | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    gpu_allocation_desc desc = { 0 };
+    desc.required_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    VkResult result = gpu_memory_create_buffer(
+        CTX.allocator, &buffer_info, &desc, &CTX.mesh.buffer, &CTX.mesh.allocation
+    );
+    ASSERT(result == VK_SUCCESS);
+
+    // The first frame waits on the copies on the GPU, the CPU moves on right away
+    staging_upload_buffer(
+        CTX.staging, CTX.mesh.buffer, 0, packed, size, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+        VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT
+    );
+    staging_flush(CTX.staging);
+    free(packed);
+    log_debug(
+        "Uploading %u vertices and %u %s indices (%lu bytes)", CTX.mesh.vertex_count, CTX.mesh.index_count,
+        CTX.mesh.index_type == VK_INDEX_TYPE_UINT16 ? "16 bit" : "32 bit", size
+    );
+}
 
-    VkResult result = vkAllocateCommandBuffers(CTX.device, &alloc_info, &CTX.command_buffer);
+static void create_instance_buffers(void)
+{
+    uint32_t max_instances = CTX.device_caps.properties.limits.maxStorageBufferRange / sizeof(instance_data);
+    CTX.max_instance_count = CONFIG.instance_count;
+    if (CTX.max_instance_count > max_instances) {
+        log_warn("Clamping %u instances to the %u a storage buffer can hold", CONFIG.instance_count, max_instances);
+        CTX.max_instance_count = max_instances;
+    }
+    CTX.instance_count = CTX.max_instance_count;
+
+    VkDescriptorPoolSize pool_size = { 0 };
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = CTX.frames_in_flight;
+    VkDescriptorPoolCreateInfo pool_info = { 0 };
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = CTX.frames_in_flight;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    VkResult result = vkCreateDescriptorPool(CTX.device, &pool_info, NULL, &CTX.descriptor_pool);
+    ASSERT(result == VK_SUCCESS);
+
+    VkDescriptorSetLayout layouts[MAX_FRAMES_IN_FLIGHT];
+    VkDescriptorSet sets[MAX_FRAMES_IN_FLIGHT];
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++)
+        layouts[i] = CTX.descriptor_set_layout;
+    VkDescriptorSetAllocateInfo set_info = { 0 };
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = CTX.descriptor_pool;
+    set_info.descriptorSetCount = CTX.frames_in_flight;
+    set_info.pSetLayouts = layouts;
+    result = vkAllocateDescriptorSets(CTX.device, &set_info, sets);
     ASSERT(result == VK_SUCCESS);
+
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++) {
+        frame_data *frame = &CTX.frames[i];
+        VkBufferCreateInfo buffer_info = { 0 };
+        buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        buffer_info.size = (VkDeviceSize) CTX.max_instance_count * sizeof(instance_data);
+        buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        // Device local and host visible when the BAR allows it, the vertex shader reads every byte every frame
+        gpu_allocation_desc desc = { 0 };
+        desc.required_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+        desc.preferred_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+        result = gpu_memory_create_buffer(
+            CTX.allocator, &buffer_info, &desc, &frame->instance_buffer, &frame->instance_memory
+        );
+        ASSERT(result == VK_SUCCESS);
+        frame->descriptor_set = sets[i];
+
+        VkDescriptorBufferInfo descriptor_buffer = { 0 };
+        descriptor_buffer.buffer = frame->instance_buffer;
+        descriptor_buffer.range = VK_WHOLE_SIZE;
+        VkWriteDescriptorSet write = { 0 };
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = frame->descriptor_set;
+        write.dstBinding = 0;
+        write.descriptorCount = 1;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write.pBufferInfo = &descriptor_buffer;
+        vkUpdateDescriptorSets(CTX.device, 1, &write, 0, NULL);
+    }
+    log_debug("Created %u instance buffers of %u instances", CTX.frames_in_flight, CTX.max_instance_count);
+}
+
+static void create_culling(void)
+{
+    if (!CONFIG.gpu_culling)
+        return;
+    if (!CTX.device_caps.draw_indirect_count) {
+        log_warn("The device cannot draw with an indirect count, instances are not culled");
+        return;
+    }
+    if (CTX.max_instance_count > CTX.device_caps.properties.limits.maxDrawIndirectCount) {
+        log_warn("More instances than indirect draws the device allows, instances are not culled");
+        return;
+    }
+
+    VkBuffer instance_buffers[MAX_FRAMES_IN_FLIGHT];
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++)
+        instance_buffers[i] = CTX.frames[i].instance_buffer;
+    CTX.culler = culling_create(
+        CTX.device, CTX.allocator, CTX.pipeline_cache, instance_buffers, CTX.max_instance_count, CTX.frames_in_flight
+    );
+    ASSERT(CTX.culler);
+}
+
+static void create_particles(void)
+{
+    if (CONFIG.particle_count == 0)
+        return;
+
+    uint32_t count = CONFIG.particle_count;
+    uint32_t max_particles = CTX.device_caps.properties.limits.maxStorageBufferRange / sizeof(particle);
+    if (count > max_particles) {
+        log_warn("Clamping %u particles to the %u a storage buffer can hold", count, max_particles);
+        count = max_particles;
+    }
+    if (CTX.device_caps.compute_family == CTX.device_caps.graphics_family)
+        log_info("No separate compute queue family, particles are simulated on the graphics queue");
+    VkPipelineRenderingCreateInfo rendering_info = pipeline_rendering_info(true);
+    CTX.particles = particles_create(
+        CTX.device, CTX.allocator, CTX.compute_queue, CTX.device_caps.compute_family, CTX.device_caps.graphics_family,
+        CTX.render_pass, CTX.main_subpass, CTX.dynamic_rendering ? &rendering_info : NULL, CTX.pipeline_cache, count,
+        CTX.frames_in_flight
+    );
+    ASSERT(CTX.particles);
+}
+
+static void animate_instance_range(void *user, uint32_t begin, uint32_t end, uint32_t thread)
+{
+    (void) user;
+    (void) thread;
+    instances_animate(CTX.scene, begin, end - begin, CTX.instance_count, CTX.frame_index);
+}
+
+static void write_instance_range(void *user, uint32_t begin, uint32_t end, uint32_t thread)
+{
+    (void) thread;
+    frame_data *frame = user;
+    instances_write(frame->instance_memory.mapped, CTX.scene, begin, end - begin, CTX.instance_count);
+}
+
+static void update_instances(frame_data *frame)
+{
+    if (!CTX.scene || CTX.scene_instance_count != CTX.instance_count) {
+        scene_destroy(CTX.scene);
+        CTX.scene = instances_create_scene(CTX.instance_count);
+        ASSERT(CTX.scene);
+        CTX.scene_instance_count = CTX.instance_count;
+    }
+    jobs_parallel_for(CTX.jobs, animate_instance_range, NULL, CTX.instance_count, INSTANCE_UPDATE_GRAIN);
+    scene_update(CTX.scene, CTX.jobs);
+    jobs_parallel_for(CTX.jobs, write_instance_range, frame, CTX.instance_count, INSTANCE_UPDATE_GRAIN);
+    gpu_memory_flush(
+        CTX.allocator, &frame->instance_memory, 0, (VkDeviceSize) CTX.instance_count * sizeof(instance_data)
+    );
+}
+
+static void create_readback_buffers(void)
+{
+    if (!CONFIG.headless || !CONFIG.readback_path)
+        return;
+
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++) {
+        VkBufferCreateInfo buffer_info = { 0 };
+        buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        buffer_info.size = (VkDeviceSize) CTX.swap_chain_extent.width * CTX.swap_chain_extent.height * 4;
+        buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        // Uncached reads of write-combined memory are very slow on the CPU
+        gpu_allocation_desc desc = { 0 };
+        desc.required_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+        desc.preferred_flags = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+        VkResult result = gpu_memory_create_buffer(
+            CTX.allocator, &buffer_info, &desc, &CTX.readback_buffers[i], &CTX.readback_memory[i]
+        );
+        ASSERT(result == VK_SUCCESS);
+    }
+}
+
+static void record_readback_pass(VkCommandBuffer command_buffer, void *user)
+{
+    const graph_recording *recording = user;
+    VkBufferImageCopy region = { 0 };
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent.width = CTX.swap_chain_extent.width;
+    region.imageExtent.height = CTX.swap_chain_extent.height;
+    region.imageExtent.depth = 1;
+    vkCmdCopyImageToBuffer(
+        command_buffer, CTX.swap_chain_images[recording->main.image_index], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        CTX.readback_buffers[CTX.current_frame], 1, &region
+    );
+
+    VkBufferMemoryBarrier barrier = { 0 };
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = CTX.readback_buffers[CTX.current_frame];
+    barrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(
+        command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1, &barrier, 0, NULL
+    );
+}
+
+static void save_readback(const char *path)
+{
+    uint32_t slot = CTX.last_submitted_frame;
+    vkWaitForFences(CTX.device, 1, &CTX.frames[slot].in_flight_fence, VK_TRUE, UINT64_MAX);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        log_error("Could not open %s to save the rendered frame", path);
+        return;
+    }
+    gpu_memory_invalidate(CTX.allocator, &CTX.readback_memory[slot], 0, VK_WHOLE_SIZE);
+    // RGBA8 rows are tightly packed, PPM wants RGB
+    const unsigned char *pixels = CTX.readback_memory[slot].mapped;
+    size_t pixel_count = (size_t) CTX.swap_chain_extent.width * CTX.swap_chain_extent.height;
+    size_t lit_count = 0;
+    fprintf(file, "P6\n%u %u\n255\n", CTX.swap_chain_extent.width, CTX.swap_chain_extent.height);
+    for (size_t i = 0; i < pixel_count; i++) {
+        fwrite(pixels + i * 4, 1, 3, file);
+        if (pixels[i * 4] || pixels[i * 4 + 1] || pixels[i * 4 + 2])
+            lit_count++;
+    }
+    fclose(file);
+    log_info("Saved frame to %s, %zu of %zu pixels are not black", path, lit_count, pixel_count);
+    // Culled or missing geometry shows up as an all black frame
+    if (!lit_count)
+        log_warn("Nothing was drawn in the saved frame");
+}
+
+// Dynamic state is not inherited by secondary command buffers, each of them sets its own
+static void cmd_set_viewport(VkCommandBuffer command_buffer, VkExtent2D extent)
+{
+    VkViewport viewport = { 0 };
+    viewport.x = 0.0;
+    viewport.y = 0.0;
+    viewport.width = (float) extent.width;
+    viewport.height = (float) extent.height;
+    viewport.minDepth = 0.0;
+    viewport.maxDepth = 1.0;
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+    VkRect2D scissor = { 0 };
+    scissor.offset.x = 0;
+    scissor.offset.y = 0;
+    scissor.extent = extent;
+    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
 }
 
-static void record_command_buffer(VkCommandBuffer command_buffer, uint32_t image_index)
+// Begins a secondary command buffer continuing the subpass of the recording, or its dynamic rendering, from the pool
+// of the given thread
+static VkCommandBuffer begin_secondary(const draw_recording *recording, uint32_t thread)
 {
+    VkCommandBufferInheritanceInfo inheritance_info = { 0 };
+    inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    VkCommandBufferInheritanceRenderingInfo rendering_info = { 0 };
+    if (CTX.dynamic_rendering) {
+        rendering_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+        rendering_info.colorAttachmentCount = recording->depth_only ? 0 : 1;
+        rendering_info.pColorAttachmentFormats = &CTX.swap_chain_image_format;
+        rendering_info.depthAttachmentFormat = CTX.device_caps.depth_format;
+        rendering_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+        inheritance_info.pNext = &rendering_info;
+    } else {
+        inheritance_info.renderPass = CTX.render_pass;
+        inheritance_info.subpass = recording->subpass;
+        inheritance_info.framebuffer = target_framebuffer(recording->image_index);
+    }
+
     VkCommandBufferBeginInfo begin_info = { 0 };
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    begin_info.pInheritanceInfo = &inheritance_info;
 
+    VkCommandBuffer command_buffer = acquire_secondary_command_buffer(&recording->frame->threads[thread]);
     VkResult result = vkBeginCommandBuffer(command_buffer, &begin_info);
     ASSERT(result == VK_SUCCESS);
+    return command_buffer;
+}
+
+static void cmd_bind_instances(VkCommandBuffer command_buffer, const draw_recording *recording)
+{
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, recording->pipeline);
+    cmd_set_viewport(command_buffer, recording->extent);
+    vkCmdBindDescriptorSets(
+        command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, CTX.pipeline_layout, 0, 1, &recording->frame->descriptor_set,
+        0, NULL
+    );
+}
+
+static void record_draw_chunks(void *user, uint32_t begin, uint32_t end, uint32_t thread)
+{
+    draw_recording *recording = user;
+
+    for (uint32_t chunk = begin; chunk < end; chunk++) {
+        VkCommandBuffer command_buffer = begin_secondary(recording, thread);
+        uint32_t first_instance = (uint32_t) ((uint64_t) CTX.instance_count * chunk / recording->chunk_count);
+        uint32_t last_instance = (uint32_t) ((uint64_t) CTX.instance_count * (chunk + 1) / recording->chunk_count);
+        cmd_bind_instances(command_buffer, recording);
+        mesh_cmd_draw(command_buffer, &CTX.mesh, first_instance, last_instance - first_instance);
+
+        VkResult result = vkEndCommandBuffer(command_buffer);
+        ASSERT(result == VK_SUCCESS);
+        recording->secondaries[chunk] = command_buffer;
+    }
+}
+
+// A single indirect draw covers every instance, there is nothing worth splitting across threads
+static VkCommandBuffer record_culled_draws(const draw_recording *recording)
+{
+    VkCommandBuffer command_buffer = begin_secondary(recording, 0);
+    cmd_bind_instances(command_buffer, recording);
+    culling_cmd_draw(CTX.culler, command_buffer, CTX.current_frame, CTX.instance_count, &CTX.mesh);
+    VkResult result = vkEndCommandBuffer(command_buffer);
+    ASSERT(result == VK_SUCCESS);
+    return command_buffer;
+}
+
+// Records the instances into secondaries of the subpass of the recording, returns how many
+static uint32_t record_instance_draws(draw_recording *recording)
+{
+    if (CTX.culler) {
+        recording->secondaries[0] = record_culled_draws(recording);
+        return 1;
+    }
+    // One chunk of instances per thread, each recorded into a secondary command buffer by whichever thread runs it
+    recording->chunk_count = jobs_thread_count(CTX.jobs);
+    if (recording->chunk_count > CTX.instance_count)
+        recording->chunk_count = CTX.instance_count;
+    jobs_parallel_for(CTX.jobs, record_draw_chunks, recording, recording->chunk_count, 1);
+    return recording->chunk_count;
+}
+
+// Recorded by the main thread once the chunks are done, so the pool of thread 0 is free to use
+static VkCommandBuffer record_particles(const draw_recording *recording)
+{
+    VkCommandBuffer command_buffer = begin_secondary(recording, 0);
+    cmd_set_viewport(command_buffer, recording->extent);
+    particles_cmd_draw(CTX.particles, command_buffer, CTX.current_frame);
+    VkResult result = vkEndCommandBuffer(command_buffer);
+    ASSERT(result == VK_SUCCESS);
+    return command_buffer;
+}
 
+static void record_cull_pass(VkCommandBuffer command_buffer, void *user)
+{
+    (void) user;
+    // Instances are placed in clip space directly, there is no camera yet
+    mat4 view_projection = GLM_MAT4_IDENTITY_INIT;
+    culling_cmd_cull(CTX.culler, command_buffer, CTX.current_frame, CTX.instance_count, &CTX.mesh, view_projection);
+}
+
+static void record_main_pass(VkCommandBuffer command_buffer, void *user)
+{
+    const graph_recording *recording = user;
     VkRenderPassBeginInfo render_pass_info = { 0 };
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     render_pass_info.renderPass = CTX.render_pass;
-    render_pass_info.framebuffer = CTX.swap_chain_framebuffers[image_index];
+    render_pass_info.framebuffer = target_framebuffer(recording->main.image_index);
     render_pass_info.renderArea.offset = (VkOffset2D){ 0, 0 };
-    render_pass_info.renderArea.extent = CTX.swap_chain_extent;
-    // TODO: Find a better way to do this xd
-    VkClearValue clear_color;
-    clear_color.color.float32[0] = 0.0;
-    clear_color.color.float32[1] = 0.0;
-    clear_color.color.float32[2] = 0.0;
-    clear_color.color.float32[3] = 1.0;
-    render_pass_info.clearValueCount = 1;
-    render_pass_info.pClearValues = &clear_color;
-
-    // ========== BEGIN RENDER PASS ==========
-    vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, CTX.graphics_pipeline);
-    vkCmdDraw(command_buffer, 3, 1, 0, 0);
+    render_pass_info.renderArea.extent = recording->main.extent;
+    VkClearValue clear_values[2] = { 0 };
+    clear_values[0].color.float32[3] = 1.0f;
+    clear_values[1].depthStencil.depth = 1.0f;
+    render_pass_info.clearValueCount = LENGTH_OF(clear_values);
+    render_pass_info.pClearValues = clear_values;
+
+    vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    if (recording->prepass_count) {
+        vkCmdExecuteCommands(command_buffer, recording->prepass_count, recording->prepass.secondaries);
+        vkCmdNextSubpass(command_buffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    }
+    vkCmdExecuteCommands(command_buffer, recording->main_count, recording->main.secondaries);
     vkCmdEndRenderPass(command_buffer);
-    // =========== END RENDER PASS ===========
+}
+
+static void cmd_begin_rendering(
+    VkCommandBuffer command_buffer, const draw_recording *recording, const VkRenderingAttachmentInfo *color,
+    const VkRenderingAttachmentInfo *depth
+)
+{
+    VkRenderingInfo rendering_info = { 0 };
+    rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+    rendering_info.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT;
+    rendering_info.renderArea.offset = (VkOffset2D){ 0, 0 };
+    rendering_info.renderArea.extent = recording->extent;
+    rendering_info.layerCount = 1;
+    rendering_info.colorAttachmentCount = color ? 1 : 0;
+    rendering_info.pColorAttachments = color;
+    rendering_info.pDepthAttachment = depth;
+    CTX.cmd_begin_rendering(command_buffer, &rendering_info);
+}
+
+// Only with dynamic rendering, the render pass has it as its first subpass
+static void record_depth_prepass(VkCommandBuffer command_buffer, void *user)
+{
+    const graph_recording *recording = user;
+    VkRenderingAttachmentInfo depth = { 0 };
+    depth.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+    depth.imageView = render_graph_image_view(CTX.graph, CTX.depth_resource);
+    depth.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depth.clearValue.depthStencil.depth = 1.0f;
+
+    cmd_begin_rendering(command_buffer, &recording->prepass, NULL, &depth);
+    vkCmdExecuteCommands(command_buffer, recording->prepass_count, recording->prepass.secondaries);
+    CTX.cmd_end_rendering(command_buffer);
+}
+
+// record_main_pass with dynamic rendering, the same attachments and clears without the pre-pass subpass
+static void record_main_rendering(VkCommandBuffer command_buffer, void *user)
+{
+    const graph_recording *recording = user;
+    VkRenderingAttachmentInfo color = { 0 };
+    color.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+    color.imageView = CTX.scaled_rendering ? render_graph_image_view(CTX.graph, CTX.scene_resource)
+                                           : CTX.swap_chain_image_views[recording->main.image_index];
+    color.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    color.clearValue.color.float32[3] = 1.0f;
+
+    // Loaded from the pre-pass when there is one
+    VkRenderingAttachmentInfo depth = { 0 };
+    depth.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+    depth.imageView = render_graph_image_view(CTX.graph, CTX.depth_resource);
+    depth.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth.loadOp = CONFIG.depth_prepass ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth.clearValue.depthStencil.depth = 1.0f;
+
+    cmd_begin_rendering(command_buffer, &recording->main, &color, &depth);
+    vkCmdExecuteCommands(command_buffer, recording->main_count, recording->main.secondaries);
+    CTX.cmd_end_rendering(command_buffer);
+}
+
+// Stretches the rendered corner of the scene target over the whole output image
+static void record_upscale_pass(VkCommandBuffer command_buffer, void *user)
+{
+    const graph_recording *recording = user;
+    VkImageBlit region = { 0 };
+    region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.srcSubresource.layerCount = 1;
+    region.srcOffsets[1] = (VkOffset3D){ (int32_t) recording->main.extent.width,
+                                         (int32_t) recording->main.extent.height, 1 };
+    region.dstSubresource = region.srcSubresource;
+    region.dstOffsets[1] = (VkOffset3D){ (int32_t) CTX.swap_chain_extent.width,
+                                         (int32_t) CTX.swap_chain_extent.height, 1 };
+    vkCmdBlitImage(
+        command_buffer, render_graph_image(CTX.graph, CTX.scene_resource), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        render_graph_image(CTX.graph, CTX.output_resource), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region,
+        VK_FILTER_LINEAR
+    );
+}
+
+// The depth buffer and the scene target are sized after the swap chain, so the graph is rebuilt with it
+static void create_render_graph(void)
+{
+    render_graph *graph = render_graph_create(CTX.device, CTX.allocator);
+    ASSERT(graph);
+    // Headless targets stay in the layout the readback copied them from
+    VkImageLayout final_layout = CONFIG.headless ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    CTX.output_resource = render_graph_import_image(
+        graph, "output", CTX.swap_chain_image_format, VK_IMAGE_LAYOUT_UNDEFINED, output_wait_stage(), final_layout
+    );
+    VkExtent2D extent = target_extent();
+    CTX.depth_resource = render_graph_create_image(graph, "depth", CTX.device_caps.depth_format, extent);
+    render_graph_resource color = CTX.output_resource;
+    if (CTX.scaled_rendering) {
+        CTX.scene_resource = render_graph_create_image(graph, "scene", CTX.swap_chain_image_format, extent);
+        color = CTX.scene_resource;
+    }
+
+    // Writes the draws of the main pass, which synchronizes with it on its own
+    if (CTX.culler)
+        render_graph_add_pass(graph, "cull", record_cull_pass, true);
+    // The graph orders the two with a barrier where the render pass has a subpass dependency
+    if (CTX.dynamic_rendering && CONFIG.depth_prepass) {
+        uint32_t prepass = render_graph_add_pass(graph, "depth prepass", record_depth_prepass, false);
+        render_graph_use(graph, prepass, CTX.depth_resource, RENDER_GRAPH_DEPTH_ATTACHMENT);
+    }
+    render_graph_record_fn record_main = CTX.dynamic_rendering ? record_main_rendering : record_main_pass;
+    uint32_t main_pass = render_graph_add_pass(graph, "main pass", record_main, false);
+    render_graph_use(graph, main_pass, color, RENDER_GRAPH_COLOR_ATTACHMENT);
+    render_graph_use(graph, main_pass, CTX.depth_resource, RENDER_GRAPH_DEPTH_ATTACHMENT);
+    if (CTX.scaled_rendering) {
+        uint32_t upscale_pass = render_graph_add_pass(graph, "upscale", record_upscale_pass, false);
+        render_graph_use(graph, upscale_pass, CTX.scene_resource, RENDER_GRAPH_TRANSFER_SRC);
+        render_graph_use(graph, upscale_pass, CTX.output_resource, RENDER_GRAPH_TRANSFER_DST);
+    }
+    // The copy to the host is the side effect
+    if (CTX.readback_buffers[0] != VK_NULL_HANDLE) {
+        uint32_t readback_pass = render_graph_add_pass(graph, "readback", record_readback_pass, true);
+        render_graph_use(graph, readback_pass, CTX.output_resource, RENDER_GRAPH_TRANSFER_SRC);
+    }
+    bool compiled = render_graph_compile(graph);
+    ASSERT(compiled);
+    CTX.graph = graph;
+}
+
+static void record_command_buffer(VkCommandBuffer command_buffer, uint32_t image_index, staging_wait *upload_wait)
+{
+    VkCommandBufferBeginInfo begin_info = { 0 };
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    VkResult result = vkBeginCommandBuffer(command_buffer, &begin_info);
+    ASSERT(result == VK_SUCCESS);
+
+    bool resolved = gpu_profiler_begin_frame(CTX.profiler, command_buffer, CTX.current_frame);
+    frame_data *frame = &CTX.frames[CTX.current_frame];
+    VkExtent2D render_extent = CTX.swap_chain_extent;
+    if (CTX.scaled_rendering) {
+        // When resolved, the results are of the previous frame of the slot, rendered at the scale the slot still
+        // holds. Otherwise they belong to another frame, or scale, and the controller is given no timing.
+        double gpu_ms = resolved ? gpu_last_frame_ms() : 0.0;
+        frame->render_scale = resolution_controller_update(&CTX.resolution, gpu_ms, frame->render_scale);
+        render_extent = scaled_extent(frame->render_scale);
+    }
+    staging_flush(CTX.staging);
+    staging_record_acquires(CTX.staging, command_buffer, upload_wait);
+
+    graph_recording recording = { 0 };
+    recording.main.frame = frame;
+    recording.main.image_index = image_index;
+    recording.main.extent = render_extent;
+    recording.main.subpass = CTX.main_subpass;
+    recording.main.pipeline = CTX.graphics_pipeline;
+    recording.main_count = record_instance_draws(&recording.main);
+    if (CTX.particles)
+        recording.main.secondaries[recording.main_count++] = record_particles(&recording.main);
+
+    // The pre-pass draws the same instances, culled or not, with the depth only pipeline
+    if (CTX.depth_prepass_pipeline != VK_NULL_HANDLE) {
+        recording.prepass.frame = frame;
+        recording.prepass.image_index = image_index;
+        recording.prepass.extent = render_extent;
+        recording.prepass.subpass = 0;
+        recording.prepass.depth_only = true;
+        recording.prepass.pipeline = CTX.depth_prepass_pipeline;
+        recording.prepass_count = record_instance_draws(&recording.prepass);
+    }
+
+    render_graph_bind_image(CTX.graph, CTX.output_resource, CTX.swap_chain_images[image_index]);
+    render_graph_execute(CTX.graph, command_buffer, CTX.profiler, &recording);
+    gpu_profiler_end_frame(CTX.profiler, command_buffer);
 
     result = vkEndCommandBuffer(command_buffer);
     ASSERT(result == VK_SUCCESS);
 }
 
+// Along with the fences tracking the images, one per swap chain image
+static void create_image_sync_objects(void)
+{
+    CTX.images_in_flight = calloc(sizeof *CTX.images_in_flight, CTX.swap_chain_images_nb);
+    ASSERT(CTX.images_in_flight);
+    CTX.render_finished_semaphores = calloc(sizeof *CTX.render_finished_semaphores, CTX.swap_chain_images_nb);
+    ASSERT(CTX.render_finished_semaphores);
+
+    VkSemaphoreCreateInfo semaphore_info = { 0 };
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    for (uint32_t i = 0; i < CTX.swap_chain_images_nb; i++) {
+        VkResult result = vkCreateSemaphore(CTX.device, &semaphore_info, NULL, &CTX.render_finished_semaphores[i]);
+        ASSERT(result == VK_SUCCESS);
+    }
+}
+
 static void create_sync_objects(void)
 {
     VkSemaphoreCreateInfo semaphore_info = { 0 };
@@ -866,79 +1881,397 @@ static void create_sync_objects(void)
     fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
     fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-    VkResult result;
-    result = vkCreateSemaphore(CTX.device, &semaphore_info, NULL, &CTX.image_available_semaphore);
-    ASSERT(result == VK_SUCCESS);
-    result = vkCreateSemaphore(CTX.device, &semaphore_info, NULL, &CTX.render_finished_semaphore);
-    ASSERT(result == VK_SUCCESS);
-    result = vkCreateFence(CTX.device, &fence_info, NULL, &CTX.in_flight_fence);
-    ASSERT(result == VK_SUCCESS);
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++) {
+        frame_data *frame = &CTX.frames[i];
+        VkResult result;
+        result = vkCreateSemaphore(CTX.device, &semaphore_info, NULL, &frame->image_available_semaphore);
+        ASSERT(result == VK_SUCCESS);
+        result = vkCreateFence(CTX.device, &fence_info, NULL, &frame->in_flight_fence);
+        ASSERT(result == VK_SUCCESS);
+    }
+    create_image_sync_objects();
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (double) (end->tv_sec - start->tv_sec) * 1e3 + (double) (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+typedef enum {
+    STAGE_INSTANCE,
+    STAGE_DEBUG_MESSENGER,
+    STAGE_SURFACE,
+    STAGE_PHYSICAL_DEVICE,
+    STAGE_LOGICAL_DEVICE,
+    STAGE_ALLOCATOR,
+    STAGE_STAGING_RING,
+    STAGE_SURFACE_FORMAT,
+    STAGE_RENDER_SCALE,
+    STAGE_SWAP_CHAIN,
+    STAGE_IMAGE_VIEWS,
+    STAGE_RENDER_PASS,
+    STAGE_PIPELINE_CACHE,
+    STAGE_DESCRIPTOR_SET_LAYOUT,
+    STAGE_PIPELINE_LAYOUT,
+    STAGE_GRAPHICS_PIPELINE,
+    STAGE_FRAMEBUFFERS,
+    STAGE_COMMAND_POOL,
+    STAGE_COMMAND_BUFFERS,
+    STAGE_THREAD_COMMAND_POOLS,
+    STAGE_GPU_PROFILER,
+    STAGE_MESH_BUFFERS,
+    STAGE_INSTANCE_BUFFERS,
+    STAGE_SYNC_OBJECTS,
+    STAGE_READBACK_BUFFERS,
+    STAGE_PARTICLES,
+    STAGE_CULLING,
+    STAGE_RENDER_GRAPH,
+    STAGE_COUNT,
+} init_stage_id;
+
+#define AFTER(stage) (1u << (stage))
+#define ALL_STAGES ((1u << STAGE_COUNT) - 1)
+
+// Stages write disjoint parts of CTX and only share thread safe objects, the allocator has its own lock. They must
+// not use the job system, a stage waiting on jobs could end up running the graph below itself.
+typedef struct {
+    const char *name;
+    void (*run)(void);
+    uint32_t dependencies;
+    // GLFW window functions may only be called from the main thread
+    bool main_thread;
+} init_stage;
+
+static const init_stage INIT_STAGES[STAGE_COUNT] = {
+    [STAGE_INSTANCE] = { "instance", create_instance, 0, false },
+    [STAGE_DEBUG_MESSENGER] = { "debug messenger", setup_debug_messenger, AFTER(STAGE_INSTANCE), false },
+    [STAGE_SURFACE] = { "surface", create_surface, AFTER(STAGE_INSTANCE), false },
+    [STAGE_PHYSICAL_DEVICE] = { "physical device", pick_physical_device, AFTER(STAGE_SURFACE), false },
+    [STAGE_LOGICAL_DEVICE] = { "logical device", create_logical_device, AFTER(STAGE_PHYSICAL_DEVICE), false },
+    [STAGE_ALLOCATOR] = { "allocator", create_allocator, AFTER(STAGE_LOGICAL_DEVICE), false },
+    [STAGE_STAGING_RING] = { "staging ring", create_staging_ring, AFTER(STAGE_ALLOCATOR), false },
+    [STAGE_SURFACE_FORMAT] = { "surface format", choose_surface_format, AFTER(STAGE_PHYSICAL_DEVICE), false },
+    [STAGE_RENDER_SCALE] = { "render scale", choose_render_scale, AFTER(STAGE_SURFACE_FORMAT), false },
+    [STAGE_SWAP_CHAIN] = { "swap chain", create_swap_chain,
+                           AFTER(STAGE_RENDER_SCALE) | AFTER(STAGE_LOGICAL_DEVICE) | AFTER(STAGE_ALLOCATOR), true },
+    [STAGE_IMAGE_VIEWS] = { "image views", create_image_views, AFTER(STAGE_SWAP_CHAIN), false },
+    [STAGE_RENDER_PASS] = { "render pass", create_render_pass,
+                            AFTER(STAGE_RENDER_SCALE) | AFTER(STAGE_LOGICAL_DEVICE), false },
+    [STAGE_PIPELINE_CACHE] = { "pipeline cache", create_pipeline_cache, AFTER(STAGE_LOGICAL_DEVICE), false },
+    [STAGE_DESCRIPTOR_SET_LAYOUT] = { "descriptor set layout", create_descriptor_set_layout,
+                                      AFTER(STAGE_LOGICAL_DEVICE), false },
+    [STAGE_PIPELINE_LAYOUT] = { "pipeline layout", create_pipeline_layout, AFTER(STAGE_DESCRIPTOR_SET_LAYOUT),
+                                false },
+    [STAGE_GRAPHICS_PIPELINE] = { "graphics pipeline", create_graphics_pipeline,
+                                  AFTER(STAGE_RENDER_PASS) | AFTER(STAGE_PIPELINE_CACHE) | AFTER(STAGE_PIPELINE_LAYOUT),
+                                  false },
+    [STAGE_FRAMEBUFFERS] = { "framebuffers", create_framebuffers,
+                             AFTER(STAGE_IMAGE_VIEWS) | AFTER(STAGE_RENDER_GRAPH) | AFTER(STAGE_RENDER_PASS),
+                             false },
+    [STAGE_COMMAND_POOL] = { "command pool", create_command_pool, AFTER(STAGE_LOGICAL_DEVICE), false },
+    [STAGE_COMMAND_BUFFERS] = { "command buffers", create_command_buffers, AFTER(STAGE_COMMAND_POOL), false },
+    [STAGE_THREAD_COMMAND_POOLS] = { "thread command pools", create_thread_command_pools,
+                                     AFTER(STAGE_LOGICAL_DEVICE), false },
+    [STAGE_GPU_PROFILER] = { "gpu profiler", create_gpu_profiler, AFTER(STAGE_LOGICAL_DEVICE), false },
+    [STAGE_MESH_BUFFERS] = { "mesh buffers", create_mesh_buffers, AFTER(STAGE_STAGING_RING), false },
+    [STAGE_INSTANCE_BUFFERS] = { "instance buffers", create_instance_buffers,
+                                 AFTER(STAGE_ALLOCATOR) | AFTER(STAGE_DESCRIPTOR_SET_LAYOUT), false },
+    [STAGE_SYNC_OBJECTS] = { "sync objects", create_sync_objects, AFTER(STAGE_SWAP_CHAIN), false },
+    [STAGE_READBACK_BUFFERS] = { "readback buffers", create_readback_buffers,
+                                 AFTER(STAGE_SWAP_CHAIN) | AFTER(STAGE_ALLOCATOR), false },
+    [STAGE_PARTICLES] = { "particles", create_particles,
+                          AFTER(STAGE_ALLOCATOR) | AFTER(STAGE_RENDER_PASS) | AFTER(STAGE_PIPELINE_CACHE), false },
+    [STAGE_CULLING] = { "culling", create_culling, AFTER(STAGE_INSTANCE_BUFFERS) | AFTER(STAGE_PIPELINE_CACHE), false },
+    [STAGE_RENDER_GRAPH] = { "render graph", create_render_graph,
+                             AFTER(STAGE_READBACK_BUFFERS) | AFTER(STAGE_CULLING), false },
+};
+
+// At most this many threads run stages, the graph is not wider than that
+#define INIT_THREADS 4
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint32_t started;
+    uint32_t done;
+    double ms[STAGE_COUNT];
+    uint32_t threads[STAGE_COUNT];
+} init_graph;
+
+__attribute__((pure)) static int next_init_stage(const init_graph *graph, bool main_thread)
+{
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const init_stage *stage = &INIT_STAGES[i];
+        if (!(graph->started & AFTER(i)) && (graph->done & stage->dependencies) == stage->dependencies
+            && (main_thread || !stage->main_thread))
+            return i;
+    }
+    return -1;
+}
+
+// Every thread runs ready stages until all are done. The main thread always takes part, so a stage restricted to it
+// cannot be left behind.
+static void run_init_stages(void *user, uint32_t begin, uint32_t end, uint32_t thread)
+{
+    init_graph *graph = user;
+    (void) begin;
+    (void) end;
+
+    pthread_mutex_lock(&graph->lock);
+    while (graph->done != ALL_STAGES) {
+        int stage = next_init_stage(graph, thread == 0);
+        if (stage < 0) {
+            pthread_cond_wait(&graph->changed, &graph->lock);
+            continue;
+        }
+        graph->started |= AFTER(stage);
+        pthread_mutex_unlock(&graph->lock);
+
+        struct timespec start;
+        struct timespec end_time;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        INIT_STAGES[stage].run();
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+
+        pthread_mutex_lock(&graph->lock);
+        graph->ms[stage] = elapsed_ms(&start, &end_time);
+        graph->threads[stage] = thread;
+        graph->done |= AFTER(stage);
+        pthread_cond_broadcast(&graph->changed);
+    }
+    pthread_mutex_unlock(&graph->lock);
 }
 
 static void init_vulkan(void)
 {
-    create_instance();
-    setup_debug_messenger();
-    create_surface();
-    pick_physical_device();
-    create_logical_device();
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+
+    CTX.frames_in_flight = CONFIG.frames_in_flight;
+    CTX.jobs = jobs_create(CONFIG.thread_count);
+    ASSERT(CTX.jobs);
+    CTX.frame_stats = frame_stats_create(FRAME_STATS_WINDOW);
+    ASSERT(CTX.frame_stats);
+    frame_limiter_init(&CTX.frame_limiter, CONFIG.fps_limit);
+
+    init_graph graph = { 0 };
+    pthread_mutex_init(&graph.lock, NULL);
+    pthread_cond_init(&graph.changed, NULL);
+    uint32_t threads = jobs_thread_count(CTX.jobs) < INIT_THREADS ? jobs_thread_count(CTX.jobs) : INIT_THREADS;
+    jobs_parallel_for(CTX.jobs, run_init_stages, &graph, threads, 1);
+    pthread_cond_destroy(&graph.changed);
+    pthread_mutex_destroy(&graph.lock);
+
+    gpu_memory_log_stats(CTX.allocator);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+    double stages_ms = 0.0;
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        log_debug("init: %-22s %8.3f ms on thread %u", INIT_STAGES[i].name, graph.ms[i], graph.threads[i]);
+        stages_ms += graph.ms[i];
+    }
+    log_debug(
+        "init: took %.3f ms for %.3f ms of stages on %u threads", elapsed_ms(&start, &end), stages_ms, threads
+    );
+}
+
+static void destroy_retired_swap_chain(retired_swap_chain *retired)
+{
+    for (uint32_t i = 0; i < retired->framebuffer_count; i++)
+        vkDestroyFramebuffer(CTX.device, retired->framebuffers[i], NULL);
+    for (uint32_t i = 0; i < retired->image_count; i++)
+        vkDestroyImageView(CTX.device, retired->image_views[i], NULL);
+    if (retired->scene_framebuffer != VK_NULL_HANDLE)
+        vkDestroyFramebuffer(CTX.device, retired->scene_framebuffer, NULL);
+    for (uint32_t i = 0; i < retired->image_count; i++)
+        vkDestroySemaphore(CTX.device, retired->render_finished_semaphores[i], NULL);
+    free(retired->render_finished_semaphores);
+    free(retired->framebuffers);
+    free(retired->image_views);
+    free(retired->images);
+    render_graph_destroy(retired->graph);
+    vkDestroySwapchainKHR(CTX.device, retired->swap_chain, NULL);
+}
+
+// Destroys what the frames that completed no longer need, or everything once the device is idle
+static void release_retired_swap_chains(bool device_idle)
+{
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < CTX.retired_swap_chain_count; i++) {
+        retired_swap_chain *retired = &CTX.retired_swap_chains[i];
+        if (device_idle || CTX.frame_index >= retired->release_frame)
+            destroy_retired_swap_chain(retired);
+        else
+            CTX.retired_swap_chains[kept++] = *retired;
+    }
+    CTX.retired_swap_chain_count = kept;
+}
+
+// Only the swap chain and what depends on its images are rebuilt. The old ones stay alive until the frames that
+// were recorded against them complete, so nothing waits for the device to go idle.
+static void recreate_swap_chain(void)
+{
+    int width;
+    int height;
+    glfwGetFramebufferSize(CTX.window, &width, &height);
+    if (width == 0 || height == 0) {
+        // Minimized, there is nothing to present to until the window comes back
+        glfwWaitEvents();
+        return;
+    }
+
+    if (CTX.retired_swap_chain_count == LENGTH_OF(CTX.retired_swap_chains)) {
+        // Resizing faster than frames complete, rare enough that stalling is fine
+        vkDeviceWaitIdle(CTX.device);
+        release_retired_swap_chains(true);
+    }
+    retired_swap_chain *retired = &CTX.retired_swap_chains[CTX.retired_swap_chain_count++];
+    retired->swap_chain = CTX.swap_chain;
+    retired->images = CTX.swap_chain_images;
+    retired->image_views = CTX.swap_chain_image_views;
+    retired->framebuffers = CTX.swap_chain_framebuffers;
+    retired->framebuffer_count = CTX.swap_chain_framebuffers_nb;
+    retired->image_count = CTX.swap_chain_images_nb;
+    retired->render_finished_semaphores = CTX.render_finished_semaphores;
+    retired->scene_framebuffer = CTX.scene_framebuffer;
+    retired->graph = CTX.graph;
+    // Frames up to frame_index - 1 may use them, the last of those is known complete when the frame
+    // frames_in_flight later waits on its slot
+    retired->release_frame = CTX.frame_index + CTX.frames_in_flight - 1;
+
     create_swap_chain();
     create_image_views();
-    create_render_pass();
-    create_graphics_pipeline();
+    create_render_graph();
     create_framebuffers();
-    create_command_pool();
-    create_command_buffer();
-    create_sync_objects();
+
+    // The fences tracked images of the old swap chain, which are covered by release_frame, and its presents may
+    // still wait on the retired semaphores
+    free(CTX.images_in_flight);
+    create_image_sync_objects();
+
+    CTX.swap_chain_outdated = false;
+    log_debug(
+        "Recreated the swap chain with %u images of %ux%u", CTX.swap_chain_images_nb, CTX.swap_chain_extent.width,
+        CTX.swap_chain_extent.height
+    );
+}
+
+// Frame to frame time, so it covers everything the CPU does between two frames and any wait on the GPU
+static void record_frame_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    if (CTX.last_frame_start.tv_sec || CTX.last_frame_start.tv_nsec)
+        frame_stats_add(CTX.frame_stats, elapsed_ms(&CTX.last_frame_start, &now));
+    CTX.last_frame_start = now;
+
+    if (frame_stats_window_full(CTX.frame_stats)) {
+        frame_stats_log(CTX.frame_stats);
+        log_gpu_timings();
+        log_culling();
+        log_render_scale();
+    }
 }
 
 static void draw_frame(void)
 {
-    // Wait for the previous frame to have been rendered
-    vkWaitForFences(CTX.device, 1, &CTX.in_flight_fence, VK_TRUE, UINT64_MAX);
-    vkResetFences(CTX.device, 1, &CTX.in_flight_fence);
-    // Now we are good to go
-    static struct timespec start = { 0 };
-    static size_t timer = 0;
-    const size_t frames_to_count = 1000;
+    frame_data *frame = &CTX.frames[CTX.current_frame];
+
+    // Wait for the last frame that used this slot to have been rendered
+    vkWaitForFences(CTX.device, 1, &frame->in_flight_fence, VK_TRUE, UINT64_MAX);
+    release_retired_swap_chains(false);
+    if (CTX.swap_chain_outdated) {
+        recreate_swap_chain();
+        if (CTX.swap_chain_outdated)
+            return;
+    }
+    record_frame_time();
 
-    if (timer++ > frames_to_count) {
-        timer = 0;
-        struct timespec tmp;
-        clock_gettime(CLOCK_MONOTONIC_RAW, &tmp);
-        size_t total_frame_times = (size_t) ((tmp.tv_sec - start.tv_sec) * 1000000
-                                             + (tmp.tv_nsec - start.tv_nsec) / 1000);
-        log_debug("Took %lu us", total_frame_times / frames_to_count);
-        start = tmp;
+    // Headless targets are owned by the frame slots, there is nothing to acquire
+    uint32_t image_index = CTX.current_frame;
+    if (!CONFIG.headless) {
+        VkResult result = vkAcquireNextImageKHR(
+            CTX.device, CTX.swap_chain, UINT64_MAX, frame->image_available_semaphore, VK_NULL_HANDLE, &image_index
+        );
+        // Nothing was acquired and the fence is still signaled, try again with a new swap chain next frame
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            CTX.swap_chain_outdated = true;
+            return;
+        }
+        // A suboptimal image was still acquired and its semaphore will signal, so it is rendered and presented first
+        if (result == VK_SUBOPTIMAL_KHR)
+            CTX.swap_chain_outdated = true;
+        else
+            ASSERT(result == VK_SUCCESS);
     }
 
-    uint32_t image_index;
-    vkAcquireNextImageKHR(
-        CTX.device, CTX.swap_chain, UINT64_MAX, CTX.image_available_semaphore, VK_NULL_HANDLE, &image_index
-    );
-    vkResetCommandBuffer(CTX.command_buffer, 0);
-    record_command_buffer(CTX.command_buffer, image_index);
+    // The image can come back before the frame that last rendered to it has retired
+    if (CTX.images_in_flight[image_index] != VK_NULL_HANDLE)
+        vkWaitForFences(CTX.device, 1, &CTX.images_in_flight[image_index], VK_TRUE, UINT64_MAX);
+    CTX.images_in_flight[image_index] = frame->in_flight_fence;
+    // Now we are good to go
+    vkResetFences(CTX.device, 1, &frame->in_flight_fence);
+
+    for (uint32_t t = 0; t < jobs_thread_count(CTX.jobs); t++) {
+        vkResetCommandPool(CTX.device, frame->threads[t].pool, 0);
+        frame->threads[t].used = 0;
+    }
+    // Submitted first so that the compute queue can start on it while this frame is recorded
+    uint64_t particles_value = 0;
+    if (CTX.particles)
+        particles_value = particles_simulate(CTX.particles, CTX.current_frame, PARTICLE_STEP);
+    update_instances(frame);
+    vkResetCommandBuffer(frame->command_buffer, 0);
+    staging_wait upload_wait;
+    record_command_buffer(frame->command_buffer, image_index, &upload_wait);
+
+    // Binary semaphores ignore their entry of the timeline values
+    VkSemaphore wait_semaphores[3];
+    VkPipelineStageFlags wait_stages[3];
+    uint64_t wait_values[3] = { 0 };
+    uint32_t wait_count = 0;
+    if (!CONFIG.headless) {
+        wait_semaphores[wait_count] = frame->image_available_semaphore;
+        wait_stages[wait_count++] = output_wait_stage();
+    }
+    if (upload_wait.value) {
+        wait_semaphores[wait_count] = upload_wait.semaphore;
+        wait_values[wait_count] = upload_wait.value;
+        wait_stages[wait_count++] = upload_wait.stages;
+    }
+    // Only the vertex input of the particle draw depends on the step, the rest of the frame overlaps it
+    if (particles_value) {
+        wait_semaphores[wait_count] = particles_timeline(CTX.particles);
+        wait_values[wait_count] = particles_value;
+        wait_stages[wait_count++] = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    }
+    VkTimelineSemaphoreSubmitInfo timeline_info = { 0 };
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.waitSemaphoreValueCount = wait_count;
+    timeline_info.pWaitSemaphoreValues = wait_values;
 
     VkSubmitInfo submit_info = { 0 };
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    VkSemaphore wait_semaphores[] = {
-        CTX.image_available_semaphore,
-    };
-    VkPipelineStageFlags wait_stages[] = {
-        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-    };
-    submit_info.waitSemaphoreCount = 1;
+    submit_info.pNext = &timeline_info;
+    submit_info.waitSemaphoreCount = wait_count;
     submit_info.pWaitSemaphores = wait_semaphores;
     submit_info.pWaitDstStageMask = wait_stages;
     submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &CTX.command_buffer;
+    submit_info.pCommandBuffers = &frame->command_buffer;
     VkSemaphore signal_semaphores[] = {
-        CTX.render_finished_semaphore,
+        CTX.render_finished_semaphores[image_index],
     };
-    submit_info.signalSemaphoreCount = 1;
+    submit_info.signalSemaphoreCount = CONFIG.headless ? 0 : 1;
     submit_info.pSignalSemaphores = signal_semaphores;
-    VkResult result = vkQueueSubmit(CTX.graphics_queue, 1, &submit_info, CTX.in_flight_fence);
+    VkResult result = vkQueueSubmit(CTX.graphics_queue, 1, &submit_info, frame->in_flight_fence);
     ASSERT(result == VK_SUCCESS);
+    CTX.last_submitted_frame = CTX.current_frame;
+    CTX.frame_index++;
+
+    if (CONFIG.headless) {
+        CTX.current_frame = (CTX.current_frame + 1) % CTX.frames_in_flight;
+        return;
+    }
 
     VkPresentInfoKHR present_info = { 0 };
     present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -951,51 +2284,166 @@ static void draw_frame(void)
     present_info.pSwapchains = swap_chains;
     present_info.pImageIndices = &image_index;
     result = vkQueuePresentKHR(CTX.present_queue, &present_info);
-    ASSERT(result == VK_SUCCESS);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+        CTX.swap_chain_outdated = true;
+    else
+        ASSERT(result == VK_SUCCESS);
+
+    CTX.current_frame = (CTX.current_frame + 1) % CTX.frames_in_flight;
+}
+
+static bool should_close(uint64_t frame)
+{
+    if (CONFIG.frame_count != 0 && frame >= CONFIG.frame_count)
+        return true;
+    return !CONFIG.headless && glfwWindowShouldClose(CTX.window);
+}
+
+// Renders BENCHMARK_FRAMES frames at every power of 4 instances up to --instances and reports the frame time
+static void run_instance_benchmark(void)
+{
+    uint64_t frame = 0;
+    for (uint32_t count = 1;; count = count > CTX.max_instance_count / 4 ? CTX.max_instance_count : count * 4) {
+        CTX.instance_count = count;
+        // Let every frame slot pick up the new count before timing
+        for (uint32_t i = 0; i < BENCHMARK_WARMUP_FRAMES; i++, frame++) {
+            if (!CONFIG.headless)
+                glfwPollEvents();
+            draw_frame();
+        }
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        for (uint32_t i = 0; i < BENCHMARK_FRAMES && !should_close(frame); i++, frame++) {
+            if (!CONFIG.headless)
+                glfwPollEvents();
+            draw_frame();
+        }
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        if (should_close(frame))
+            break;
+
+        double frame_ms = elapsed_ms(&start, &end) / BENCHMARK_FRAMES;
+        log_info(
+            "benchmark: %8u instances, %8.3f ms/frame (GPU %8.3f ms), %8.2f M instances/s", count, frame_ms,
+            gpu_frame_ms(), (double) count / frame_ms / 1e3
+        );
+        if (count == CTX.max_instance_count)
+            break;
+    }
 }
 
 static void main_loop(void)
 {
-    while (!glfwWindowShouldClose(CTX.window)) {
-        glfwPollEvents();
-        draw_frame();
+    if (CONFIG.instance_benchmark) {
+        run_instance_benchmark();
+    } else {
+        for (uint64_t frame = 0; !should_close(frame); frame++) {
+            frame_limiter_wait(&CTX.frame_limiter);
+            if (!CONFIG.headless)
+                glfwPollEvents();
+            draw_frame();
+        }
     }
 
     vkDeviceWaitIdle(CTX.device);
+    if (CTX.readback_buffers[CTX.last_submitted_frame] != VK_NULL_HANDLE)
+        save_readback(CONFIG.readback_path);
+    frame_stats_log(CTX.frame_stats);
+    if (CONFIG.frame_stats_path)
+        frame_stats_export(CTX.frame_stats, CONFIG.frame_stats_path);
 }
 
 static void cleanup(void)
 {
-    vkDestroySemaphore(CTX.device, CTX.image_available_semaphore, NULL);
-    vkDestroySemaphore(CTX.device, CTX.render_finished_semaphore, NULL);
-    vkDestroyFence(CTX.device, CTX.in_flight_fence, NULL);
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++) {
+        vkDestroySemaphore(CTX.device, CTX.frames[i].image_available_semaphore, NULL);
+        vkDestroyFence(CTX.device, CTX.frames[i].in_flight_fence, NULL);
+    }
+    for (uint32_t i = 0; i < CTX.swap_chain_images_nb; i++)
+        vkDestroySemaphore(CTX.device, CTX.render_finished_semaphores[i], NULL);
+    free(CTX.render_finished_semaphores);
+    free(CTX.images_in_flight);
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++) {
+        if (CTX.readback_buffers[i] == VK_NULL_HANDLE)
+            continue;
+        gpu_memory_destroy_buffer(CTX.allocator, CTX.readback_buffers[i], &CTX.readback_memory[i]);
+    }
+    gpu_memory_destroy_buffer(CTX.allocator, CTX.mesh.buffer, &CTX.mesh.allocation);
+    particles_destroy(CTX.particles);
+    culling_destroy(CTX.culler);
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++)
+        gpu_memory_destroy_buffer(CTX.allocator, CTX.frames[i].instance_buffer, &CTX.frames[i].instance_memory);
     vkDestroyCommandPool(CTX.device, CTX.command_pool, NULL);
+    for (uint32_t i = 0; i < CTX.frames_in_flight; i++) {
+        for (uint32_t t = 0; t < jobs_thread_count(CTX.jobs); t++) {
+            vkDestroyCommandPool(CTX.device, CTX.frames[i].threads[t].pool, NULL);
+            free(CTX.frames[i].threads[t].buffers);
+        }
+    }
+    jobs_destroy(CTX.jobs);
+    scene_destroy(CTX.scene);
+    gpu_profiler_destroy(CTX.profiler);
+    frame_stats_destroy(CTX.frame_stats);
     for (uint32_t i = 0; i < CTX.swap_chain_framebuffers_nb; i++)
         vkDestroyFramebuffer(CTX.device, CTX.swap_chain_framebuffers[i], NULL);
     free(CTX.swap_chain_framebuffers);
+    release_retired_swap_chains(true);
+    if (CTX.scaled_rendering)
+        vkDestroyFramebuffer(CTX.device, CTX.scene_framebuffer, NULL);
+    render_graph_destroy(CTX.graph);
     vkDestroyPipeline(CTX.device, CTX.graphics_pipeline, NULL);
+    vkDestroyPipeline(CTX.device, CTX.depth_prepass_pipeline, NULL);
+    destroy_pipeline_cache();
     vkDestroyPipelineLayout(CTX.device, CTX.pipeline_layout, NULL);
+    vkDestroyDescriptorPool(CTX.device, CTX.descriptor_pool, NULL);
+    vkDestroyDescriptorSetLayout(CTX.device, CTX.descriptor_set_layout, NULL);
     vkDestroyRenderPass(CTX.device, CTX.render_pass, NULL);
     for (uint32_t i = 0; i < CTX.swap_chain_image_views_nb; i++)
         vkDestroyImageView(CTX.device, CTX.swap_chain_image_views[i], NULL);
     free(CTX.swap_chain_image_views);
-    vkDestroySwapchainKHR(CTX.device, CTX.swap_chain, NULL);
+    if (CONFIG.headless) {
+        for (uint32_t i = 0; i < CTX.swap_chain_images_nb; i++)
+            gpu_memory_destroy_image(CTX.allocator, CTX.swap_chain_images[i], &CTX.headless_image_memory[i]);
+        free(CTX.headless_image_memory);
+    } else {
+        vkDestroySwapchainKHR(CTX.device, CTX.swap_chain, NULL);
+    }
+    free(CTX.swap_chain_images);
+    staging_destroy(CTX.staging);
+    gpu_allocator_destroy(CTX.allocator);
     vkDestroyDevice(CTX.device, NULL);
+    device_caps_free(&CTX.device_caps);
     if (ENABLE_VALIDATION_LAYERS)
         vk_destroy_debug_utils_messenger_ext(CTX.instance, CTX.debug_messenger, NULL);
-    vkDestroySurfaceKHR(CTX.instance, CTX.surface, NULL);
+    if (!CONFIG.headless)
+        vkDestroySurfaceKHR(CTX.instance, CTX.surface, NULL);
     vkDestroyInstance(CTX.instance, NULL);
 
-    glfwDestroyWindow(CTX.window);
-    glfwTerminate();
+    if (!CONFIG.headless) {
+        glfwDestroyWindow(CTX.window);
+        glfwTerminate();
+    }
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
+#ifdef NDEBUG
+    log_set_level(LOG_INFO);
+#else
     log_set_level(LOG_DEBUG);
+#endif
+    config_set_defaults(&CONFIG);
+    config_status status = config_parse_args(&CONFIG, argc, argv);
+    if (status != CONFIG_RUN)
+        return status == CONFIG_HELP ? 0 : 1;
+    if (!CONFIG.sync_log && log_start_async() != 0)
+        log_warn("Could not start the log writer thread, logging synchronously");
+    config_log(&CONFIG);
     init_window();
     init_vulkan();
     main_loop();
     cleanup();
+    log_stop_async();
     return 0;
 }
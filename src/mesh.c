@@ -0,0 +1,206 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "mesh.h"
+
+#define POSITION_SIZE sizeof(((mesh_vertex *) 0)->position)
+#define COLOR_SIZE sizeof(((mesh_vertex *) 0)->color)
+
+static const mesh_vertex TRIANGLE[] = {
+    { { 0.0f, -0.5f }, { 1.0f, 0.0f, 0.0f } },
+    { { 0.5f, 0.5f }, { 0.0f, 1.0f, 0.0f } },
+    { { -0.5f, 0.5f }, { 0.0f, 0.0f, 1.0f } },
+};
+
+bool mesh_generate_grid(uint32_t subdivisions, mesh_data *mesh)
+{
+    memset(mesh, 0, sizeof *mesh);
+    uint32_t side = subdivisions + 1;
+    mesh->vertex_count = subdivisions ? side * side : 3;
+    mesh->index_count = subdivisions ? subdivisions * subdivisions * 6 : 3;
+    mesh->vertices = malloc(mesh->vertex_count * sizeof *mesh->vertices);
+    mesh->indices = malloc(mesh->index_count * sizeof *mesh->indices);
+    if (!mesh->vertices || !mesh->indices) {
+        mesh_data_free(mesh);
+        return false;
+    }
+
+    if (!subdivisions) {
+        memcpy(mesh->vertices, TRIANGLE, sizeof TRIANGLE);
+        for (uint32_t i = 0; i < 3; i++)
+            mesh->indices[i] = i;
+        return true;
+    }
+
+    for (uint32_t y = 0; y < side; y++) {
+        for (uint32_t x = 0; x < side; x++) {
+            float u = (float) x / (float) subdivisions;
+            float v = (float) y / (float) subdivisions;
+            mesh_vertex *vertex = &mesh->vertices[y * side + x];
+            vertex->position[0] = u - 0.5f;
+            vertex->position[1] = v - 0.5f;
+            vertex->color[0] = u;
+            vertex->color[1] = v;
+            vertex->color[2] = 1.0f - u;
+        }
+    }
+    uint32_t *index = mesh->indices;
+    for (uint32_t y = 0; y < subdivisions; y++) {
+        for (uint32_t x = 0; x < subdivisions; x++) {
+            uint32_t top_left = y * side + x;
+            uint32_t bottom_left = top_left + side;
+            // Clockwise like TRIANGLE, the pipeline culls the other faces
+            *index++ = top_left;
+            *index++ = top_left + 1;
+            *index++ = bottom_left;
+            *index++ = top_left + 1;
+            *index++ = bottom_left + 1;
+            *index++ = bottom_left;
+        }
+    }
+    log_debug("Generated a grid of %u vertices and %u triangles", mesh->vertex_count, mesh->index_count / 3);
+    return true;
+}
+
+void mesh_data_free(mesh_data *mesh)
+{
+    free(mesh->vertices);
+    free(mesh->indices);
+    memset(mesh, 0, sizeof *mesh);
+}
+
+void mesh_vertex_input_describe(vertex_layout layout, mesh_vertex_input *input)
+{
+    memset(input, 0, sizeof *input);
+    input->attributes[0].location = 0;
+    input->attributes[0].format = VK_FORMAT_R32G32_SFLOAT;
+    input->attributes[1].location = 1;
+    input->attributes[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+
+    switch (layout) {
+    case VERTEX_LAYOUT_INTERLEAVED:
+        input->binding_count = 1;
+        input->bindings[0].binding = 0;
+        input->bindings[0].stride = sizeof(mesh_vertex);
+        input->bindings[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        input->attributes[0].binding = 0;
+        input->attributes[0].offset = offsetof(mesh_vertex, position);
+        input->attributes[1].binding = 0;
+        input->attributes[1].offset = offsetof(mesh_vertex, color);
+        break;
+    case VERTEX_LAYOUT_DEINTERLEAVED:
+        input->binding_count = 2;
+        for (uint32_t i = 0; i < 2; i++) {
+            input->bindings[i].binding = i;
+            input->bindings[i].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+            input->attributes[i].binding = i;
+            input->attributes[i].offset = 0;
+        }
+        input->bindings[0].stride = POSITION_SIZE;
+        input->bindings[1].stride = COLOR_SIZE;
+        break;
+    }
+}
+
+// Centered on the bounding box, not minimal but tight enough for the flat meshes generated here
+static void compute_bounding_sphere(const mesh_data *data, float sphere[4])
+{
+    float min[2] = { 0.0f, 0.0f };
+    float max[2] = { 0.0f, 0.0f };
+    for (uint32_t i = 0; i < data->vertex_count; i++) {
+        for (uint32_t axis = 0; axis < 2; axis++) {
+            float value = data->vertices[i].position[axis];
+            if (i == 0 || value < min[axis])
+                min[axis] = value;
+            if (i == 0 || value > max[axis])
+                max[axis] = value;
+        }
+    }
+    sphere[0] = (min[0] + max[0]) * 0.5f;
+    sphere[1] = (min[1] + max[1]) * 0.5f;
+    sphere[2] = 0.0f;
+    float radius_squared = 0.0f;
+    for (uint32_t i = 0; i < data->vertex_count; i++) {
+        float dx = data->vertices[i].position[0] - sphere[0];
+        float dy = data->vertices[i].position[1] - sphere[1];
+        if (dx * dx + dy * dy > radius_squared)
+            radius_squared = dx * dx + dy * dy;
+    }
+    sphere[3] = sqrtf(radius_squared);
+}
+
+VkDeviceSize mesh_packed_size(const mesh_data *data, vertex_layout layout, gpu_mesh *mesh)
+{
+    VkDeviceSize vertex_count = data->vertex_count;
+    mesh->layout = layout;
+    mesh->vertex_count = data->vertex_count;
+    mesh->index_count = data->index_count;
+    // 16 bit indices halve the index fetch bandwidth whenever they can address every vertex
+    mesh->index_type = data->vertex_count <= UINT16_MAX + 1u ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    compute_bounding_sphere(data, mesh->bounding_sphere);
+
+    VkDeviceSize offset = 0;
+    switch (layout) {
+    case VERTEX_LAYOUT_INTERLEAVED:
+        mesh->binding_count = 1;
+        mesh->binding_offsets[0] = 0;
+        offset = vertex_count * sizeof(mesh_vertex);
+        break;
+    case VERTEX_LAYOUT_DEINTERLEAVED:
+        mesh->binding_count = 2;
+        mesh->binding_offsets[0] = 0;
+        mesh->binding_offsets[1] = vertex_count * POSITION_SIZE;
+        offset = mesh->binding_offsets[1] + vertex_count * COLOR_SIZE;
+        break;
+    }
+    // Every vertex size is a multiple of 4, which is all the index offset needs
+    mesh->index_offset = offset;
+    VkDeviceSize index_size = mesh->index_type == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+    return offset + (VkDeviceSize) data->index_count * index_size;
+}
+
+void mesh_pack(const mesh_data *data, const gpu_mesh *mesh, void *dst)
+{
+    char *bytes = dst;
+
+    switch (mesh->layout) {
+    case VERTEX_LAYOUT_INTERLEAVED:
+        memcpy(bytes, data->vertices, data->vertex_count * sizeof(mesh_vertex));
+        break;
+    case VERTEX_LAYOUT_DEINTERLEAVED: {
+        char *positions = bytes + mesh->binding_offsets[0];
+        char *colors = bytes + mesh->binding_offsets[1];
+        for (uint32_t i = 0; i < data->vertex_count; i++) {
+            memcpy(positions + i * POSITION_SIZE, data->vertices[i].position, POSITION_SIZE);
+            memcpy(colors + i * COLOR_SIZE, data->vertices[i].color, COLOR_SIZE);
+        }
+        break;
+    }
+    }
+
+    if (mesh->index_type == VK_INDEX_TYPE_UINT16) {
+        uint16_t *indices = (uint16_t *) (bytes + mesh->index_offset);
+        for (uint32_t i = 0; i < data->index_count; i++)
+            indices[i] = (uint16_t) data->indices[i];
+    } else {
+        memcpy(bytes + mesh->index_offset, data->indices, data->index_count * sizeof(uint32_t));
+    }
+}
+
+void mesh_cmd_bind(VkCommandBuffer command_buffer, const gpu_mesh *mesh)
+{
+    VkBuffer buffers[MESH_MAX_BINDINGS] = { mesh->buffer, mesh->buffer };
+    vkCmdBindVertexBuffers(command_buffer, 0, mesh->binding_count, buffers, mesh->binding_offsets);
+    vkCmdBindIndexBuffer(command_buffer, mesh->buffer, mesh->index_offset, mesh->index_type);
+}
+
+void mesh_cmd_draw(
+    VkCommandBuffer command_buffer, const gpu_mesh *mesh, uint32_t first_instance, uint32_t instance_count
+)
+{
+    mesh_cmd_bind(command_buffer, mesh);
+    vkCmdDrawIndexed(command_buffer, mesh->index_count, instance_count, 0, 0, first_instance);
+}
@@ -0,0 +1,71 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "gpu_memory.h"
+
+#define MESH_MAX_BINDINGS 2
+#define MESH_ATTRIBUTE_COUNT 2
+
+typedef enum {
+    // One binding of position/color pairs
+    VERTEX_LAYOUT_INTERLEAVED,
+    // One binding per attribute, position-only passes fetch less memory
+    VERTEX_LAYOUT_DEINTERLEAVED,
+} vertex_layout;
+
+typedef struct {
+    float position[2];
+    float color[3];
+} mesh_vertex;
+
+// CPU side geometry, packed into a gpu_mesh for upload
+typedef struct {
+    mesh_vertex *vertices;
+    uint32_t vertex_count;
+    uint32_t *indices;
+    uint32_t index_count;
+} mesh_data;
+
+typedef struct {
+    VkVertexInputBindingDescription bindings[MESH_MAX_BINDINGS];
+    VkVertexInputAttributeDescription attributes[MESH_ATTRIBUTE_COUNT];
+    uint32_t binding_count;
+} mesh_vertex_input;
+
+// Vertices and indices live in the same device local buffer
+typedef struct {
+    VkBuffer buffer;
+    gpu_allocation allocation;
+    vertex_layout layout;
+    VkDeviceSize binding_offsets[MESH_MAX_BINDINGS];
+    uint32_t binding_count;
+    VkDeviceSize index_offset;
+    VkIndexType index_type;
+    uint32_t index_count;
+    uint32_t vertex_count;
+    // Center then radius, in model space
+    float bounding_sphere[4];
+} gpu_mesh;
+
+// A grid of subdivisions x subdivisions quads, or the single triangle when subdivisions is 0
+bool mesh_generate_grid(uint32_t subdivisions, mesh_data *mesh);
+void mesh_data_free(mesh_data *mesh);
+
+void mesh_vertex_input_describe(vertex_layout layout, mesh_vertex_input *input);
+
+// Fills the layout fields and the bounding sphere of gpu_mesh and returns the number of bytes mesh_pack writes
+VkDeviceSize mesh_packed_size(const mesh_data *data, vertex_layout layout, gpu_mesh *mesh);
+// Writes vertices and indices as described by a previous mesh_packed_size
+void mesh_pack(const mesh_data *data, const gpu_mesh *mesh, void *dst);
+
+// Binds the vertex and index buffers for indirect draws
+void mesh_cmd_bind(VkCommandBuffer command_buffer, const gpu_mesh *mesh);
+void mesh_cmd_draw(
+    VkCommandBuffer command_buffer, const gpu_mesh *mesh, uint32_t first_instance, uint32_t instance_count
+);
+
+#endif
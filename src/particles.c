@@ -0,0 +1,472 @@
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "array_helper_macros.h"
+#include "log.h"
+#include "particles.h"
+#include "shader_code.h"
+
+// Must match local_size_x of particles.comp
+#define WORKGROUP_SIZE 256u
+// Mixed into the particle index by the first step, any non zero value works
+#define SEED 0x9e3779b9u
+
+// Must match the Step push constants of particles.comp
+typedef struct {
+    float dt;
+    float time;
+    uint32_t count;
+    uint32_t seed;
+} step_constants;
+
+struct particle_system {
+    VkDevice device;
+    gpu_allocator *allocator;
+    VkQueue queue;
+    VkCommandPool command_pool;
+    VkCommandBuffer command_buffers[MAX_FRAMES_IN_FLIGHT];
+    VkSemaphore timeline;
+    // Value the next step will signal, every earlier value has been submitted
+    uint64_t next_value;
+    float time;
+
+    VkBuffer buffers[MAX_FRAMES_IN_FLIGHT];
+    gpu_allocation memory[MAX_FRAMES_IN_FLIGHT];
+    uint32_t count;
+    uint32_t frames_in_flight;
+
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet sets[MAX_FRAMES_IN_FLIGHT];
+    VkPipelineLayout compute_layout;
+    VkPipeline compute_pipeline;
+    VkPipelineLayout draw_layout;
+    VkPipeline draw_pipeline;
+};
+
+static VkShaderModule load_shader_module(VkDevice device, const char *name)
+{
+    shader_code code;
+    if (!shader_code_load(name, &code))
+        return VK_NULL_HANDLE;
+
+    VkShaderModuleCreateInfo create_info = { 0 };
+    create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    create_info.codeSize = code.size;
+    create_info.pCode = code.code;
+    VkShaderModule module = VK_NULL_HANDLE;
+    vkCreateShaderModule(device, &create_info, NULL, &module);
+    shader_code_release(&code);
+    return module;
+}
+
+static VkResult create_buffers(particle_system *particles, uint32_t compute_family, uint32_t graphics_family)
+{
+    uint32_t families[] = { compute_family, graphics_family };
+    VkBufferCreateInfo buffer_info = { 0 };
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = (VkDeviceSize) particles->count * sizeof(particle);
+    buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    if (compute_family != graphics_family) {
+        buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_info.queueFamilyIndexCount = LENGTH_OF(families);
+        buffer_info.pQueueFamilyIndices = families;
+    } else {
+        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    }
+    gpu_allocation_desc desc = { 0 };
+    desc.required_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+    for (uint32_t i = 0; i < particles->frames_in_flight; i++) {
+        VkResult result = gpu_memory_create_buffer(
+            particles->allocator, &buffer_info, &desc, &particles->buffers[i], &particles->memory[i]
+        );
+        if (result != VK_SUCCESS)
+            return result;
+    }
+    return VK_SUCCESS;
+}
+
+// Set i reads the buffer of the slot before i and writes buffer i
+static VkResult create_descriptor_sets(particle_system *particles)
+{
+    VkDescriptorSetLayoutBinding bindings[2] = { 0 };
+    for (uint32_t i = 0; i < LENGTH_OF(bindings); i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    VkDescriptorSetLayoutCreateInfo layout_info = { 0 };
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = LENGTH_OF(bindings);
+    layout_info.pBindings = bindings;
+    VkResult result = vkCreateDescriptorSetLayout(particles->device, &layout_info, NULL, &particles->set_layout);
+    if (result != VK_SUCCESS)
+        return result;
+
+    VkDescriptorPoolSize pool_size = { 0 };
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = particles->frames_in_flight * LENGTH_OF(bindings);
+    VkDescriptorPoolCreateInfo pool_info = { 0 };
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = particles->frames_in_flight;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    result = vkCreateDescriptorPool(particles->device, &pool_info, NULL, &particles->descriptor_pool);
+    if (result != VK_SUCCESS)
+        return result;
+
+    VkDescriptorSetLayout layouts[MAX_FRAMES_IN_FLIGHT];
+    for (uint32_t i = 0; i < particles->frames_in_flight; i++)
+        layouts[i] = particles->set_layout;
+    VkDescriptorSetAllocateInfo set_info = { 0 };
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = particles->descriptor_pool;
+    set_info.descriptorSetCount = particles->frames_in_flight;
+    set_info.pSetLayouts = layouts;
+    result = vkAllocateDescriptorSets(particles->device, &set_info, particles->sets);
+    if (result != VK_SUCCESS)
+        return result;
+
+    for (uint32_t i = 0; i < particles->frames_in_flight; i++) {
+        uint32_t previous = (i + particles->frames_in_flight - 1) % particles->frames_in_flight;
+        VkDescriptorBufferInfo buffer_infos[2] = { 0 };
+        buffer_infos[0].buffer = particles->buffers[previous];
+        buffer_infos[0].range = VK_WHOLE_SIZE;
+        buffer_infos[1].buffer = particles->buffers[i];
+        buffer_infos[1].range = VK_WHOLE_SIZE;
+        VkWriteDescriptorSet writes[2] = { 0 };
+        for (uint32_t y = 0; y < LENGTH_OF(writes); y++) {
+            writes[y].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[y].dstSet = particles->sets[i];
+            writes[y].dstBinding = y;
+            writes[y].descriptorCount = 1;
+            writes[y].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writes[y].pBufferInfo = &buffer_infos[y];
+        }
+        vkUpdateDescriptorSets(particles->device, LENGTH_OF(writes), writes, 0, NULL);
+    }
+    return VK_SUCCESS;
+}
+
+static VkResult create_compute_pipeline(particle_system *particles, VkPipelineCache pipeline_cache)
+{
+    VkPushConstantRange push_range = { 0 };
+    push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_range.size = sizeof(step_constants);
+    VkPipelineLayoutCreateInfo layout_info = { 0 };
+    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout_info.setLayoutCount = 1;
+    layout_info.pSetLayouts = &particles->set_layout;
+    layout_info.pushConstantRangeCount = 1;
+    layout_info.pPushConstantRanges = &push_range;
+    VkResult result = vkCreatePipelineLayout(particles->device, &layout_info, NULL, &particles->compute_layout);
+    if (result != VK_SUCCESS)
+        return result;
+
+    VkShaderModule module = load_shader_module(particles->device, "particles_comp");
+    if (module == VK_NULL_HANDLE)
+        return VK_ERROR_INITIALIZATION_FAILED;
+    VkComputePipelineCreateInfo pipeline_info = { 0 };
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = particles->compute_layout;
+    result = vkCreateComputePipelines(
+        particles->device, pipeline_cache, 1, &pipeline_info, NULL, &particles->compute_pipeline
+    );
+    vkDestroyShaderModule(particles->device, module, NULL);
+    return result;
+}
+
+static VkResult create_draw_pipeline(
+    particle_system *particles, VkRenderPass render_pass, uint32_t subpass,
+    const VkPipelineRenderingCreateInfo *rendering, VkPipelineCache pipeline_cache
+)
+{
+    VkPipelineLayoutCreateInfo layout_info = { 0 };
+    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    VkResult result = vkCreatePipelineLayout(particles->device, &layout_info, NULL, &particles->draw_layout);
+    if (result != VK_SUCCESS)
+        return result;
+
+    VkShaderModule vert_module = load_shader_module(particles->device, "particles_vert");
+    // The color is computed per vertex, the instanced mesh fragment shader does the rest
+    VkShaderModule frag_module = load_shader_module(particles->device, "frag");
+    if (vert_module == VK_NULL_HANDLE || frag_module == VK_NULL_HANDLE) {
+        vkDestroyShaderModule(particles->device, vert_module, NULL);
+        vkDestroyShaderModule(particles->device, frag_module, NULL);
+        return VK_ERROR_INITIALIZATION_FAILED;
+    }
+    VkPipelineShaderStageCreateInfo stages[2] = { 0 };
+    stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    stages[0].module = vert_module;
+    stages[0].pName = "main";
+    stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    stages[1].module = frag_module;
+    stages[1].pName = "main";
+
+    VkVertexInputBindingDescription binding = { 0 };
+    binding.binding = 0;
+    binding.stride = sizeof(particle);
+    binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    VkVertexInputAttributeDescription attributes[2] = { 0 };
+    attributes[0].location = 0;
+    attributes[0].format = VK_FORMAT_R32G32_SFLOAT;
+    attributes[0].offset = offsetof(particle, position);
+    attributes[1].location = 1;
+    attributes[1].format = VK_FORMAT_R32G32_SFLOAT;
+    attributes[1].offset = offsetof(particle, velocity);
+    VkPipelineVertexInputStateCreateInfo vertex_input = { 0 };
+    vertex_input.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertex_input.vertexBindingDescriptionCount = 1;
+    vertex_input.pVertexBindingDescriptions = &binding;
+    vertex_input.vertexAttributeDescriptionCount = LENGTH_OF(attributes);
+    vertex_input.pVertexAttributeDescriptions = attributes;
+
+    VkPipelineInputAssemblyStateCreateInfo input_assembly = { 0 };
+    input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+
+    VkPipelineViewportStateCreateInfo viewport_state = { 0 };
+    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state.viewportCount = 1;
+    viewport_state.scissorCount = 1;
+    VkDynamicState dynamic_states[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR,
+    };
+    VkPipelineDynamicStateCreateInfo dynamic_state = { 0 };
+    dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state.dynamicStateCount = LENGTH_OF(dynamic_states);
+    dynamic_state.pDynamicStates = dynamic_states;
+
+    VkPipelineRasterizationStateCreateInfo rasterizer = { 0 };
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.lineWidth = 1.0;
+    rasterizer.cullMode = VK_CULL_MODE_NONE;
+
+    VkPipelineMultisampleStateCreateInfo multisampling = { 0 };
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    // Drawn over the meshes, the pass has a depth attachment but the points neither test nor write it
+    VkPipelineDepthStencilStateCreateInfo depth_stencil = { 0 };
+    depth_stencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil.depthTestEnable = VK_FALSE;
+    depth_stencil.depthWriteEnable = VK_FALSE;
+
+    VkPipelineColorBlendAttachmentState blend_attachment = { 0 };
+    blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT
+                                    | VK_COLOR_COMPONENT_A_BIT;
+    VkPipelineColorBlendStateCreateInfo color_blending = { 0 };
+    color_blending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    color_blending.attachmentCount = 1;
+    color_blending.pAttachments = &blend_attachment;
+
+    VkGraphicsPipelineCreateInfo pipeline_info = { 0 };
+    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_info.pNext = rendering;
+    pipeline_info.stageCount = LENGTH_OF(stages);
+    pipeline_info.pStages = stages;
+    pipeline_info.pVertexInputState = &vertex_input;
+    pipeline_info.pInputAssemblyState = &input_assembly;
+    pipeline_info.pViewportState = &viewport_state;
+    pipeline_info.pRasterizationState = &rasterizer;
+    pipeline_info.pMultisampleState = &multisampling;
+    pipeline_info.pDepthStencilState = &depth_stencil;
+    pipeline_info.pColorBlendState = &color_blending;
+    pipeline_info.pDynamicState = &dynamic_state;
+    pipeline_info.layout = particles->draw_layout;
+    pipeline_info.renderPass = render_pass;
+    pipeline_info.subpass = subpass;
+    result = vkCreateGraphicsPipelines(
+        particles->device, pipeline_cache, 1, &pipeline_info, NULL, &particles->draw_pipeline
+    );
+    vkDestroyShaderModule(particles->device, vert_module, NULL);
+    vkDestroyShaderModule(particles->device, frag_module, NULL);
+    return result;
+}
+
+particle_system *particles_create(
+    VkDevice device, gpu_allocator *allocator, VkQueue compute_queue, uint32_t compute_family,
+    uint32_t graphics_family, VkRenderPass render_pass, uint32_t subpass,
+    const VkPipelineRenderingCreateInfo *rendering, VkPipelineCache pipeline_cache, uint32_t count,
+    uint32_t frames_in_flight
+)
+{
+    particle_system *particles = calloc(1, sizeof *particles);
+    if (!particles)
+        return NULL;
+    particles->device = device;
+    particles->allocator = allocator;
+    particles->queue = compute_queue;
+    particles->count = count;
+    particles->frames_in_flight = frames_in_flight;
+    particles->next_value = 1;
+
+    VkCommandPoolCreateInfo pool_info = { 0 };
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_info.queueFamilyIndex = compute_family;
+    VkResult result = vkCreateCommandPool(device, &pool_info, NULL, &particles->command_pool);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    VkCommandBufferAllocateInfo alloc_info = { 0 };
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = particles->command_pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = frames_in_flight;
+    result = vkAllocateCommandBuffers(device, &alloc_info, particles->command_buffers);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    VkSemaphoreTypeCreateInfo type_info = { 0 };
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type_info.initialValue = 0;
+    VkSemaphoreCreateInfo semaphore_info = { 0 };
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &type_info;
+    result = vkCreateSemaphore(device, &semaphore_info, NULL, &particles->timeline);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    result = create_buffers(particles, compute_family, graphics_family);
+    if (result != VK_SUCCESS)
+        goto fail;
+    result = create_descriptor_sets(particles);
+    if (result != VK_SUCCESS)
+        goto fail;
+    result = create_compute_pipeline(particles, pipeline_cache);
+    if (result != VK_SUCCESS)
+        goto fail;
+    result = create_draw_pipeline(particles, render_pass, subpass, rendering, pipeline_cache);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    log_debug(
+        "Created %u particles simulated on queue family %u (graphics on %u)", count, compute_family, graphics_family
+    );
+    return particles;
+
+fail:
+    log_error("Could not create the particle system (%d)", result);
+    particles_destroy(particles);
+    return NULL;
+}
+
+void particles_destroy(particle_system *particles)
+{
+    if (!particles)
+        return;
+
+    if (particles->next_value > 1) {
+        VkSemaphoreWaitInfo wait_info = { 0 };
+        wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        wait_info.semaphoreCount = 1;
+        wait_info.pSemaphores = &particles->timeline;
+        uint64_t last_value = particles->next_value - 1;
+        wait_info.pValues = &last_value;
+        vkWaitSemaphores(particles->device, &wait_info, UINT64_MAX);
+    }
+    vkDestroyPipeline(particles->device, particles->draw_pipeline, NULL);
+    vkDestroyPipelineLayout(particles->device, particles->draw_layout, NULL);
+    vkDestroyPipeline(particles->device, particles->compute_pipeline, NULL);
+    vkDestroyPipelineLayout(particles->device, particles->compute_layout, NULL);
+    vkDestroyDescriptorPool(particles->device, particles->descriptor_pool, NULL);
+    vkDestroyDescriptorSetLayout(particles->device, particles->set_layout, NULL);
+    for (uint32_t i = 0; i < particles->frames_in_flight; i++) {
+        if (particles->buffers[i] != VK_NULL_HANDLE)
+            gpu_memory_destroy_buffer(particles->allocator, particles->buffers[i], &particles->memory[i]);
+    }
+    vkDestroySemaphore(particles->device, particles->timeline, NULL);
+    vkDestroyCommandPool(particles->device, particles->command_pool, NULL);
+    free(particles);
+}
+
+uint64_t particles_simulate(particle_system *particles, uint32_t slot, float dt)
+{
+    VkCommandBuffer command_buffer = particles->command_buffers[slot];
+    vkResetCommandBuffer(command_buffer, 0);
+    VkCommandBufferBeginInfo begin_info = { 0 };
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VkResult result = vkBeginCommandBuffer(command_buffer, &begin_info);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    // The previous step was submitted to the same queue, make its writes visible to this one. Graphics reads of the
+    // buffer written here are already covered by the frame fence the caller waited on.
+    VkMemoryBarrier barrier = { 0 };
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(
+        command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0,
+        NULL, 0, NULL
+    );
+
+    step_constants constants = { 0 };
+    constants.dt = dt;
+    constants.time = particles->time;
+    constants.count = particles->count;
+    constants.seed = particles->next_value == 1 ? SEED : 0;
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles->compute_pipeline);
+    vkCmdBindDescriptorSets(
+        command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles->compute_layout, 0, 1, &particles->sets[slot], 0,
+        NULL
+    );
+    vkCmdPushConstants(
+        command_buffer, particles->compute_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof constants, &constants
+    );
+    vkCmdDispatch(command_buffer, (particles->count + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+    result = vkEndCommandBuffer(command_buffer);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    uint64_t value = particles->next_value;
+    VkTimelineSemaphoreSubmitInfo timeline_info = { 0 };
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &value;
+    VkSubmitInfo submit_info = { 0 };
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &command_buffer;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &particles->timeline;
+    result = vkQueueSubmit(particles->queue, 1, &submit_info, VK_NULL_HANDLE);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    particles->next_value++;
+    particles->time += dt;
+    return value;
+
+fail:
+    // The graphics submission can still wait on the last step, the particles just do not move this frame
+    log_limited(LOG_ERROR, 1, 1000, "Could not submit the particle step (%d)", result);
+    return particles->next_value - 1;
+}
+
+__attribute__((pure)) VkSemaphore particles_timeline(const particle_system *particles)
+{
+    return particles->timeline;
+}
+
+void particles_cmd_draw(const particle_system *particles, VkCommandBuffer command_buffer, uint32_t slot)
+{
+    VkDeviceSize offset = 0;
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, particles->draw_pipeline);
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &particles->buffers[slot], &offset);
+    vkCmdDraw(command_buffer, particles->count, 1, 0, 0);
+}
@@ -0,0 +1,44 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "config.h"
+#include "gpu_memory.h"
+
+// Matches the std430 Particle struct of particles.comp, also read as vertex attributes by particles.vert
+typedef struct {
+    float position[2];
+    float velocity[2];
+} particle;
+
+// Particles simulated by a compute shader on the compute queue and drawn as points by the graphics queue.
+// Each frame slot has its own buffer, the step of a slot reads the buffer of the previous slot and writes its own.
+// Steps signal the next value of a timeline semaphore that the graphics submission of the same frame waits on, so
+// the step of a frame runs while the graphics queue is still busy with the previous frame when the device has a
+// separate compute family. The buffers are shared concurrently by both families, no ownership transfer is recorded.
+typedef struct particle_system particle_system;
+
+// compute_queue may be the graphics queue when the device has no separate compute family. The draw pipeline is
+// built for the given subpass of render_pass, which must have a depth attachment, with dynamic viewport and scissor.
+// With dynamic rendering render_pass is VK_NULL_HANDLE and rendering describes the attachments instead, it is NULL
+// otherwise.
+particle_system *particles_create(
+    VkDevice device, gpu_allocator *allocator, VkQueue compute_queue, uint32_t compute_family,
+    uint32_t graphics_family, VkRenderPass render_pass, uint32_t subpass,
+    const VkPipelineRenderingCreateInfo *rendering, VkPipelineCache pipeline_cache, uint32_t count,
+    uint32_t frames_in_flight
+);
+// Waits for the last step to complete, the device must not be drawing the particles anymore
+void particles_destroy(particle_system *particles);
+
+// Records and submits the step of a frame slot. The previous frame using the slot must have completed.
+// Returns the timeline value signalled once the step is done.
+uint64_t particles_simulate(particle_system *particles, uint32_t slot, float dt);
+__attribute__((pure)) VkSemaphore particles_timeline(const particle_system *particles);
+
+// Draws the particles of a slot, the viewport and scissor must already be set
+void particles_cmd_draw(const particle_system *particles, VkCommandBuffer command_buffer, uint32_t slot);
+
+#endif
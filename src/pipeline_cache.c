@@ -0,0 +1,242 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "pipeline_cache.h"
+
+#define PIPELINE_CACHE_MAGIC 0x43505256u // "VRPC"
+#define PIPELINE_CACHE_FILE_VERSION 2u
+
+// Written in front of the driver blob so that a cache from another device, another driver build or a truncated
+// write is never handed to the driver
+typedef struct {
+    uint32_t magic;
+    uint32_t file_version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t driver_uuid[VK_UUID_SIZE];
+    uint8_t cache_uuid[VK_UUID_SIZE];
+    uint64_t data_size;
+    uint64_t data_hash;
+} pipeline_cache_file_header;
+
+// FNV-1a, good enough to catch truncated or damaged files
+__attribute__((pure)) static uint64_t hash_data(const unsigned char *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+void pipeline_cache_identify(VkPhysicalDevice physical_device, pipeline_cache_identity *identity)
+{
+    memset(identity, 0, sizeof *identity);
+    vkGetPhysicalDeviceProperties(physical_device, &identity->properties);
+    if (identity->properties.apiVersion < VK_API_VERSION_1_1)
+        return;
+
+    VkPhysicalDeviceIDProperties id_properties = { 0 };
+    id_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties = { 0 };
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &id_properties;
+    vkGetPhysicalDeviceProperties2(physical_device, &properties);
+    memcpy(identity->driver_uuid, id_properties.driverUUID, VK_UUID_SIZE);
+}
+
+bool pipeline_cache_path(const pipeline_cache_identity *identity, const char *dir, char *path, size_t size)
+{
+    char default_dir[512];
+    if (!dir) {
+        const char *xdg = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        if (xdg && *xdg)
+            snprintf(default_dir, sizeof default_dir, "%s/vulkan_renderer", xdg);
+        else if (home && *home)
+            snprintf(default_dir, sizeof default_dir, "%s/.cache/vulkan_renderer", home);
+        else
+            return false;
+        dir = default_dir;
+    }
+
+    // The driver UUID changes with every driver build, so an update starts a new file instead of rewriting the old
+    char uuid[VK_UUID_SIZE * 2 + 1];
+    for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
+        snprintf(uuid + i * 2, 3, "%02x", identity->driver_uuid[i]);
+
+    const VkPhysicalDeviceProperties *properties = &identity->properties;
+    int written = snprintf(
+        path, size, "%s/pipeline_cache_%04x_%04x_%s.bin", dir, properties->vendorID, properties->deviceID, uuid
+    );
+    return written > 0 && (size_t) written < size;
+}
+
+static bool is_header_valid(
+    const pipeline_cache_file_header *header, const pipeline_cache_identity *identity, size_t file_size
+)
+{
+    const VkPhysicalDeviceProperties *properties = &identity->properties;
+    if (header->magic != PIPELINE_CACHE_MAGIC || header->file_version != PIPELINE_CACHE_FILE_VERSION)
+        return false;
+    if (header->vendor_id != properties->vendorID || header->device_id != properties->deviceID
+        || header->driver_version != properties->driverVersion
+        || memcmp(header->driver_uuid, identity->driver_uuid, VK_UUID_SIZE) != 0
+        || memcmp(header->cache_uuid, properties->pipelineCacheUUID, VK_UUID_SIZE) != 0)
+        return false;
+    return header->data_size == file_size - sizeof *header;
+}
+
+// The driver blob starts with its own header, check it agrees with ours before handing it over
+static bool is_driver_header_valid(
+    const unsigned char *data, size_t size, const VkPhysicalDeviceProperties *properties
+)
+{
+    VkPipelineCacheHeaderVersionOne driver_header;
+    if (size < sizeof driver_header)
+        return false;
+    memcpy(&driver_header, data, sizeof driver_header);
+    return driver_header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        && driver_header.vendorID == properties->vendorID && driver_header.deviceID == properties->deviceID
+        && !memcmp(driver_header.pipelineCacheUUID, properties->pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+static unsigned char *read_cache_file(const pipeline_cache_identity *identity, const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        log_debug("No pipeline cache at %s", path);
+        return NULL;
+    }
+
+    unsigned char *data = NULL;
+    pipeline_cache_file_header header;
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || (size_t) st.st_size < sizeof header
+        || fread(&header, sizeof header, 1, file) != 1) {
+        log_warn("Pipeline cache %s is truncated, ignoring it", path);
+        goto out;
+    }
+    if (!is_header_valid(&header, identity, (size_t) st.st_size)) {
+        log_warn("Pipeline cache %s was written by another device or driver, ignoring it", path);
+        goto out;
+    }
+
+    data = malloc(header.data_size);
+    if (!data || fread(data, 1, header.data_size, file) != header.data_size
+        || hash_data(data, header.data_size) != header.data_hash
+        || !is_driver_header_valid(data, header.data_size, &identity->properties)) {
+        log_warn("Pipeline cache %s is corrupted, ignoring it", path);
+        free(data);
+        data = NULL;
+        goto out;
+    }
+    *size = header.data_size;
+
+out:
+    fclose(file);
+    return data;
+}
+
+VkPipelineCache pipeline_cache_load(VkDevice device, const pipeline_cache_identity *identity, const char *path)
+{
+    size_t size = 0;
+    unsigned char *data = path ? read_cache_file(identity, path, &size) : NULL;
+
+    VkPipelineCacheCreateInfo create_info = { 0 };
+    create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    create_info.initialDataSize = size;
+    create_info.pInitialData = data;
+
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    VkResult result = vkCreatePipelineCache(device, &create_info, NULL, &cache);
+    if (result != VK_SUCCESS && data) {
+        // The driver may still refuse a blob that passed our checks, start from scratch then
+        log_warn("Driver rejected pipeline cache %s (%d), starting empty", path, result);
+        create_info.initialDataSize = 0;
+        create_info.pInitialData = NULL;
+        result = vkCreatePipelineCache(device, &create_info, NULL, &cache);
+    }
+    if (result != VK_SUCCESS) {
+        log_error("Could not create pipeline cache (%d)", result);
+        cache = VK_NULL_HANDLE;
+    } else if (data) {
+        log_debug("Loaded %lu bytes of pipeline cache from %s", size, path);
+    }
+    free(data);
+    return cache;
+}
+
+static void make_parent_dirs(const char *path)
+{
+    char dir[512];
+    snprintf(dir, sizeof dir, "%s", path);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+            log_warn("Could not create directory %s: %s", dir, strerror(errno));
+        *p = '/';
+    }
+}
+
+void pipeline_cache_save(
+    VkDevice device, VkPipelineCache cache, const pipeline_cache_identity *identity, const char *path
+)
+{
+    if (cache == VK_NULL_HANDLE || !path)
+        return;
+
+    size_t size = 0;
+    VkResult result = vkGetPipelineCacheData(device, cache, &size, NULL);
+    if (result != VK_SUCCESS || size == 0)
+        return;
+    unsigned char *data = malloc(size);
+    if (!data)
+        return;
+    result = vkGetPipelineCacheData(device, cache, &size, data);
+    if (result != VK_SUCCESS) {
+        free(data);
+        return;
+    }
+
+    pipeline_cache_file_header header = { 0 };
+    header.magic = PIPELINE_CACHE_MAGIC;
+    header.file_version = PIPELINE_CACHE_FILE_VERSION;
+    header.vendor_id = identity->properties.vendorID;
+    header.device_id = identity->properties.deviceID;
+    header.driver_version = identity->properties.driverVersion;
+    memcpy(header.driver_uuid, identity->driver_uuid, VK_UUID_SIZE);
+    memcpy(header.cache_uuid, identity->properties.pipelineCacheUUID, VK_UUID_SIZE);
+    header.data_size = size;
+    header.data_hash = hash_data(data, size);
+
+    // Write next to the target and rename so a crash never leaves a half written cache behind
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+    make_parent_dirs(path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        log_warn("Could not write pipeline cache to %s", tmp_path);
+        free(data);
+        return;
+    }
+    bool ok = fwrite(&header, sizeof header, 1, file) == 1 && fwrite(data, 1, size, file) == size;
+    ok = fclose(file) == 0 && ok;
+    if (ok && rename(tmp_path, path) == 0) {
+        log_debug("Saved %lu bytes of pipeline cache to %s", size, path);
+    } else {
+        log_warn("Could not write pipeline cache to %s", path);
+        remove(tmp_path);
+    }
+    free(data);
+}
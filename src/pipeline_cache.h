@@ -0,0 +1,30 @@
+#ifndef PIPELINE_CACHE_H
+#define PIPELINE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <vulkan/vulkan.h>
+
+// What a cache file is tied to, the device and the build of its driver
+typedef struct {
+    VkPhysicalDeviceProperties properties;
+    // Zeroed on devices older than Vulkan 1.1, the other fields still tell drivers apart there
+    uint8_t driver_uuid[VK_UUID_SIZE];
+} pipeline_cache_identity;
+
+void pipeline_cache_identify(VkPhysicalDevice physical_device, pipeline_cache_identity *identity);
+
+// Builds the cache file path for this device and driver inside dir, or the XDG cache directory if dir is NULL.
+// Returns false if no directory could be found.
+bool pipeline_cache_path(const pipeline_cache_identity *identity, const char *dir, char *path, size_t size);
+
+// Creates a pipeline cache seeded with the file at path when it was written by the same device and driver and
+// is intact, or an empty one otherwise
+VkPipelineCache pipeline_cache_load(VkDevice device, const pipeline_cache_identity *identity, const char *path);
+
+// Writes the cache content to path, creating missing directories
+void pipeline_cache_save(
+    VkDevice device, VkPipelineCache cache, const pipeline_cache_identity *identity, const char *path
+);
+
+#endif
@@ -0,0 +1,636 @@
+#include <stdlib.h>
+
+#include "log.h"
+#include "render_graph.h"
+
+#define UNUSED_PASS UINT32_MAX
+
+#define FRAGMENT_TESTS (VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT)
+
+typedef struct {
+    VkPipelineStageFlags stages;
+    VkAccessFlags access;
+    // The part of access that writes, empty for reads
+    VkAccessFlags write_access;
+    VkImageLayout layout;
+    VkImageUsageFlags image_usage;
+} usage_info;
+
+static const usage_info USAGES[RENDER_GRAPH_USAGE_COUNT] = {
+    [RENDER_GRAPH_COLOR_ATTACHMENT] = {
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+        VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+    },
+    [RENDER_GRAPH_DEPTH_ATTACHMENT] = {
+        FRAGMENT_TESTS,
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+    },
+    [RENDER_GRAPH_DEPTH_READ] = {
+        FRAGMENT_TESTS,
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
+        0,
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+    },
+    [RENDER_GRAPH_SAMPLED] = {
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_ACCESS_SHADER_READ_BIT,
+        0,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_IMAGE_USAGE_SAMPLED_BIT,
+    },
+    [RENDER_GRAPH_TRANSFER_SRC] = {
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_ACCESS_TRANSFER_READ_BIT,
+        0,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+    },
+    [RENDER_GRAPH_TRANSFER_DST] = {
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+    },
+};
+
+typedef struct {
+    const char *name;
+    VkFormat format;
+    bool imported;
+    VkImageLayout initial_layout;
+    VkPipelineStageFlags initial_stages;
+    VkImageLayout final_layout;
+    // Transient images only
+    VkExtent2D extent;
+    VkImageUsageFlags usage;
+    VkMemoryRequirements requirements;
+    // In the shared memory of the transients, or in their own memory when they cannot share it
+    VkDeviceSize offset;
+    gpu_allocation memory;
+    VkImageView view;
+    // Created by the graph for transients, bound before each execution for imports
+    VkImage image;
+    // Kept passes using the image, UNUSED_PASS when none does
+    uint32_t first_pass;
+    uint32_t last_pass;
+    // Of every use in a frame, what the first use in the next frame waits for, as does an image aliasing this one
+    VkPipelineStageFlags frame_stages;
+    VkAccessFlags frame_writes;
+} graph_resource;
+
+typedef struct {
+    render_graph_resource resource;
+    VkImageLayout old_layout;
+    VkImageLayout new_layout;
+    VkAccessFlags src_access;
+    VkAccessFlags dst_access;
+} image_transition;
+
+// Recorded as a single vkCmdPipelineBarrier
+typedef struct {
+    VkPipelineStageFlags src_stages;
+    VkPipelineStageFlags dst_stages;
+    image_transition transitions[RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t count;
+} barrier_batch;
+
+typedef struct {
+    render_graph_resource resource;
+    render_graph_usage usage;
+} resource_use;
+
+typedef struct {
+    const char *name;
+    render_graph_record_fn record;
+    bool side_effect;
+    bool culled;
+    resource_use uses[RENDER_GRAPH_MAX_USES];
+    uint32_t use_count;
+    // Before the pass
+    barrier_batch barriers;
+} graph_pass;
+
+// Where the compilation is at with an image, walking the passes in order
+typedef struct {
+    VkImageLayout layout;
+    VkPipelineStageFlags write_stages;
+    VkAccessFlags write_access;
+    // Stages the last write was made visible to
+    VkPipelineStageFlags visible_stages;
+    // Reads since the last write, the next write has to wait for them
+    VkPipelineStageFlags read_stages;
+} resource_state;
+
+struct render_graph {
+    VkDevice device;
+    gpu_allocator *allocator;
+    graph_resource resources[RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t resource_count;
+    graph_pass passes[RENDER_GRAPH_MAX_PASSES];
+    uint32_t pass_count;
+    // Set when a declaration was rejected, the graph then refuses to compile
+    bool invalid;
+    // Shared by the transients, VK_NULL_HANDLE when they each have their own
+    gpu_allocation transient_memory;
+    // Imported images to their final layouts, after the last pass
+    barrier_batch final_barriers;
+};
+
+render_graph *render_graph_create(VkDevice device, gpu_allocator *allocator)
+{
+    render_graph *graph = calloc(1, sizeof *graph);
+    if (!graph)
+        return NULL;
+    graph->device = device;
+    graph->allocator = allocator;
+    return graph;
+}
+
+void render_graph_destroy(render_graph *graph)
+{
+    if (!graph)
+        return;
+    for (uint32_t i = 0; i < graph->resource_count; i++) {
+        graph_resource *resource = &graph->resources[i];
+        if (resource->imported)
+            continue;
+        vkDestroyImageView(graph->device, resource->view, NULL);
+        vkDestroyImage(graph->device, resource->image, NULL);
+        if (resource->memory.memory != VK_NULL_HANDLE)
+            gpu_memory_free(graph->allocator, &resource->memory);
+    }
+    if (graph->transient_memory.memory != VK_NULL_HANDLE)
+        gpu_memory_free(graph->allocator, &graph->transient_memory);
+    free(graph);
+}
+
+static graph_resource *add_resource(render_graph *graph, const char *name, VkFormat format)
+{
+    if (graph->resource_count == RENDER_GRAPH_MAX_RESOURCES) {
+        log_error("The render graph is full at %u images, %s is left out", RENDER_GRAPH_MAX_RESOURCES, name);
+        graph->invalid = true;
+        return NULL;
+    }
+    graph_resource *resource = &graph->resources[graph->resource_count++];
+    resource->name = name;
+    resource->format = format;
+    resource->first_pass = UNUSED_PASS;
+    resource->last_pass = UNUSED_PASS;
+    return resource;
+}
+
+render_graph_resource render_graph_import_image(
+    render_graph *graph, const char *name, VkFormat format, VkImageLayout initial_layout,
+    VkPipelineStageFlags initial_stages, VkImageLayout final_layout
+)
+{
+    graph_resource *resource = add_resource(graph, name, format);
+    if (!resource)
+        return RENDER_GRAPH_MAX_RESOURCES;
+    resource->imported = true;
+    resource->initial_layout = initial_layout;
+    resource->initial_stages = initial_stages;
+    resource->final_layout = final_layout;
+    return graph->resource_count - 1;
+}
+
+render_graph_resource render_graph_create_image(
+    render_graph *graph, const char *name, VkFormat format, VkExtent2D extent
+)
+{
+    graph_resource *resource = add_resource(graph, name, format);
+    if (!resource)
+        return RENDER_GRAPH_MAX_RESOURCES;
+    resource->extent = extent;
+    return graph->resource_count - 1;
+}
+
+uint32_t render_graph_add_pass(render_graph *graph, const char *name, render_graph_record_fn record, bool side_effect)
+{
+    if (graph->pass_count == RENDER_GRAPH_MAX_PASSES) {
+        log_error("The render graph is full at %u passes, %s is left out", RENDER_GRAPH_MAX_PASSES, name);
+        graph->invalid = true;
+        return RENDER_GRAPH_MAX_PASSES;
+    }
+    graph_pass *pass = &graph->passes[graph->pass_count++];
+    pass->name = name;
+    pass->record = record;
+    pass->side_effect = side_effect;
+    return graph->pass_count - 1;
+}
+
+void render_graph_use(render_graph *graph, uint32_t pass, render_graph_resource resource, render_graph_usage usage)
+{
+    if (pass >= graph->pass_count || resource >= graph->resource_count
+        || graph->passes[pass].use_count == RENDER_GRAPH_MAX_USES) {
+        log_error("Render graph pass %u cannot use image %u", pass, resource);
+        graph->invalid = true;
+        return;
+    }
+    graph_pass *declared = &graph->passes[pass];
+    declared->uses[declared->use_count].resource = resource;
+    declared->uses[declared->use_count].usage = usage;
+    declared->use_count++;
+}
+
+__attribute__((const)) static VkImageAspectFlags format_aspect(VkFormat format)
+{
+    switch (format) {
+    case VK_FORMAT_D16_UNORM:
+    case VK_FORMAT_X8_D24_UNORM_PACK32:
+    case VK_FORMAT_D32_SFLOAT:
+        return VK_IMAGE_ASPECT_DEPTH_BIT;
+    case VK_FORMAT_D16_UNORM_S8_UINT:
+    case VK_FORMAT_D24_UNORM_S8_UINT:
+    case VK_FORMAT_D32_SFLOAT_S8_UINT:
+        return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+    default:
+        return VK_IMAGE_ASPECT_COLOR_BIT;
+    }
+}
+
+// Walking backwards, a pass is kept when it has side effects or writes an image that is imported or read by a kept
+// pass after it. Attachments count as read, their previous content may be loaded.
+static uint32_t cull_passes(render_graph *graph)
+{
+    bool needed[RENDER_GRAPH_MAX_RESOURCES] = { 0 };
+    for (uint32_t i = 0; i < graph->resource_count; i++)
+        needed[i] = graph->resources[i].imported;
+
+    uint32_t kept = 0;
+    for (uint32_t p = graph->pass_count; p-- > 0;) {
+        graph_pass *pass = &graph->passes[p];
+        bool contributes = pass->side_effect;
+        for (uint32_t u = 0; u < pass->use_count && !contributes; u++) {
+            const resource_use *use = &pass->uses[u];
+            contributes = USAGES[use->usage].write_access && needed[use->resource];
+        }
+        pass->culled = !contributes;
+        if (pass->culled) {
+            log_debug("Culled render graph pass %s, nothing uses what it writes", pass->name);
+            continue;
+        }
+        kept++;
+        for (uint32_t u = 0; u < pass->use_count; u++) {
+            const usage_info *info = &USAGES[pass->uses[u].usage];
+            if (info->access & ~info->write_access)
+                needed[pass->uses[u].resource] = true;
+        }
+    }
+    return kept;
+}
+
+static void compute_lifetimes(render_graph *graph)
+{
+    for (uint32_t p = 0; p < graph->pass_count; p++) {
+        const graph_pass *pass = &graph->passes[p];
+        if (pass->culled)
+            continue;
+        for (uint32_t u = 0; u < pass->use_count; u++) {
+            graph_resource *resource = &graph->resources[pass->uses[u].resource];
+            const usage_info *info = &USAGES[pass->uses[u].usage];
+            if (resource->first_pass == UNUSED_PASS)
+                resource->first_pass = p;
+            resource->last_pass = p;
+            resource->frame_stages |= info->stages;
+            resource->frame_writes |= info->write_access;
+            resource->usage |= info->image_usage;
+        }
+    }
+}
+
+__attribute__((pure)) static bool is_transient(const graph_resource *resource)
+{
+    return !resource->imported && resource->first_pass != UNUSED_PASS;
+}
+
+__attribute__((pure)) static bool lifetimes_overlap(const graph_resource *a, const graph_resource *b)
+{
+    return a->first_pass <= b->last_pass && b->first_pass <= a->last_pass;
+}
+
+// Whether the two images may hold the same bytes, in which case the first use of one waits for the other
+__attribute__((pure)) static bool share_memory(
+    const render_graph *graph, const graph_resource *a, const graph_resource *b
+)
+{
+    if (a == b)
+        return true;
+    if (graph->transient_memory.memory == VK_NULL_HANDLE || !is_transient(a) || !is_transient(b))
+        return false;
+    return a->offset < b->offset + b->requirements.size && b->offset < a->offset + a->requirements.size;
+}
+
+static VkResult create_transient_images(render_graph *graph)
+{
+    for (uint32_t i = 0; i < graph->resource_count; i++) {
+        graph_resource *resource = &graph->resources[i];
+        if (!is_transient(resource))
+            continue;
+        VkImageCreateInfo image_info = { 0 };
+        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_info.imageType = VK_IMAGE_TYPE_2D;
+        image_info.format = resource->format;
+        image_info.extent.width = resource->extent.width;
+        image_info.extent.height = resource->extent.height;
+        image_info.extent.depth = 1;
+        image_info.mipLevels = 1;
+        image_info.arrayLayers = 1;
+        image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+        image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        image_info.usage = resource->usage;
+        image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkResult result = vkCreateImage(graph->device, &image_info, NULL, &resource->image);
+        if (result != VK_SUCCESS)
+            return result;
+        vkGetImageMemoryRequirements(graph->device, resource->image, &resource->requirements);
+    }
+    return VK_SUCCESS;
+}
+
+// Largest first, each image goes to the lowest offset that does not overlap an image placed before it whose
+// lifetime overlaps its own. Returns the size of the shared memory.
+static VkDeviceSize place_transients(render_graph *graph)
+{
+    graph_resource *order[RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < graph->resource_count; i++) {
+        graph_resource *resource = &graph->resources[i];
+        if (!is_transient(resource))
+            continue;
+        uint32_t at = count++;
+        while (at > 0 && order[at - 1]->requirements.size < resource->requirements.size) {
+            order[at] = order[at - 1];
+            at--;
+        }
+        order[at] = resource;
+    }
+
+    VkDeviceSize size = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        graph_resource *resource = order[i];
+        VkDeviceSize alignment = resource->requirements.alignment;
+        resource->offset = 0;
+        for (bool moved = true; moved;) {
+            moved = false;
+            for (uint32_t j = 0; j < i; j++) {
+                const graph_resource *placed = order[j];
+                VkDeviceSize placed_end = placed->offset + placed->requirements.size;
+                bool collides = lifetimes_overlap(resource, placed) && resource->offset < placed_end
+                             && placed->offset < resource->offset + resource->requirements.size;
+                if (collides) {
+                    resource->offset = (placed_end + alignment - 1) / alignment * alignment;
+                    moved = true;
+                }
+            }
+        }
+        if (resource->offset + resource->requirements.size > size)
+            size = resource->offset + resource->requirements.size;
+    }
+    return size;
+}
+
+static VkResult allocate_transients(render_graph *graph)
+{
+    VkMemoryRequirements shared = { 0 };
+    shared.memoryTypeBits = UINT32_MAX;
+    VkDeviceSize separate_size = 0;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < graph->resource_count; i++) {
+        const graph_resource *resource = &graph->resources[i];
+        if (!is_transient(resource))
+            continue;
+        count++;
+        separate_size += resource->requirements.size;
+        shared.memoryTypeBits &= resource->requirements.memoryTypeBits;
+        if (resource->requirements.alignment > shared.alignment)
+            shared.alignment = resource->requirements.alignment;
+    }
+    if (!count)
+        return VK_SUCCESS;
+
+    gpu_allocation_desc desc = { 0 };
+    desc.required_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    desc.kind = GPU_RESOURCE_OPTIMAL;
+    VkResult result;
+    if (shared.memoryTypeBits) {
+        shared.size = place_transients(graph);
+        result = gpu_memory_allocate(graph->allocator, &shared, &desc, &graph->transient_memory);
+        if (result != VK_SUCCESS)
+            return result;
+        log_debug("Render graph transients take %lu KiB instead of %lu KiB", shared.size >> 10, separate_size >> 10);
+    } else {
+        log_warn("The render graph transients have no memory type in common, they cannot alias");
+    }
+
+    for (uint32_t i = 0; i < graph->resource_count; i++) {
+        graph_resource *resource = &graph->resources[i];
+        if (!is_transient(resource))
+            continue;
+        VkDeviceMemory memory = graph->transient_memory.memory;
+        VkDeviceSize offset = graph->transient_memory.offset + resource->offset;
+        if (memory == VK_NULL_HANDLE) {
+            result = gpu_memory_allocate(graph->allocator, &resource->requirements, &desc, &resource->memory);
+            if (result != VK_SUCCESS)
+                return result;
+            memory = resource->memory.memory;
+            offset = resource->memory.offset;
+        }
+        result = vkBindImageMemory(graph->device, resource->image, memory, offset);
+        if (result != VK_SUCCESS)
+            return result;
+
+        VkImageViewCreateInfo view_info = { 0 };
+        view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view_info.image = resource->image;
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        view_info.format = resource->format;
+        view_info.subresourceRange.aspectMask = format_aspect(resource->format);
+        view_info.subresourceRange.levelCount = 1;
+        view_info.subresourceRange.layerCount = 1;
+        result = vkCreateImageView(graph->device, &view_info, NULL, &resource->view);
+        if (result != VK_SUCCESS)
+            return result;
+    }
+    return VK_SUCCESS;
+}
+
+static void add_transition(
+    barrier_batch *batch, render_graph_resource resource, const resource_state *state, VkPipelineStageFlags dst_stages,
+    VkAccessFlags dst_access, VkImageLayout new_layout
+)
+{
+    image_transition *transition = &batch->transitions[batch->count++];
+    transition->resource = resource;
+    transition->old_layout = state->layout;
+    transition->new_layout = new_layout;
+    transition->src_access = state->write_access;
+    transition->dst_access = dst_access;
+    batch->src_stages |= state->write_stages | state->read_stages;
+    batch->dst_stages |= dst_stages;
+}
+
+// Reads after reads in the same layout need nothing, and a read only waits for a write it cannot see yet
+static void track_use(
+    barrier_batch *batch, render_graph_resource resource, resource_state *state, const usage_info *info
+)
+{
+    bool needed = state->layout != info->layout;
+    if (info->write_access)
+        needed = needed || state->write_stages || state->read_stages;
+    else
+        needed = needed || (state->write_access && (info->stages & ~state->visible_stages));
+    if (needed)
+        add_transition(batch, resource, state, info->stages, info->access, info->layout);
+
+    state->layout = info->layout;
+    if (info->write_access) {
+        state->write_stages = info->stages;
+        state->write_access = info->write_access;
+        state->visible_stages = info->stages;
+        state->read_stages = 0;
+    } else {
+        if (needed)
+            state->visible_stages |= info->stages;
+        state->read_stages |= info->stages;
+    }
+}
+
+// The first use of a transient in a frame discards its content, after whatever used its memory last: the previous
+// frame for the image itself, or an image aliasing it
+__attribute__((pure)) static resource_state initial_state(const render_graph *graph, const graph_resource *resource)
+{
+    resource_state state = { 0 };
+    if (resource->imported) {
+        state.layout = resource->initial_layout;
+        state.write_stages = resource->initial_stages;
+        return state;
+    }
+    state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    for (uint32_t i = 0; i < graph->resource_count; i++) {
+        const graph_resource *other = &graph->resources[i];
+        if (!share_memory(graph, resource, other))
+            continue;
+        state.write_stages |= other->frame_stages;
+        state.write_access |= other->frame_writes;
+    }
+    return state;
+}
+
+static uint32_t compute_barriers(render_graph *graph)
+{
+    resource_state states[RENDER_GRAPH_MAX_RESOURCES];
+    for (uint32_t i = 0; i < graph->resource_count; i++)
+        states[i] = initial_state(graph, &graph->resources[i]);
+
+    uint32_t barrier_count = 0;
+    for (uint32_t p = 0; p < graph->pass_count; p++) {
+        graph_pass *pass = &graph->passes[p];
+        if (pass->culled)
+            continue;
+        for (uint32_t u = 0; u < pass->use_count; u++) {
+            render_graph_resource resource = pass->uses[u].resource;
+            track_use(&pass->barriers, resource, &states[resource], &USAGES[pass->uses[u].usage]);
+        }
+        barrier_count += pass->barriers.count > 0;
+    }
+
+    for (uint32_t i = 0; i < graph->resource_count; i++) {
+        const graph_resource *resource = &graph->resources[i];
+        if (!resource->imported || resource->first_pass == UNUSED_PASS)
+            continue;
+        if (resource->final_layout == VK_IMAGE_LAYOUT_UNDEFINED || resource->final_layout == states[i].layout)
+            continue;
+        add_transition(
+            &graph->final_barriers, i, &states[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, resource->final_layout
+        );
+    }
+    barrier_count += graph->final_barriers.count > 0;
+    return barrier_count;
+}
+
+bool render_graph_compile(render_graph *graph)
+{
+    if (graph->invalid)
+        return false;
+
+    uint32_t kept = cull_passes(graph);
+    compute_lifetimes(graph);
+    VkResult result = create_transient_images(graph);
+    if (result == VK_SUCCESS)
+        result = allocate_transients(graph);
+    if (result != VK_SUCCESS) {
+        log_error("Could not create the render graph transients: %d", result);
+        return false;
+    }
+    uint32_t barrier_count = compute_barriers(graph);
+    log_debug(
+        "Compiled the render graph, %u of %u passes kept with %u barriers", kept, graph->pass_count, barrier_count
+    );
+    return true;
+}
+
+__attribute__((pure)) VkImageView render_graph_image_view(const render_graph *graph, render_graph_resource resource)
+{
+    return graph->resources[resource].view;
+}
+
+__attribute__((pure)) VkImage render_graph_image(const render_graph *graph, render_graph_resource resource)
+{
+    return graph->resources[resource].image;
+}
+
+void render_graph_bind_image(render_graph *graph, render_graph_resource resource, VkImage image)
+{
+    graph->resources[resource].image = image;
+}
+
+static void cmd_barriers(const render_graph *graph, VkCommandBuffer command_buffer, const barrier_batch *batch)
+{
+    if (!batch->count)
+        return;
+    VkImageMemoryBarrier barriers[RENDER_GRAPH_MAX_RESOURCES];
+    for (uint32_t i = 0; i < batch->count; i++) {
+        const image_transition *transition = &batch->transitions[i];
+        const graph_resource *resource = &graph->resources[transition->resource];
+        VkImageMemoryBarrier *barrier = &barriers[i];
+        *barrier = (VkImageMemoryBarrier){ 0 };
+        barrier->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier->srcAccessMask = transition->src_access;
+        barrier->dstAccessMask = transition->dst_access;
+        barrier->oldLayout = transition->old_layout;
+        barrier->newLayout = transition->new_layout;
+        barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier->image = resource->image;
+        barrier->subresourceRange.aspectMask = format_aspect(resource->format);
+        barrier->subresourceRange.levelCount = 1;
+        barrier->subresourceRange.layerCount = 1;
+    }
+    // Nothing to wait for on the first use of an imported image without initial stages
+    VkPipelineStageFlags src_stages = batch->src_stages ? batch->src_stages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    vkCmdPipelineBarrier(command_buffer, src_stages, batch->dst_stages, 0, 0, NULL, 0, NULL, batch->count, barriers);
+}
+
+void render_graph_execute(const render_graph *graph, VkCommandBuffer command_buffer, gpu_profiler *profiler, void *user)
+{
+    for (uint32_t p = 0; p < graph->pass_count; p++) {
+        const graph_pass *pass = &graph->passes[p];
+        if (pass->culled)
+            continue;
+        uint32_t scope = gpu_profiler_begin_scope(profiler, command_buffer, pass->name);
+        cmd_barriers(graph, command_buffer, &pass->barriers);
+        pass->record(command_buffer, user);
+        gpu_profiler_end_scope(profiler, command_buffer, scope);
+    }
+    cmd_barriers(graph, command_buffer, &graph->final_barriers);
+}
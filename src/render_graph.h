@@ -0,0 +1,73 @@
+#ifndef RENDER_GRAPH_H
+#define RENDER_GRAPH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "gpu_memory.h"
+#include "gpu_profiler.h"
+
+#define RENDER_GRAPH_MAX_RESOURCES 16
+#define RENDER_GRAPH_MAX_PASSES 16
+// Images a single pass may use
+#define RENDER_GRAPH_MAX_USES 8
+
+// Passes of a frame declared with the images they use, in the order they run. Compiling the graph drops the passes
+// that nothing depends on, works out every layout transition and barrier between the passes once, and places the
+// transient images whose lifetimes do not overlap in the same memory. Executing it then only records the precomputed
+// barriers around the passes. Buffers are not tracked, the passes synchronize their own.
+typedef struct render_graph render_graph;
+
+typedef uint32_t render_graph_resource;
+
+typedef enum {
+    RENDER_GRAPH_COLOR_ATTACHMENT,
+    RENDER_GRAPH_DEPTH_ATTACHMENT,
+    RENDER_GRAPH_DEPTH_READ,
+    RENDER_GRAPH_SAMPLED,
+    RENDER_GRAPH_TRANSFER_SRC,
+    RENDER_GRAPH_TRANSFER_DST,
+    RENDER_GRAPH_USAGE_COUNT,
+} render_graph_usage;
+
+// user is what was given to render_graph_execute. The image is already in the layout of the declared usage and
+// must be left in it.
+typedef void (*render_graph_record_fn)(VkCommandBuffer command_buffer, void *user);
+
+render_graph *render_graph_create(VkDevice device, gpu_allocator *allocator);
+void render_graph_destroy(render_graph *graph);
+
+// An image owned outside of the graph, bound with render_graph_bind_image before every execution. Its content is
+// kept, so the passes writing it are never culled. initial_stages are the stages that must be done with it before
+// the first pass, such as the wait on the acquire semaphore. Left in final_layout, or in the layout of its last use
+// when that is VK_IMAGE_LAYOUT_UNDEFINED.
+render_graph_resource render_graph_import_image(
+    render_graph *graph, const char *name, VkFormat format, VkImageLayout initial_layout,
+    VkPipelineStageFlags initial_stages, VkImageLayout final_layout
+);
+// An image created by the graph, only valid from its first use to its last in a frame. Its usage flags follow from
+// the passes using it.
+render_graph_resource render_graph_create_image(
+    render_graph *graph, const char *name, VkFormat format, VkExtent2D extent
+);
+
+// name must outlive the graph. Passes with side effects, e.g. writing buffers read by the host or by later passes,
+// are never culled.
+uint32_t render_graph_add_pass(render_graph *graph, const char *name, render_graph_record_fn record, bool side_effect);
+void render_graph_use(render_graph *graph, uint32_t pass, render_graph_resource resource, render_graph_usage usage);
+
+// Once every pass is declared. Creates and binds the transient images, false if that fails.
+bool render_graph_compile(render_graph *graph);
+// Of a transient image, VK_NULL_HANDLE when its passes were culled
+__attribute__((pure)) VkImageView render_graph_image_view(const render_graph *graph, render_graph_resource resource);
+// Transient images are created by render_graph_compile, imported ones are what was last bound
+__attribute__((pure)) VkImage render_graph_image(const render_graph *graph, render_graph_resource resource);
+
+void render_graph_bind_image(render_graph *graph, render_graph_resource resource, VkImage image);
+// Records the passes that were kept, each in a profiler scope named after it
+void render_graph_execute(
+    const render_graph *graph, VkCommandBuffer command_buffer, gpu_profiler *profiler, void *user
+);
+
+#endif
@@ -0,0 +1,41 @@
+#include <math.h>
+
+#include "resolution_controller.h"
+
+void resolution_controller_init(resolution_controller *controller, float min_scale, float max_scale, double budget_ms)
+{
+    controller->min_scale = min_scale < max_scale ? min_scale : max_scale;
+    controller->max_scale = max_scale;
+    controller->scale = max_scale;
+    controller->budget_ms = budget_ms;
+    controller->full_scale_ms = 0.0;
+}
+
+float resolution_controller_update(resolution_controller *controller, double gpu_ms, float frame_scale)
+{
+    if (controller->budget_ms <= 0.0 || gpu_ms <= 0.0 || frame_scale <= 0.0f)
+        return controller->scale;
+
+    double full_scale_ms = gpu_ms / ((double) frame_scale * frame_scale);
+    if (controller->full_scale_ms == 0.0)
+        controller->full_scale_ms = full_scale_ms;
+    else
+        controller->full_scale_ms += RESOLUTION_SMOOTHING * (full_scale_ms - controller->full_scale_ms);
+
+    float ideal = (float) sqrt(RESOLUTION_TARGET * controller->budget_ms / controller->full_scale_ms);
+    float delta = ideal - controller->scale;
+    if (fabsf(delta) < RESOLUTION_DEAD_BAND)
+        return controller->scale;
+    if (delta < -RESOLUTION_STEP_DOWN)
+        delta = -RESOLUTION_STEP_DOWN;
+    if (delta > RESOLUTION_STEP_UP)
+        delta = RESOLUTION_STEP_UP;
+
+    float scale = controller->scale + delta;
+    if (scale < controller->min_scale)
+        scale = controller->min_scale;
+    if (scale > controller->max_scale)
+        scale = controller->max_scale;
+    controller->scale = scale;
+    return scale;
+}
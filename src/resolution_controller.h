@@ -0,0 +1,32 @@
+#ifndef RESOLUTION_CONTROLLER_H
+#define RESOLUTION_CONTROLLER_H
+
+// Weight of the newest frame in the moving average of the GPU cost
+#define RESOLUTION_SMOOTHING 0.2
+// Fraction of the budget the controller aims for, leaves room for the noise of the timings
+#define RESOLUTION_TARGET 0.9
+// Largest change of the scale per frame. Going down is faster so that a load spike costs few frames over budget.
+#define RESOLUTION_STEP_DOWN 0.1f
+#define RESOLUTION_STEP_UP 0.02f
+// Changes smaller than this are ignored, so the scale settles instead of jittering
+#define RESOLUTION_DEAD_BAND 0.01f
+
+// Picks the render scale, the fraction of the output resolution along each axis, that holds the GPU frame time under a
+// budget. The GPU time is assumed proportional to the pixel count, so it is divided by the square of the scale a frame
+// was rendered at before being averaged, which makes measurements at different scales comparable.
+typedef struct {
+    float min_scale;
+    float max_scale;
+    float scale;
+    // 0 keeps the scale at max_scale
+    double budget_ms;
+    // Moving average of the GPU time of a frame at scale 1, 0 before the first measurement
+    double full_scale_ms;
+} resolution_controller;
+
+// Scales are in (0, 1], min_scale is lowered to max_scale when above it
+void resolution_controller_init(resolution_controller *controller, float min_scale, float max_scale, double budget_ms);
+// Feeds the GPU time of a frame rendered at frame_scale, 0 when it has none, and returns the scale of the next frame
+float resolution_controller_update(resolution_controller *controller, double gpu_ms, float frame_scale);
+
+#endif
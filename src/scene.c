@@ -0,0 +1,198 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <cglm/affine.h>
+#include <cglm/vec4.h>
+
+#include "log.h"
+#include "scene.h"
+
+// Nodes updated per job, the matrix work per node is small
+#define SCENE_UPDATE_GRAIN 4096
+
+struct scene_graph {
+    uint32_t capacity;
+    uint32_t count;
+    // Translations with w at 1, so that they can be stored as the last column directly
+    vec4 *positions;
+    versor *rotations;
+    // w is unused, only there to keep every element on its own 16 bytes
+    vec4 *scales;
+    uint32_t *parents;
+    mat4 *locals;
+    mat4 *worlds;
+    // Set by the setters, cleared once the local matrix is rebuilt
+    uint8_t *local_dirty;
+    // Whether the world matrix changed in the last update, read by the children in the next level
+    uint8_t *world_changed;
+    uint32_t level_count;
+    uint32_t level_start[SCENE_MAX_LEVELS];
+};
+
+typedef struct {
+    scene_graph *scene;
+    uint32_t first;
+} level_update;
+
+// Cache line aligned so that the vectorized loads and stores of cglm never straddle lines
+static void *alloc_array(uint32_t count, size_t size)
+{
+    size_t bytes = ((size_t) count * size + 63) & ~(size_t) 63;
+    return aligned_alloc(64, bytes ? bytes : 64);
+}
+
+scene_graph *scene_create(uint32_t capacity)
+{
+    scene_graph *scene = calloc(1, sizeof *scene);
+    if (!scene)
+        return NULL;
+    scene->capacity = capacity;
+    scene->positions = alloc_array(capacity, sizeof *scene->positions);
+    scene->rotations = alloc_array(capacity, sizeof *scene->rotations);
+    scene->scales = alloc_array(capacity, sizeof *scene->scales);
+    scene->parents = alloc_array(capacity, sizeof *scene->parents);
+    scene->locals = alloc_array(capacity, sizeof *scene->locals);
+    scene->worlds = alloc_array(capacity, sizeof *scene->worlds);
+    scene->local_dirty = alloc_array(capacity, sizeof *scene->local_dirty);
+    scene->world_changed = alloc_array(capacity, sizeof *scene->world_changed);
+    if (!scene->positions || !scene->rotations || !scene->scales || !scene->parents || !scene->locals || !scene->worlds
+        || !scene->local_dirty || !scene->world_changed) {
+        scene_destroy(scene);
+        return NULL;
+    }
+    return scene;
+}
+
+void scene_destroy(scene_graph *scene)
+{
+    if (!scene)
+        return;
+    free(scene->positions);
+    free(scene->rotations);
+    free(scene->scales);
+    free(scene->parents);
+    free(scene->locals);
+    free(scene->worlds);
+    free(scene->local_dirty);
+    free(scene->world_changed);
+    free(scene);
+}
+
+__attribute__((pure)) static uint32_t level_of(const scene_graph *scene, uint32_t node)
+{
+    uint32_t level = scene->level_count - 1;
+    while (scene->level_start[level] > node)
+        level--;
+    return level;
+}
+
+uint32_t scene_add(scene_graph *scene, uint32_t parent)
+{
+    if (scene->count == scene->capacity) {
+        log_error("The scene is full at %u nodes", scene->capacity);
+        return SCENE_NO_PARENT;
+    }
+    uint32_t level = 0;
+    if (parent != SCENE_NO_PARENT) {
+        if (parent >= scene->count) {
+            log_error("Node %u does not exist", parent);
+            return SCENE_NO_PARENT;
+        }
+        level = level_of(scene, parent) + 1;
+    }
+    // Either the deepest level continues or a new one starts below it
+    bool in_order = scene->level_count == 0 ? level == 0
+                                            : level + 1 >= scene->level_count && level <= scene->level_count;
+    if (!in_order || level >= SCENE_MAX_LEVELS) {
+        log_error("A node of level %u cannot follow level %u", level, scene->level_count - 1);
+        return SCENE_NO_PARENT;
+    }
+    if (level == scene->level_count)
+        scene->level_start[scene->level_count++] = scene->count;
+
+    uint32_t node = scene->count++;
+    glm_vec4_copy((vec4) { 0.0f, 0.0f, 0.0f, 1.0f }, scene->positions[node]);
+    glm_quat_identity(scene->rotations[node]);
+    glm_vec4_copy((vec4) { 1.0f, 1.0f, 1.0f, 0.0f }, scene->scales[node]);
+    scene->parents[node] = parent;
+    scene->local_dirty[node] = 1;
+    scene->world_changed[node] = 0;
+    return node;
+}
+
+__attribute__((pure)) uint32_t scene_node_count(const scene_graph *scene)
+{
+    return scene->count;
+}
+
+void scene_set_position(scene_graph *scene, uint32_t node, vec3 position)
+{
+    glm_vec3_copy(position, scene->positions[node]);
+    scene->local_dirty[node] = 1;
+}
+
+void scene_set_rotation(scene_graph *scene, uint32_t node, versor rotation)
+{
+    glm_vec4_copy(rotation, scene->rotations[node]);
+    scene->local_dirty[node] = 1;
+}
+
+void scene_set_scale(scene_graph *scene, uint32_t node, vec3 scale)
+{
+    glm_vec3_copy(scale, scene->scales[node]);
+    scene->local_dirty[node] = 1;
+}
+
+// Translation * rotation * scale, the scale applied to the rotation columns with vector multiplies
+static void compose_local(scene_graph *scene, uint32_t node)
+{
+    mat4 *local = &scene->locals[node];
+    glm_quat_mat4(scene->rotations[node], *local);
+    glm_vec4_scale((*local)[0], scene->scales[node][0], (*local)[0]);
+    glm_vec4_scale((*local)[1], scene->scales[node][1], (*local)[1]);
+    glm_vec4_scale((*local)[2], scene->scales[node][2], (*local)[2]);
+    glm_vec4_copy(scene->positions[node], (*local)[3]);
+}
+
+// The level of the parents is complete, so a node only has to look at its own flags and those of its parent
+static void update_level_range(void *user, uint32_t begin, uint32_t end, uint32_t thread)
+{
+    (void) thread;
+    const level_update *update = user;
+    scene_graph *scene = update->scene;
+
+    for (uint32_t node = update->first + begin; node < update->first + end; node++) {
+        uint32_t parent = scene->parents[node];
+        bool parent_changed = parent != SCENE_NO_PARENT && scene->world_changed[parent];
+        if (!scene->local_dirty[node] && !parent_changed) {
+            scene->world_changed[node] = 0;
+            continue;
+        }
+        if (scene->local_dirty[node]) {
+            compose_local(scene, node);
+            scene->local_dirty[node] = 0;
+        }
+        // Both are affine, glm_mul skips the last row that glm_mat4_mul would compute
+        if (parent == SCENE_NO_PARENT)
+            glm_mat4_copy(scene->locals[node], scene->worlds[node]);
+        else
+            glm_mul(scene->worlds[parent], scene->locals[node], scene->worlds[node]);
+        scene->world_changed[node] = 1;
+    }
+}
+
+void scene_update(scene_graph *scene, job_system *jobs)
+{
+    for (uint32_t level = 0; level < scene->level_count; level++) {
+        level_update update = { 0 };
+        update.scene = scene;
+        update.first = scene->level_start[level];
+        uint32_t end = level + 1 < scene->level_count ? scene->level_start[level + 1] : scene->count;
+        jobs_parallel_for(jobs, update_level_range, &update, end - update.first, SCENE_UPDATE_GRAIN);
+    }
+}
+
+__attribute__((pure)) const mat4 *scene_world_matrices(const scene_graph *scene)
+{
+    return (const mat4 *) scene->worlds;
+}
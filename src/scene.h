@@ -0,0 +1,42 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdint.h>
+
+#include <cglm/mat4.h>
+#include <cglm/quat.h>
+#include <cglm/vec3.h>
+
+#include "jobs.h"
+
+#define SCENE_NO_PARENT UINT32_MAX
+// Depth of the deepest hierarchy, roots are level 0
+#define SCENE_MAX_LEVELS 32
+
+// Hierarchy of transforms stored as structure of arrays, one array per component indexed by node.
+// Nodes are added parents first and level by level, so every level is a contiguous range that directly follows the
+// level of its parents. The update walks the levels in order, splits each level across the job system and only
+// recomputes the nodes whose transform changed or whose parent's world matrix did.
+typedef struct scene_graph scene_graph;
+
+scene_graph *scene_create(uint32_t capacity);
+void scene_destroy(scene_graph *scene);
+
+// Adds a node with the identity transform and returns its index. The parent must be SCENE_NO_PARENT while no other
+// level exists, or a node of the deepest level or the one above it. Returns SCENE_NO_PARENT when the scene is full or
+// the parent breaks the level order.
+uint32_t scene_add(scene_graph *scene, uint32_t parent);
+__attribute__((pure)) uint32_t scene_node_count(const scene_graph *scene);
+
+// Setters only flag their own node, different nodes may be set from different threads
+void scene_set_position(scene_graph *scene, uint32_t node, vec3 position);
+void scene_set_rotation(scene_graph *scene, uint32_t node, versor rotation);
+void scene_set_scale(scene_graph *scene, uint32_t node, vec3 scale);
+
+// Recomputes the world matrices of the nodes set since the last update and of all their descendants.
+// Must not run concurrently with the setters.
+void scene_update(scene_graph *scene, job_system *jobs);
+// Indexed by node, valid until the next update
+__attribute__((pure)) const mat4 *scene_world_matrices(const scene_graph *scene);
+
+#endif
@@ -0,0 +1,117 @@
+#define _XOPEN_SOURCE 600
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "array_helper_macros.h"
+#include "log.h"
+#include "shader_code.h"
+
+#define SPIRV_MAGIC 0x07230203u
+// Magic, version, generator, bound and schema
+#define SPIRV_HEADER_WORDS 5
+
+#ifdef EMBED_SHADERS
+// Defined in shader_blobs.S
+extern const uint32_t vert_spv[];
+extern const char vert_spv_end[];
+extern const uint32_t frag_spv[];
+extern const char frag_spv_end[];
+extern const uint32_t particles_comp_spv[];
+extern const char particles_comp_spv_end[];
+extern const uint32_t particles_vert_spv[];
+extern const char particles_vert_spv_end[];
+extern const uint32_t cull_comp_spv[];
+extern const char cull_comp_spv_end[];
+
+typedef struct {
+    const char *name;
+    const uint32_t *start;
+    const char *end;
+} embedded_shader;
+
+static const embedded_shader EMBEDDED_SHADERS[] = {
+    { "vert", vert_spv, vert_spv_end },
+    { "frag", frag_spv, frag_spv_end },
+    { "particles_comp", particles_comp_spv, particles_comp_spv_end },
+    { "particles_vert", particles_vert_spv, particles_vert_spv_end },
+    { "cull_comp", cull_comp_spv, cull_comp_spv_end },
+};
+#endif
+
+static bool validate(const char *name, const uint32_t *code, size_t size)
+{
+    if (size % sizeof(uint32_t) != 0 || size < SPIRV_HEADER_WORDS * sizeof(uint32_t)) {
+        log_error("Shader %s is %lu bytes, not a whole number of SPIR-V words with a header", name, size);
+        return false;
+    }
+    if (code[0] != SPIRV_MAGIC) {
+        log_error("Shader %s does not start with the SPIR-V magic number (0x%08x)", name, code[0]);
+        return false;
+    }
+    return true;
+}
+
+static bool map_file(const char *name, shader_code *shader)
+{
+    char path[256];
+    snprintf(path, sizeof path, "shaders/%s.spv", name);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("Could not open %s", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        log_error("Could not get the size of %s", path);
+        close(fd);
+        return false;
+    }
+    // Mappings are page aligned, which satisfies the uint32_t alignment of pCode
+    void *mapping = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        log_error("Could not map %s", path);
+        return false;
+    }
+
+    shader->code = mapping;
+    shader->size = (size_t) st.st_size;
+    shader->mapping = mapping;
+    return true;
+}
+
+bool shader_code_load(const char *name, shader_code *shader)
+{
+    memset(shader, 0, sizeof *shader);
+#ifdef EMBED_SHADERS
+    for (size_t i = 0; i < LENGTH_OF(EMBEDDED_SHADERS); i++) {
+        if (strcmp(EMBEDDED_SHADERS[i].name, name) != 0)
+            continue;
+        shader->code = EMBEDDED_SHADERS[i].start;
+        shader->size = (size_t) (EMBEDDED_SHADERS[i].end - (const char *) EMBEDDED_SHADERS[i].start);
+        break;
+    }
+#endif
+    if (!shader->code && !map_file(name, shader))
+        return false;
+
+    if (!validate(name, shader->code, shader->size)) {
+        shader_code_release(shader);
+        return false;
+    }
+    log_debug("Loaded %s shader, %lu bytes %s", name, shader->size, shader->mapping ? "mapped" : "embedded");
+    return true;
+}
+
+void shader_code_release(shader_code *shader)
+{
+    if (shader->mapping)
+        munmap(shader->mapping, shader->size);
+    memset(shader, 0, sizeof *shader);
+}
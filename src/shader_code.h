@@ -0,0 +1,22 @@
+#ifndef SHADER_CODE_H
+#define SHADER_CODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// SPIR-V of one shader, either embedded into the binary or mapped from shaders/<name>.spv. Both are at least 4 byte
+// aligned and used in place, nothing is copied.
+typedef struct {
+    const uint32_t *code;
+    // Bytes
+    size_t size;
+    // NULL for embedded code
+    void *mapping;
+} shader_code;
+
+// name is the file name without .spv, e.g. "vert". Fails if the code is missing or not valid SPIR-V.
+bool shader_code_load(const char *name, shader_code *shader);
+void shader_code_release(shader_code *shader);
+
+#endif
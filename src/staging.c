@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "staging.h"
+
+// Copies start on this alignment, which covers optimalBufferCopyOffsetAlignment on every known device
+#define STAGING_ALIGNMENT 256ull
+
+typedef struct {
+    VkCommandBuffer command_buffer;
+    // Timeline value signalled when the copies of the batch are done
+    uint64_t value;
+    // Ring offset right after the last byte of the batch
+    VkDeviceSize end;
+} staging_batch;
+
+typedef struct {
+    VkBuffer buffer;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    VkPipelineStageFlags dst_stages;
+    VkAccessFlags dst_access;
+    uint64_t value;
+} staging_transfer;
+
+struct staging_ring {
+    VkDevice device;
+    gpu_allocator *allocator;
+    VkQueue queue;
+    uint32_t queue_family;
+    uint32_t graphics_family;
+    VkCommandPool command_pool;
+    VkSemaphore timeline;
+    // Value the open batch will signal, every earlier value has been submitted
+    uint64_t next_value;
+
+    VkBuffer buffer;
+    gpu_allocation memory;
+    VkDeviceSize size;
+    // Bytes in [tail, head), wrapping around, belong to batches that are not retired yet
+    VkDeviceSize head;
+    VkDeviceSize tail;
+
+    staging_batch batches[STAGING_MAX_BATCHES];
+    uint32_t first_batch;
+    uint32_t submitted_count;
+    bool batch_open;
+    uint32_t open_copy_count;
+
+    // Uploads whose ownership still has to be released (open batch) or acquired (submitted batches)
+    staging_transfer *transfers;
+    uint32_t transfer_count;
+    uint32_t transfer_capacity;
+};
+
+__attribute__((const)) static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+staging_ring *staging_create(
+    VkDevice device, gpu_allocator *allocator, VkQueue queue, uint32_t queue_family, uint32_t graphics_family,
+    VkDeviceSize size
+)
+{
+    staging_ring *ring = calloc(1, sizeof *ring);
+    if (!ring)
+        return NULL;
+    ring->device = device;
+    ring->allocator = allocator;
+    ring->queue = queue;
+    ring->queue_family = queue_family;
+    ring->graphics_family = graphics_family;
+    ring->size = size;
+    ring->next_value = 1;
+
+    VkCommandPoolCreateInfo pool_info = { 0 };
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_info.queueFamilyIndex = queue_family;
+    VkResult result = vkCreateCommandPool(device, &pool_info, NULL, &ring->command_pool);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    VkCommandBuffer command_buffers[STAGING_MAX_BATCHES];
+    VkCommandBufferAllocateInfo alloc_info = { 0 };
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = ring->command_pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = STAGING_MAX_BATCHES;
+    result = vkAllocateCommandBuffers(device, &alloc_info, command_buffers);
+    if (result != VK_SUCCESS)
+        goto fail;
+    for (uint32_t i = 0; i < STAGING_MAX_BATCHES; i++)
+        ring->batches[i].command_buffer = command_buffers[i];
+
+    VkSemaphoreTypeCreateInfo type_info = { 0 };
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type_info.initialValue = 0;
+    VkSemaphoreCreateInfo semaphore_info = { 0 };
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &type_info;
+    result = vkCreateSemaphore(device, &semaphore_info, NULL, &ring->timeline);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    VkBufferCreateInfo buffer_info = { 0 };
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = size;
+    buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    gpu_allocation_desc desc = { 0 };
+    desc.required_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    desc.dedicated = true;
+    result = gpu_memory_create_buffer(allocator, &buffer_info, &desc, &ring->buffer, &ring->memory);
+    if (result != VK_SUCCESS)
+        goto fail;
+
+    log_debug(
+        "Created a %lu MiB staging ring on queue family %u (graphics on %u)", size >> 20, queue_family,
+        graphics_family
+    );
+    return ring;
+
+fail:
+    log_error("Could not create the staging ring (%d)", result);
+    staging_destroy(ring);
+    return NULL;
+}
+
+void staging_destroy(staging_ring *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->next_value > 1) {
+        VkSemaphoreWaitInfo wait_info = { 0 };
+        wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        wait_info.semaphoreCount = 1;
+        wait_info.pSemaphores = &ring->timeline;
+        uint64_t last_value = ring->next_value - 1;
+        wait_info.pValues = &last_value;
+        vkWaitSemaphores(ring->device, &wait_info, UINT64_MAX);
+    }
+    if (ring->buffer != VK_NULL_HANDLE)
+        gpu_memory_destroy_buffer(ring->allocator, ring->buffer, &ring->memory);
+    vkDestroySemaphore(ring->device, ring->timeline, NULL);
+    vkDestroyCommandPool(ring->device, ring->command_pool, NULL);
+    free(ring->transfers);
+    free(ring);
+}
+
+bool staging_is_complete(const staging_ring *ring, uint64_t value)
+{
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(ring->device, ring->timeline, &completed);
+    return completed >= value;
+}
+
+static void retire_batches(staging_ring *ring)
+{
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(ring->device, ring->timeline, &completed);
+
+    while (ring->submitted_count && ring->batches[ring->first_batch].value <= completed) {
+        ring->tail = ring->batches[ring->first_batch].end;
+        ring->first_batch = (ring->first_batch + 1) % STAGING_MAX_BATCHES;
+        ring->submitted_count--;
+    }
+    // Restarting at 0 once everything retired avoids wrapping around with a mostly empty ring
+    if (!ring->submitted_count && !ring->open_copy_count)
+        ring->head = ring->tail = 0;
+}
+
+// Blocks until the oldest submitted batch retires, only happens when the ring is exhausted
+static void wait_oldest_batch(staging_ring *ring)
+{
+    VkSemaphoreWaitInfo wait_info = { 0 };
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &ring->timeline;
+    wait_info.pValues = &ring->batches[ring->first_batch].value;
+    vkWaitSemaphores(ring->device, &wait_info, UINT64_MAX);
+    retire_batches(ring);
+}
+
+static bool reserve(staging_ring *ring, VkDeviceSize size, VkDeviceSize *offset)
+{
+    VkDeviceSize start = align_up(ring->head, STAGING_ALIGNMENT);
+    bool empty = !ring->submitted_count && !ring->open_copy_count;
+
+    if (empty || ring->head > ring->tail) {
+        if (start + size <= ring->size) {
+            *offset = start;
+            return true;
+        }
+        // Skip the end of the ring, head == tail must keep meaning empty
+        if (size < ring->tail || empty) {
+            *offset = 0;
+            return true;
+        }
+        return false;
+    }
+    if (start + size < ring->tail) {
+        *offset = start;
+        return true;
+    }
+    return false;
+}
+
+static staging_batch *open_batch(staging_ring *ring)
+{
+    uint32_t index = (ring->first_batch + ring->submitted_count) % STAGING_MAX_BATCHES;
+    staging_batch *batch = &ring->batches[index];
+    if (ring->batch_open)
+        return batch;
+
+    if (ring->submitted_count == STAGING_MAX_BATCHES - 1)
+        wait_oldest_batch(ring);
+    index = (ring->first_batch + ring->submitted_count) % STAGING_MAX_BATCHES;
+    batch = &ring->batches[index];
+
+    vkResetCommandBuffer(batch->command_buffer, 0);
+    VkCommandBufferBeginInfo begin_info = { 0 };
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(batch->command_buffer, &begin_info);
+    batch->value = ring->next_value;
+    ring->batch_open = true;
+    ring->open_copy_count = 0;
+    return batch;
+}
+
+static void push_transfer(staging_ring *ring, const staging_transfer *transfer)
+{
+    if (ring->transfer_count == ring->transfer_capacity) {
+        uint32_t capacity = ring->transfer_capacity ? ring->transfer_capacity * 2 : 16;
+        staging_transfer *transfers = realloc(ring->transfers, capacity * sizeof *transfers);
+        if (!transfers) {
+            log_fatal("Out of memory for staging transfers");
+            abort();
+        }
+        ring->transfers = transfers;
+        ring->transfer_capacity = capacity;
+    }
+    ring->transfers[ring->transfer_count++] = *transfer;
+}
+
+uint64_t staging_upload_buffer(
+    staging_ring *ring, VkBuffer dst, VkDeviceSize dst_offset, const void *data, VkDeviceSize size,
+    VkPipelineStageFlags dst_stages, VkAccessFlags dst_access
+)
+{
+    // Chunks of a quarter of the ring keep the copy queue busy while the next chunk is written
+    const VkDeviceSize max_chunk = ring->size / 4;
+    const char *bytes = data;
+    uint64_t value = ring->next_value - 1;
+
+    while (size) {
+        VkDeviceSize chunk = size < max_chunk ? size : max_chunk;
+        VkDeviceSize offset;
+
+        retire_batches(ring);
+        staging_batch *batch = open_batch(ring);
+        while (!reserve(ring, chunk, &offset)) {
+            staging_flush(ring);
+            wait_oldest_batch(ring);
+            batch = open_batch(ring);
+        }
+        memcpy((char *) ring->memory.mapped + offset, bytes, chunk);
+        gpu_memory_flush(ring->allocator, &ring->memory, offset, chunk);
+
+        VkBufferCopy region = { 0 };
+        region.srcOffset = offset;
+        region.dstOffset = dst_offset;
+        region.size = chunk;
+        vkCmdCopyBuffer(batch->command_buffer, ring->buffer, dst, 1, &region);
+        ring->head = offset + chunk;
+        batch->end = ring->head;
+        ring->open_copy_count++;
+
+        staging_transfer transfer = { 0 };
+        transfer.buffer = dst;
+        transfer.offset = dst_offset;
+        transfer.size = chunk;
+        transfer.dst_stages = dst_stages;
+        transfer.dst_access = dst_access;
+        transfer.value = batch->value;
+        push_transfer(ring, &transfer);
+
+        value = batch->value;
+        bytes += chunk;
+        dst_offset += chunk;
+        size -= chunk;
+    }
+    return value;
+}
+
+static void fill_ownership_barrier(
+    const staging_ring *ring, const staging_transfer *transfer, VkBufferMemoryBarrier *barrier
+)
+{
+    memset(barrier, 0, sizeof *barrier);
+    barrier->sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier->srcQueueFamilyIndex = ring->queue_family;
+    barrier->dstQueueFamilyIndex = ring->graphics_family;
+    barrier->buffer = transfer->buffer;
+    barrier->offset = transfer->offset;
+    barrier->size = transfer->size;
+}
+
+void staging_flush(staging_ring *ring)
+{
+    if (!ring->batch_open || !ring->open_copy_count)
+        return;
+
+    uint32_t index = (ring->first_batch + ring->submitted_count) % STAGING_MAX_BATCHES;
+    staging_batch *batch = &ring->batches[index];
+
+    // Release half of the queue family ownership transfers, the graphics queue acquires them
+    if (ring->queue_family != ring->graphics_family) {
+        for (uint32_t i = 0; i < ring->transfer_count; i++) {
+            if (ring->transfers[i].value != batch->value)
+                continue;
+            VkBufferMemoryBarrier barrier;
+            fill_ownership_barrier(ring, &ring->transfers[i], &barrier);
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            vkCmdPipelineBarrier(
+                batch->command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0,
+                NULL, 1, &barrier, 0, NULL
+            );
+        }
+    }
+    VkResult result = vkEndCommandBuffer(batch->command_buffer);
+    if (result != VK_SUCCESS)
+        log_limited(LOG_ERROR, 1, 1000, "Could not record the staging copies (%d)", result);
+
+    VkTimelineSemaphoreSubmitInfo timeline_info = { 0 };
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &batch->value;
+
+    VkSubmitInfo submit_info = { 0 };
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &batch->command_buffer;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &ring->timeline;
+    result = vkQueueSubmit(ring->queue, 1, &submit_info, VK_NULL_HANDLE);
+    if (result != VK_SUCCESS)
+        log_limited(LOG_ERROR, 1, 1000, "Could not submit the staging copies (%d)", result);
+
+    ring->batch_open = false;
+    ring->open_copy_count = 0;
+    ring->submitted_count++;
+    ring->next_value++;
+}
+
+void staging_record_acquires(staging_ring *ring, VkCommandBuffer command_buffer, staging_wait *wait)
+{
+    wait->semaphore = ring->timeline;
+    wait->value = 0;
+    wait->stages = 0;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < ring->transfer_count; i++) {
+        const staging_transfer *transfer = &ring->transfers[i];
+        // Still in the open batch, the next flush releases it
+        if (transfer->value >= ring->next_value) {
+            ring->transfers[kept++] = *transfer;
+            continue;
+        }
+        if (transfer->value > wait->value)
+            wait->value = transfer->value;
+        wait->stages |= transfer->dst_stages;
+
+        if (ring->queue_family == ring->graphics_family)
+            continue;
+        VkBufferMemoryBarrier barrier;
+        fill_ownership_barrier(ring, transfer, &barrier);
+        barrier.dstAccessMask = transfer->dst_access;
+        vkCmdPipelineBarrier(
+            command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, transfer->dst_stages, 0, 0, NULL, 1, &barrier, 0, NULL
+        );
+    }
+    ring->transfer_count = kept;
+}
@@ -0,0 +1,49 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "gpu_memory.h"
+
+// Upper bound of copy batches submitted to the transfer queue and not yet retired
+#define STAGING_MAX_BATCHES 8
+
+// Persistently mapped ring of upload memory feeding copies on a transfer queue.
+// Each submitted batch signals the next value of a timeline semaphore, graphics submissions wait on the values of
+// the batches they consume instead of the CPU ever waiting on the copies.
+// Not thread safe, uploads and flushes are expected from the thread that records graphics work.
+typedef struct staging_ring staging_ring;
+
+// What a graphics submission must wait on before touching the uploaded data
+typedef struct {
+    VkSemaphore semaphore;
+    // 0 when there is nothing to wait for
+    uint64_t value;
+    VkPipelineStageFlags stages;
+} staging_wait;
+
+// queue may be the graphics queue when the device has no separate transfer family
+staging_ring *staging_create(
+    VkDevice device, gpu_allocator *allocator, VkQueue queue, uint32_t queue_family, uint32_t graphics_family,
+    VkDeviceSize size
+);
+void staging_destroy(staging_ring *ring);
+
+// Copies data into the ring and queues a copy to dst, split into several copies when it does not fit at once.
+// dst_stages and dst_access describe the first graphics use of the range.
+// Returns the timeline value signalled once the data is in dst.
+uint64_t staging_upload_buffer(
+    staging_ring *ring, VkBuffer dst, VkDeviceSize dst_offset, const void *data, VkDeviceSize size,
+    VkPipelineStageFlags dst_stages, VkAccessFlags dst_access
+);
+// Submits the copies queued since the last flush, a no-op if there are none
+void staging_flush(staging_ring *ring);
+bool staging_is_complete(const staging_ring *ring, uint64_t value);
+
+// Records the queue family ownership acquires of every flushed upload into a graphics command buffer and fills wait
+// with what the submission of that command buffer has to wait on
+void staging_record_acquires(staging_ring *ring, VkCommandBuffer command_buffer, staging_wait *wait);
+
+#endif